@@ -0,0 +1,52 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include "Utils.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/** A self-contained slice of history in one file: the refs it carries,
+ *  the commits the receiver must already have, and a pack holding every
+ *  object between the two.
+ *
+ *  The file starts with "GLBD" and a version (32-bit, big-endian), then
+ *  the number of refs followed by a length-prefixed name and commit id
+ *  per ref, the number of prerequisites followed by their ids, then the
+ *  pack and its index (see Pack), and last the 64-bit lengths of the two.
+ *  The lengths trail so the pack can be streamed into the file as it is
+ *  built.  The pack is stored exactly as it is installed, so unbundling
+ *  never decodes an object. */
+class Bundle {
+public:
+    struct Ref {
+        std::string name;
+        std::string commit_id;
+    };
+
+    std::vector<Ref> refs;
+    std::vector<std::string> prerequisites;
+    /** The pack and index of a bundle that was read, which point into
+     *  FILE, the bundle mapped whole. */
+    std::shared_ptr<MappedFile> file;
+    const unsigned char* pack = nullptr;
+    size_t pack_size = 0;
+    const unsigned char* index = nullptr;
+    size_t index_size = 0;
+
+    /** Streams a pack to the sink and stores its index in the string. */
+    typedef std::function<void(const Utils::ByteSink&, std::string&)> PackWriter;
+
+    /** Streams the bundle to PATH, its pack written by WRITE_PACK. */
+    void write(const std::string& path, const PackWriter& write_pack) const;
+
+    /** Reads the bundle at PATH; throws std::runtime_error if it is not one. */
+    static Bundle read(const std::string& path);
+
+    /** Transfers of fewer objects than this are copied as loose objects
+     *  rather than as a pack: GITLITE_UNPACK_LIMIT if set, else 100. */
+    static size_t unpack_limit();
+};
+
+#endif // BUNDLE_H
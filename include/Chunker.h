@@ -0,0 +1,38 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+/** Splits a byte stream at content-defined boundaries (FastCDC).
+ *
+ *  A gear hash is rolled over the data and a chunk ends where enough of
+ *  its high bits are zero, so an insertion or deletion only moves the
+ *  boundaries next to it and the chunks around an edit keep their ids.
+ *  Chunks are between MIN_SIZE and MAX_SIZE bytes; a stricter mask
+ *  below AVG_SIZE and a looser one above it pull sizes towards the
+ *  average ("normalized chunking").  Only the current chunk is buffered. */
+class Chunker {
+public:
+    static const size_t MIN_SIZE = 16 * 1024;
+    static const size_t AVG_SIZE = 64 * 1024;
+    static const size_t MAX_SIZE = 256 * 1024;
+
+    typedef std::function<void(const std::string& chunk)> Emit;
+
+    /** Files of at least this many bytes are stored chunked:
+     *  GITLITE_CHUNK_THRESHOLD if set (0 turns chunking off), else 4 MiB. */
+    static uint64_t threshold();
+
+    explicit Chunker(const Emit& emit);
+    void update(const char* data, size_t len);
+    void finish();
+
+private:
+    Emit emit;
+    std::string chunk;
+    uint64_t hash;
+};
+
+#endif // CHUNKER_H
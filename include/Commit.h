@@ -8,26 +8,43 @@
 #include<cmath>
 #include<ctime>
 #include<set>
+#include<functional>
+#include<memory>
+#include "Utils.h"
 
+/** A file's content.  Its id is the hash of "blob\n" followed by the
+ *  content alone, so equal files share one object whatever their paths;
+ *  the path lives in the tree.  Blobs written before that hashed the file
+ *  name too and stored the id and name in front of the content; they are
+ *  still read (see is_legacy) until `gitlite migrate` rewrites them. */
 class Blob{
 private :
     std::string sha_blob;
-    std::string file_name;
     std::string file_content;
 public :
     Blob() = default;
-    Blob(const std::string& file,const std::string content);
+    explicit Blob(const std::string& content);
     std::string get_sha() const;
-    std::string get_file_name() const;
     std::string get_file_content() const;
     std::string serialize() const;
-    static Blob deserialize(const std::string& content);
+    static Blob deserialize(const std::string& blob_id, const std::string& data);
+    static SHA1::SHA hasher();
+    static bool is_legacy(const std::string& blob_id, const std::string& data);
+};
+
+/** Stat information recorded when a working file was last hashed, so a
+ *  later add or status can skip rehashing files that did not change. */
+struct Cache_Entry{
+    std::string blob_id;
+    FileStat stat;
 };
 
 class Stage_Area{
 private:
     std::map<std::string, std::string> add_staged; // filename -> blobId
     std::set<std::string> remove_staged;
+    std::map<std::string, Cache_Entry> cache; // filename -> last hash
+    int64_t written_ns = 0; // when this index was last written
 public:
     void add(const std::string& file_name, const std::string& blob_sha);
     void mark_remove(const std::string& file_name);
@@ -39,6 +56,10 @@ public:
     bool empty() const;
     void clear();
 
+    void record(const std::string& file_name, const std::string& blob_id, const FileStat& st);
+    void forget(const std::string& file_name);
+    bool cached_blob(const std::string& file_name, const FileStat& st, std::string& blob_id) const;
+
     const std::map<std::string, std::string>& files() const;
     const std::set<std::string>& removedFiles() const;
 
@@ -46,25 +67,84 @@ public:
     static Stage_Area deserialize(const std::string& raw);
 };
 
+/** One directory level of a commit's files.  A tree names the blobs
+ *  directly in its directory and the trees of its subdirectories, and
+ *  its id is the hash of that listing, so an unchanged subdirectory keeps
+ *  its tree id and is shared between commits instead of rewritten. */
+class Tree{
+private :
+    std::map<std::string,std::string> blobs;    // name -> blob id
+    std::map<std::string,std::string> subtrees; // name -> tree id
+
+public:
+    void add_blob(const std::string& name, const std::string& blob_id);
+    void add_tree(const std::string& name, const std::string& tree_id);
+    void remove_blob(const std::string& name);
+    void remove_tree(const std::string& name);
+    bool empty() const;
+    const std::map<std::string,std::string>& get_blobs() const;
+    const std::map<std::string,std::string>& get_subtrees() const;
+    std::string get_id() const;
+
+    std::string serialize() const;
+    static Tree deserialize(const std::string& raw);
+};
+
+/** The files of a commit, read through its trees as they are needed.
+ *  Looking up one file loads only the trees on its path, and each of
+ *  those is loaded once however many lookups pass through it; copies
+ *  share what was loaded, so one FileTree must not be used from several
+ *  threads.  Commits stored before trees hold their whole file table
+ *  inline instead, and have no root. */
+class FileTree{
+public:
+    typedef std::function<std::string(const std::string&)> Loader; // tree id -> stored tree
+
+private :
+    std::string root;
+    Loader load;
+    std::shared_ptr<std::map<std::string,Tree>> trees; // tree id -> loaded tree
+    std::map<std::string,std::string> table;            // inline file table
+
+    const Tree& tree(const std::string& tree_id) const;
+    void flatten(const std::string& tree_id, const std::string& prefix,
+                 std::map<std::string,std::string>& files) const;
+
+public:
+    FileTree() = default;
+    explicit FileTree(std::map<std::string,std::string> files);
+    FileTree(std::string root_id, Loader loader);
+    const std::string& get_root() const;
+    bool find(const std::string& path, std::string& blob_id) const;
+    bool contains(const std::string& path) const;
+    std::map<std::string,std::string> files() const;
+};
+
+/** A commit.  Its id hashes the message, timestamp, parents and root
+ *  tree id, so making a commit never needs its full file table.  A
+ *  commit read back from the store also carries its files. */
 class Commit{
 private :
     std::string id;
     std::string message;
     std::time_t timestamp;
     std::vector<std::string> formers;
-    std::map<std::string,std::string> blobs_commit;
+    std::string tree;
+    FileTree files;
 
 public:
     Commit();
     Commit(const std::string& msg,const std::vector<std::string>& former ,
-            const std::map<std::string,std::string>& blobs,const Stage_Area& stage,
-            const std::time_t& tm = std::time(nullptr));
-    static Commit initial_commit();
+            const std::string& tree_id, const std::time_t& tm = std::time(nullptr));
+    static Commit initial_commit(const std::string& tree_id);
     const std::string& get_id() const;
+    std::string compute_id() const;
     const std::string& get_message() const;
     const std::time_t& get_timestamp() const;
     const std::vector<std::string> get_formers() const;
-    const std::map<std::string,std::string>& get_blobs_commit() const;
+    const std::string& get_tree() const;
+    const FileTree& get_files() const;
+    void set_files(const FileTree& f);
 
     std::string serialize() const;
     static Commit deserialize(const std::string& raw);
@@ -75,4 +155,31 @@ public:
 
 
 
+/** Read-only view of a stored commit that keeps the object bytes as
+ *  they were loaded.  The id, message, timestamp and parents are located
+ *  up front; the file table is only parsed when asked for, so history
+ *  walks that look at parents and messages never build a file map.
+ *  Commits that reference a root tree have no inline file table; their
+ *  files are read through the tree. */
+class CommitView{
+private :
+    std::string raw;
+    size_t message_begin = 0;
+    size_t message_end = 0;
+    std::time_t timestamp = 0;
+    std::vector<std::string> formers;
+    std::string tree;
+    size_t files_begin = 0;
+
+public:
+    explicit CommitView(std::string data);
+    std::string get_id() const;
+    std::string get_message() const;
+    bool message_equals(const std::string& msg) const;
+    const std::time_t& get_timestamp() const;
+    const std::vector<std::string>& get_formers() const;
+    const std::string& get_tree() const;
+    std::map<std::string,std::string> get_blobs_commit() const;
+};
+
 #endif // COMMIT_H
@@ -0,0 +1,69 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+#include "Utils.h"
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+/** The commit-graph file: the shape of the whole history in one table.
+ *
+ *  .gitlite/commit-graph starts with "GLCG", a version and the number of
+ *  sorted commits (32-bit, big-endian).  Each 40-byte entry that follows
+ *  holds a raw commit id, its generation number (1 for root commits,
+ *  otherwise one more than its highest parent), its timestamp and the
+ *  positions of up to two parents in the table.  Sorted entries are
+ *  ordered by id, so a commit is found by binary search and its ancestors
+ *  by following positions, without loading any commit object.
+ *
+ *  New commits are appended after the sorted entries as an unsorted tail,
+ *  parents first, which lookups scan; positions into the table stay valid
+ *  as it grows.  The tail is merged into the sorted entries once it would
+ *  pass TAIL_LIMIT commits, and whenever the graph is rebuilt (as gc
+ *  does). */
+class CommitGraph {
+private:
+    std::string graphPath;
+    static const uint32_t TAIL_LIMIT = 1024;
+
+public:
+    static const uint32_t NONE = 0xffffffffu;
+
+    struct Node {
+        std::string id;
+        std::vector<std::string> parents;
+        std::time_t timestamp;
+    };
+
+    /** A mapped, read-only snapshot of the graph. */
+    class View {
+    private:
+        MappedFile file;
+        uint32_t count; // sorted entries
+        uint32_t total; // sorted and tail entries
+        const unsigned char* entry(uint32_t pos) const;
+    public:
+        explicit View(const std::string& path);
+        uint32_t size() const;
+        uint32_t sorted_size() const;
+        bool find(const std::string& id, uint32_t& pos) const;
+        std::string id(uint32_t pos) const;
+        uint32_t generation(uint32_t pos) const;
+        std::time_t timestamp(uint32_t pos) const;
+        uint32_t parent(uint32_t pos, int k) const;
+
+        bool is_ancestor(uint32_t ancestor, uint32_t descendant) const;
+        uint32_t split_point(uint32_t head, uint32_t given) const;
+    };
+
+    CommitGraph(const std::string& path);
+
+    bool exists() const;
+    void rebuild(const std::vector<Node>& nodes) const;
+    bool add(const Node& node) const;
+    bool add(const std::vector<Node>& nodes) const;
+    View view() const;
+};
+
+#endif // COMMIT_GRAPH_H
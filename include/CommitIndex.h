@@ -0,0 +1,37 @@
+#ifndef COMMIT_INDEX_H
+#define COMMIT_INDEX_H
+
+#include <string>
+#include <vector>
+
+/** Sorted on-disk table of every commit id in the repository.
+ *
+ *  The file starts with the magic "GLCI", a format version and the number
+ *  of sorted entries (both 32-bit, big-endian), followed by the raw 20-byte
+ *  ids in ascending order.  Lookups mmap the file and binary-search it, so
+ *  resolving an abbreviated id no longer scans the object store.
+ *
+ *  New commits are appended after the sorted entries as an unsorted tail
+ *  that lookups scan, so a commit writes 20 bytes instead of the whole
+ *  table.  The tail is merged into the sorted entries once it reaches
+ *  TAIL_LIMIT ids, and whenever the index is rebuilt (as gc does). */
+class CommitIndex {
+private:
+    std::string indexPath;
+    static const size_t TAIL_LIMIT = 1024;
+
+    std::vector<std::string> read_all() const;
+    void write_all(const std::vector<std::string>& raw_ids) const;
+
+public:
+    CommitIndex(const std::string& path);
+
+    bool exists() const;
+    void rebuild(const std::vector<std::string>& ids) const;
+    void add(const std::string& id) const;
+    void add(const std::vector<std::string>& ids) const;
+    bool contains(const std::string& id) const;
+    int resolve(const std::string& prefix, std::string& id) const;
+};
+
+#endif // COMMIT_INDEX_H
@@ -0,0 +1,20 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <string>
+
+/** Copy/insert deltas between two byte strings.
+ *
+ *  A delta starts with the base and target sizes (64-bit, big-endian),
+ *  followed by instructions that rebuild the target:
+ *    0x00 offset(u32) length(u32)   copy LENGTH bytes of the base
+ *    0x01 length(u32) bytes         insert LENGTH literal bytes
+ *  Matches are found by hashing fixed-size blocks of the base and
+ *  rolling the same hash over the target. */
+class Delta {
+public:
+    static std::string create(const std::string& base, const std::string& target);
+    static std::string apply(const std::string& base, const std::string& delta);
+};
+
+#endif // DELTA_H
@@ -0,0 +1,54 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/** Maps the lines of one or more texts to small integers, equal lines to
+ *  equal numbers, so that diffs compare integers instead of strings.
+ *  Lines keep their trailing newline; the texts must outlive the
+ *  interner, whose table points into them.  Newlines are found sixteen
+ *  bytes at a time with SSE2 where available, and lines are hashed a
+ *  machine word at a time. */
+class LineInterner {
+private:
+    struct LineHash {
+        size_t operator()(std::string_view line) const;
+    };
+    std::unordered_map<std::string_view, uint32_t, LineHash> ids;
+
+    void add(std::string_view line, std::vector<uint32_t>& result, std::vector<std::string_view>* lines);
+
+public:
+    std::vector<uint32_t> intern(const std::string& text, std::vector<std::string_view>* lines = nullptr);
+    size_t size() const;
+};
+
+/** Line diffs with Myers' O((N+M)D) algorithm in its linear-space,
+ *  divide-and-conquer form.  Common prefixes and suffixes are stripped
+ *  first, and a search whose edit cost grows past about the square root
+ *  of the input splits at the furthest-reaching diagonal instead of the
+ *  optimal one, which bounds the time on very different inputs at the
+ *  price of a slightly longer script. */
+class Diff {
+public:
+    /** Lines [a_begin, a_end) of A are replaced by [b_begin, b_end) of B;
+     *  either range may be empty. */
+    struct Hunk {
+        size_t a_begin, a_end;
+        size_t b_begin, b_end;
+    };
+
+    static std::vector<Hunk> compute(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b);
+
+    /** Writes the hunks that turn text A into text B to OUT in unified
+     *  format, with CONTEXT unchanged lines around each change.  Nothing
+     *  is written when the texts are equal. */
+    static void unified(const std::string& a, const std::string& b, std::ostream& out, size_t context = 3);
+};
+
+#endif // DIFF_H
@@ -0,0 +1,41 @@
+#ifndef LOCK_FILE_H
+#define LOCK_FILE_H
+
+#include <string>
+
+/** An exclusive lock represented by the existence of a file, such as
+ *  .gitlite/index.lock or refs/<branch>.lock.
+ *
+ *  Acquiring creates the file with O_EXCL and writes the holder's pid and
+ *  host name into it.  A waiter polls with growing sleeps up to a time
+ *  limit; a lock left behind by a process on this host that no longer
+ *  exists is stale and is broken.  A held lock is released by the
+ *  destructor, so a command that fails also releases it: the exception
+ *  Utils::exitWithMessage throws unwinds the stack before main() reports
+ *  it.  Locks still held when the process calls std::exit are released
+ *  as well. */
+class LockFile {
+private:
+    std::string lockPath;
+    bool held;
+
+    bool try_create();
+    bool break_if_stale();
+
+public:
+    explicit LockFile(const std::string& path);
+    ~LockFile();
+
+    LockFile(const LockFile&) = delete;
+    LockFile& operator=(const LockFile&) = delete;
+
+    static int timeout_ms();
+
+    const std::string& path() const;
+    bool held_by_us() const;
+    bool try_acquire();
+    bool acquire(int timeout_ms);
+    void release();
+};
+
+#endif // LOCK_FILE_H
@@ -0,0 +1,38 @@
+#ifndef MATERIALIZER_H
+#define MATERIALIZER_H
+
+#include "Utils.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+/** Writes a batch of working files in parallel.
+ *
+ *  Files are queued with add() and written by run(): every directory the
+ *  batch needs is created once up front, then a pool of workerCount()
+ *  threads each streams one blob into its file before taking the next, so
+ *  memory use stays bounded by the number of workers times the chunk
+ *  size. */
+class Materializer {
+public:
+    typedef std::function<void(const std::string& blob_id, const Utils::ByteSink& sink)> Loader;
+
+    struct File {
+        std::string path;
+        std::string blob_id;
+        FileStat stat;
+    };
+
+    explicit Materializer(const Loader& load);
+
+    void add(const std::string& path, const std::string& blob_id);
+    size_t size() const;
+    void run();
+    const std::vector<File>& files() const;
+
+private:
+    Loader load;
+    std::vector<File> pending;
+};
+
+#endif // MATERIALIZER_H
@@ -0,0 +1,29 @@
+#ifndef MERGE3_H
+#define MERGE3_H
+
+#include <string>
+
+/** Line-based three-way merge in the style of diff3.
+ *
+ *  BASE is diffed against OURS and against THEIRS (see Diff).  Runs of
+ *  changes whose base ranges neither overlap nor touch are taken from the
+ *  side that made them; overlapping runs that end up identical on both
+ *  sides are taken once; anything else becomes a conflict region
+ *      <<<<<<< HEAD / ours / ======= / theirs / >>>>>>>
+ *  trimmed of the lines both sides agree on at its start and end.
+ *  Memory stays linear in the size of the three texts. */
+class Merge3 {
+public:
+    struct Result {
+        std::string text;
+        size_t conflicts = 0;
+    };
+
+    /** True for content that is not merged line by line: anything with a
+     *  NUL byte in its first 8000 bytes, as git decides. */
+    static bool is_binary(const std::string& content);
+
+    static Result merge(const std::string& base, const std::string& ours, const std::string& theirs);
+};
+
+#endif // MERGE3_H
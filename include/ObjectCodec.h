@@ -0,0 +1,81 @@
+#ifndef OBJECT_CODEC_H
+#define OBJECT_CODEC_H
+
+#include "ObjectStore.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+enum class Codec : uint8_t { None = 0, Zlib = 1, Zstd = 2 };
+
+/** On-disk encoding of a stored object.
+ *
+ *  An encoded object starts with a 15-byte header: the magic "\x7fGLO",
+ *  a format version byte, the object type, the codec, and the
+ *  uncompressed size as a 64-bit big-endian number.  The (possibly
+ *  compressed) payload follows.  Objects written before this header
+ *  existed start with their hex id instead and are returned unchanged,
+ *  so old repositories stay readable without a rewrite. */
+class ObjectCodec {
+public:
+    static const size_t HEADER_SIZE = 15;
+
+    /** The codec new objects are written with: GITLITE_COMPRESSION may be
+     *  "none", "zlib" or "zstd"; by default the best built-in one. */
+    static Codec preferred();
+    static bool available(Codec codec);
+    static const char* name(Codec codec);
+
+    static std::string encode(ObjectType type, const std::string& data, Codec codec);
+    static bool is_encoded(const std::string& raw);
+    /** True if RAW is encoded and its header names TYPE. */
+    static bool is_encoded(const std::string& raw, ObjectType type);
+    static std::string decode(const std::string& raw);
+};
+
+/** Streams one object into an open file in the ObjectCodec format.  The
+ *  header is written first with a zero size and patched by finish(), so
+ *  the payload never has to be held in memory. */
+class ObjectEncoder {
+private:
+    struct State;
+    int fd;
+    Codec codec;
+    uint64_t total;
+    std::unique_ptr<State> state;
+    void put(const char* data, size_t len);
+    void pump(bool last);
+
+public:
+    ObjectEncoder(int fd, ObjectType type, Codec codec);
+    ~ObjectEncoder();
+    void write(const char* data, size_t len);
+    void write(const std::string& data);
+    void finish();
+};
+
+/** Streams the content of a stored object back out in chunks.  Reads
+ *  either an open object file, in any format ObjectCodec::decode
+ *  accepts, or content that is already in memory. */
+class ObjectDecoder {
+private:
+    struct State;
+    int fd;
+    Codec codec;
+    uint64_t left;
+    std::string pending;
+    size_t pendingPos;
+    std::unique_ptr<State> state;
+    size_t read_raw(char* buf, size_t len);
+
+public:
+    explicit ObjectDecoder(int fd);
+    explicit ObjectDecoder(std::string data);
+    ~ObjectDecoder();
+    ObjectDecoder(const ObjectDecoder&) = delete;
+    ObjectDecoder& operator=(const ObjectDecoder&) = delete;
+    /** Reads up to LEN bytes into BUF; returns 0 at the end. */
+    size_t read(char* buf, size_t len);
+};
+
+#endif // OBJECT_CODEC_H
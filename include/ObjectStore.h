@@ -0,0 +1,83 @@
+#ifndef OBJECT_STORE_H
+#define OBJECT_STORE_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Utils.h"
+
+enum class ObjectType { Blob, Commit, Tree, Chunk, Manifest };
+
+class Pack;
+class ObjectEncoder;
+class ObjectDecoder;
+
+/** Content-addressed storage below .gitlite/objects.
+ *
+ *  Objects are kept in one subtree per type and fanned out by the first
+ *  two hex digits of their id, so a commit abcdef... is stored at
+ *  objects/commits/ab/cdef...  Enumerating commits therefore never
+ *  touches blobs, and no single directory grows past 256 entries plus
+ *  1/256 of the objects of that type.
+ *
+ *  Large blobs may instead be stored as a manifest (same id, own subtree)
+ *  listing content-defined chunks, which are keyed by the hash of their
+ *  bytes alone so that equal chunks of any file are stored once.
+ *
+ *  Objects may also live in packfiles below objects/pack (see Pack);
+ *  lookups try the loose file first and then every pack.  A lookup that
+ *  misses rescans the pack directory once, so a reader racing with gc
+ *  finds objects that moved from loose files into a new pack. */
+class ObjectStore {
+private:
+    std::string objectDir;
+    std::string commitDir;
+    std::string blobDir;
+    std::string treeDir;
+    std::string chunkDir;
+    std::string manifestDir;
+    std::string packDir;
+    mutable std::vector<std::shared_ptr<Pack>> packs;
+    mutable std::vector<std::string> packNames;
+    mutable bool packsLoaded;
+    mutable std::mutex packLock;
+
+    const std::string& type_dir(ObjectType type) const;
+    std::vector<std::shared_ptr<Pack>> loaded_packs() const;
+    bool rescan_packs() const;
+    bool read_packed(ObjectType type, const std::string& id, std::string& data) const;
+    void close_packs() const;
+    static bool is_legacy_blob(const std::string& id, const std::string& raw);
+
+public:
+    ObjectStore(const std::string& dir);
+    ~ObjectStore();
+
+    void init() const;
+    std::string path(ObjectType type, const std::string& id) const;
+    void save(ObjectType type, const std::string& id, const std::string& data) const;
+    std::string load(ObjectType type, const std::string& id) const;
+    std::unique_ptr<ObjectDecoder> open(ObjectType type, const std::string& id) const;
+    bool save_stream(ObjectType type, const std::string& id,
+                     const std::function<bool(ObjectEncoder&)>& produce) const;
+    bool copy_from(const ObjectStore& source, ObjectType type, const std::string& id) const;
+    bool load_raw(ObjectType type, const std::string& id, std::string& raw) const;
+    void export_pack(const std::vector<std::pair<ObjectType, std::string>>& list,
+                     const Utils::ByteSink& sink, std::string& index) const;
+    void copy_pack(const ObjectStore& source, const std::vector<std::pair<ObjectType, std::string>>& list) const;
+    std::vector<std::string> import_pack(const unsigned char* pack, size_t pack_size,
+                                         const unsigned char* index, size_t index_size,
+                                         const std::function<void(const Pack&)>& check) const;
+    bool loose_size(ObjectType type, const std::string& id, uint64_t& size) const;
+    bool exists(ObjectType type, const std::string& id) const;
+    std::vector<std::string> ids(ObjectType type) const;
+    void repack(const std::vector<std::pair<ObjectType, std::string>>& keep) const;
+
+    bool needs_migration() const;
+    void migrate() const;
+};
+
+#endif // OBJECT_STORE_H
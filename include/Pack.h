@@ -0,0 +1,87 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include "ObjectStore.h"
+#include "Utils.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/** A packfile and its sidecar index below .gitlite/objects/pack.
+ *
+ *  pack-<name>.pack holds "GLPK", a version and an entry count (32-bit,
+ *  big-endian), then one entry per object: a kind byte (0 full, 1
+ *  delta), for deltas the raw 20-byte id of the base object, and the
+ *  length-prefixed payload encoded by ObjectCodec.  A delta's base is
+ *  always stored in the same pack.
+ *
+ *  pack-<name>.idx holds "GLPI", a version and the count, then for every
+ *  object in ascending id order its raw id, type byte and 64-bit offset
+ *  into the pack, so lookups binary-search the mapped index. */
+class Pack {
+private:
+    MappedFile pack;
+    MappedFile idx;
+    size_t count;
+
+    const unsigned char* entry(size_t i) const;
+    bool locate(const std::string& id, size_t& pos) const;
+    std::string read_at(uint64_t offset, ObjectType type, int depth) const;
+
+public:
+    struct Object {
+        ObjectType type;
+        std::string id;
+    };
+    typedef std::function<std::string(ObjectType, const std::string&)> Loader;
+
+    explicit Pack(const std::string& packPath);
+
+    bool contains(ObjectType type, const std::string& id) const;
+    bool read(ObjectType type, const std::string& id, std::string& data) const;
+    bool read_encoded(ObjectType type, const std::string& id, std::string& raw) const;
+    void ids(ObjectType type, std::vector<std::string>& out) const;
+
+    /** Checks, without decoding any entry, that the index and the pack
+     *  agree: the pack holds exactly the entries the index lists, back to
+     *  back, each well formed and in ObjectCodec form with the type the
+     *  index gives it.  Throws std::runtime_error if not. */
+    void verify() const;
+
+    /** Writes OBJECTS, fetched through LOAD, into a new pack in DIR and
+     *  returns the pack's path.  Objects of the same type that are close
+     *  in OBJECTS are tried as delta bases for each other, so callers
+     *  should list likely-similar objects next to each other. */
+    static std::string write(const std::string& dir, const std::vector<Object>& objects,
+                             const Loader& load);
+
+    /** Returns the stored payload, in ObjectCodec form (as a loose object
+     *  file holds it), of the object at the given position in a list. */
+    typedef std::function<std::string(size_t)> Encoded;
+
+    /** Streams OBJECTS to SINK as a pack of full entries, taking their
+     *  payloads from ENCODED in order, stores the pack's index in INDEX
+     *  and returns the pack's name.  Nothing is decoded or compressed
+     *  again, and only one entry is held at a time. */
+    static std::string build(const std::vector<Object>& objects, const Encoded& encoded,
+                             const Utils::ByteSink& sink, std::string& index);
+
+    /** Like build, but writes the pack into DIR and returns its path. */
+    static std::string write_encoded(const std::string& dir, const std::vector<Object>& objects,
+                                     const Encoded& encoded);
+
+    /** Copies the PACK_SIZE bytes of a pack at PACK and its index at INDEX
+     *  into DIR, the index last so readers only pick up a complete pack,
+     *  and returns the pack's path.  The pack is named after the ids in
+     *  its index; an index that does not parse throws std::runtime_error. */
+    static std::string install(const std::string& dir, const unsigned char* pack, size_t pack_size,
+                               const unsigned char* index, size_t index_size);
+
+    /** Returns the path install would give the pack whose index of
+     *  INDEX_SIZE bytes is at INDEX; an index that does not parse throws
+     *  std::runtime_error. */
+    static std::string path_for(const std::string& dir, const unsigned char* index, size_t index_size);
+};
+
+#endif // PACK_H
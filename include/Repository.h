@@ -4,7 +4,15 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <memory>
+#include <functional>
 #include "Commit.h"
+#include "ObjectStore.h"
+#include "CommitIndex.h"
+#include "CommitGraph.h"
+#include "LockFile.h"
+#include "Bundle.h"
 
 class Repository{
 
@@ -14,27 +22,94 @@ private:
     std::string refsDir;
     std::string headPath;
     std::string indexPath;
+    std::string remotesDir;
+    ObjectStore objects;
+    CommitIndex commitIndex;
+    CommitGraph commitGraph;
+    std::string lockPath;
+
+    // Caches kept between the commands of a batch session
+    struct Cached_File{
+        FileStat stat;
+        std::string content;
+    };
+    static const size_t COMMIT_CACHE_SIZE = 64;
+    mutable std::map<std::string,Cached_File> fileCache;  // HEAD and refs
+    mutable std::map<std::string,Commit> commitCache;     // id -> commit and its loaded trees
+    mutable Stage_Area stageCache;
+    mutable FileStat stageStat;
+    mutable bool stageCached;
 
     std::string branch_now() const ;
+    std::string read_cached(const std::string& path) const;
+    void write_cached(const std::string& path, const std::string& content) const;
     void ensure() const;
+    void rebuild_graph() const;
+    std::string split_point(const std::string& head_id, const std::string& given_id) const;
+    std::unique_ptr<LockFile> lock_repository() const;
     void write_ref(const std::string& branch , const std::string& commit_id) const;
+    static bool is_ref_name(const std::string& name);
+    std::vector<std::string> ref_names() const;
     std::string read_ref(const std::string& branch) const;
-    void save_object(const std::string& id , const std::string& data) const;
-    std::string load_object(const std::string& id) const;
-    bool object_exist(const std::string& id) const;
+    void save_object(ObjectType type, const std::string& id , const std::string& data) const;
+    std::string load_object(ObjectType type, const std::string& id) const;
+    bool object_exist(ObjectType type, const std::string& id) const;
+    bool blob_exist(const std::string& blob_id) const;
     void save_blob(const Blob& b) const;
     Blob load_blob(const std::string& blob_id) const;
+    typedef std::map<std::string,std::string>::const_iterator FileIter;
+    std::string save_tree(FileIter begin, FileIter end, size_t prefix) const;
+    std::string save_tree(const FileTree& parent, const Stage_Area& s) const;
+    std::string update_tree(const std::string& tree_id, FileIter begin, FileIter end, size_t prefix) const;
+    void save_commit(const Commit& c) const;
+    Commit load_commit(const std::string& commit_id) const;
+    CommitView load_commit_view(const std::string& commit_id) const;
     Stage_Area read_stage() const;
     void write_stage(const Stage_Area& s) const;
     void clear_stage() const;
+    std::string working_blob_id(const std::string& file_name, const Stage_Area& s,
+                                FileStat& st, bool save) const;
+    size_t switch_files(const std::map<std::string,std::string>& now,
+                        const std::map<std::string,std::string>& target,
+                        Stage_Area& s) const;
+    void report_touched(size_t touched) const;
+    std::string hash_working_file(const std::string& file_name) const;
+    void save_working_file(const std::string& file_name, const std::string& blob_id) const;
+    void save_chunked_file(const std::string& file_name, const std::string& blob_id) const;
+    std::vector<std::string> load_manifest(const std::string& blob_id) const;
+    static std::vector<std::string> manifest_chunks(const std::string& blob_id, const std::string& manifest);
+    void stream_blob(const std::string& blob_id, const Utils::ByteSink& sink) const;
+    void write_working_file(const std::string& file_name, const std::string& blob_id) const;
     Commit load_commit_by_id(const std::string& idcommit) const;
     std::vector<std::string> all_commit_ids() const;
+    void prune(const std::vector<std::string>& roots) const;
+    std::string blob_head(const std::string& blob_id) const;
+    bool legacy_match(const std::string& file_name, const std::string& blob_id) const;
+    std::string migrate_blob(const std::string& blob_id) const;
+    bool is_ancestor(const std::string& ancestor_id, const std::string& commit_id) const;
+    std::string remote_dir(const std::string& name) const;
+    std::string resolve_rev(const std::string& rev) const;
+    // Whether the receiving side of a transfer has an object
+    typedef std::function<bool(ObjectType,const std::string&)> Has;
+    std::vector<std::string> missing_commits(const std::vector<std::string>& heads, const Has& has,
+                                             std::vector<std::string>& prerequisites) const;
+    void missing_trees(const std::string& tree_id, const Has& has, std::set<std::string>& seen,
+                       std::vector<std::string>& trees, std::set<std::string>& blobs) const;
+    std::vector<std::pair<ObjectType,std::string>> missing_objects(const std::vector<std::string>& commits,
+                                                                   const Has& has) const;
+    void add_commits(const std::vector<std::string>& commits) const;
+    void check_pack(const Pack& pack, const Bundle& b) const;
+    std::vector<std::string> receive_bundle(const Bundle& b) const;
+    void copy_history(const Repository& from, const std::string& head_id) const;
+    std::map<std::string,std::string> working_files(const std::map<std::string,std::string>& tracked) const;
+    void print_diff(const std::map<std::string,std::string>& from,
+                    const std::map<std::string,std::string>& to, bool worktree) const;
 
 public:
     Repository(const std::string& dir = ".gitlite");
     static std::string getGitliteDir();
     void init();
-    void add(const std::string& file_name);
+    void add(const std::vector<std::string>& paths);
     void commit(const std::string& message);
     void rm(const std::string& file_name);
     void log() const;
@@ -50,6 +125,18 @@ public:
     void rm_branch(const std::string& name);
     void reset(const std::string& commit_id);
     void merge(const std::string& branch_name);
+    void gc();
+    void migrate();
+    void addRemote(const std::string& name, const std::string& dir);
+    void rmRemote(const std::string& name);
+    void push(const std::string& remote_name, const std::string& branch_name);
+    void fetch(const std::string& remote_name, const std::string& branch_name);
+    void pull(const std::string& remote_name, const std::string& branch_name);
+    void diff() const;
+    void diff(const std::string& commit_id) const;
+    void diff(const std::string& from_id, const std::string& to_id) const;
+    void bundleCreate(const std::string& file, const std::vector<std::string>& revs) const;
+    void bundleUnbundle(const std::string& file);
     
 
 };
@@ -0,0 +1,27 @@
+#ifndef SHA1_KERNELS_H
+#define SHA1_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace SHA1 {
+    /** A compression function: folds BLOCKS consecutive 64-byte blocks at
+     *  DATA into the five state words. */
+    typedef void (*Compress)(uint32_t state[5], const uint8_t* data, size_t blocks);
+
+    struct Kernel {
+        const char* name;
+        Compress compress;
+    };
+
+    /** Every kernel that can run on this CPU, starting with the plain
+     *  reference implementation and ending with the fastest one. */
+    std::vector<Kernel> availableKernels();
+
+    /** The kernel SHA uses.  Chosen once via CPUID; the environment
+     *  variable GITLITE_SHA1_KERNEL may name a specific available kernel. */
+    Compress selectedCompress();
+}
+
+#endif // SHA1_KERNELS_H
@@ -12,34 +12,95 @@
 #include <unistd.h>
 #include <cstdint>
 #include <iomanip>
+#include <functional>
 
 namespace SHA1 {
+    /** Incremental SHA-1.  Call init(), feed the message in any number of
+     *  update() calls, then final() for the hex digest.  Input is consumed
+     *  in 64-byte blocks straight from the caller's buffer; only a partial
+     *  trailing block is copied.  The compression itself runs on the
+     *  fastest kernel the CPU supports (see Sha1Kernels.h). */
     class SHA {
     private:
         typedef uint8_t BYTE;
         typedef uint32_t WORD;
-        WORD A, B, C, D, E;
-        std::vector<WORD> Word;
-        void reset();
-        std::string padding(std::string message);
-        inline WORD charToWord(char ch);
-        WORD shiftLeft(WORD x, int n);
-        WORD kt(int t);
-        WORD ft(int t, WORD B, WORD C, WORD D);
-        void getWord(std::string& message, int index);
+        WORD state[5];
+        BYTE block[64];
+        size_t blockLength;
+        uint64_t messageLength;
     public:
         SHA();
-        std::string sha(std::string message);
+        void init();
+        void update(const void* data, size_t len);
+        void update(const std::string& message);
+        std::string final();
+        std::string sha(const std::string& message);
     };
-    extern SHA sha;
-    std::string sha1(std::string message);
-    std::string sha1(std::string s1, std::string s2);
-    std::string sha1(std::string s1, std::string s2, std::string s3, std::string s4);
+    std::string sha1(const std::string& message);
+    std::string sha1(const std::string& s1, const std::string& s2);
+    std::string sha1(const std::string& s1, const std::string& s2,
+                     const std::string& s3, const std::string& s4);
 }
 
+/** The stat fields used to tell whether a file changed since it was last
+ *  hashed. */
+struct FileStat {
+    int64_t mtimeNs = 0;
+    int64_t ctimeNs = 0;
+    uint64_t size = 0;
+    uint64_t inode = 0;
+
+    bool operator==(const FileStat& other) const;
+    bool operator!=(const FileStat& other) const { return !(*this == other); }
+};
+
+/** How hard writes to .gitlite are pushed to stable storage, chosen with
+ *  GITLITE_FSYNC.  None only renames complete files into place; Full
+ *  fsyncs every file and its directory as it is installed; Batch (the
+ *  default) leaves objects to a single syncfs issued just before the next
+ *  ref, HEAD or index update, which itself is fsynced like Full. */
+enum class Durability { None, Batch, Full };
+
+/** Bounds-checked cursor over a binary buffer written with the Utils::put*
+ *  helpers.  Reading past the end throws std::runtime_error. */
+class ByteReader {
+private:
+    const unsigned char* pos;
+    const unsigned char* end;
+    const unsigned char* take(size_t n);
+public:
+    ByteReader(const unsigned char* data, size_t len);
+    explicit ByteReader(const std::string& data);
+    uint8_t u8();
+    uint32_t u32();
+    uint64_t u64();
+    std::string bytes(size_t n);
+    std::string str();
+    size_t remaining() const;
+};
+
+/** Read-only memory mapping of a whole file.  A missing or empty file
+ *  maps to an empty buffer. */
+class MappedFile {
+private:
+    void* addr;
+    size_t length;
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    const unsigned char* data() const;
+    size_t size() const;
+};
+
 class Utils {
 public:
     static const int UID_LENGTH = 40;
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    /** Receives a file or object in consecutive chunks. */
+    typedef std::function<void(const char* data, size_t len)> ByteSink;
 
     // SHA-1 hash functions
     static std::string sha1(const std::string& s1);
@@ -48,15 +109,43 @@ public:
                           const std::string& s3, const std::string& s4);
     static std::string sha1(const std::vector<unsigned char>& data);
 
+    // Hex encoding of raw ids
+    static std::string toHex(const unsigned char* data, size_t len);
+    static bool fromHex(const std::string& hex, std::string& raw);
+
+    // Big-endian binary encoding
+    static void putU32(std::string& out, uint32_t v);
+    static void putU64(std::string& out, uint64_t v);
+    static void putString(std::string& out, const std::string& s);
+    static uint32_t getU32(const unsigned char* p);
+    static uint64_t getU64(const unsigned char* p);
+
     // File operations
     static bool restrictedDelete(const std::string& filepath);
     static std::vector<unsigned char> readContents(const std::string& filepath);
     static std::string readContentsAsString(const std::string& filepath);
     static void writeContents(const std::string& filepath, const std::string& content);
+    static void writeFile(const std::string& filepath, const std::string& content, FileStat& st);
+    static void writeFile(const std::string& filepath,
+                          const std::function<void(const ByteSink&)>& produce, FileStat& st);
+    static void readChunks(const std::string& filepath, const ByteSink& sink);
     static void writeContents(const std::string& filepath, const std::vector<unsigned char>& content);
 
+    // Crash-safe writes
+    static Durability durability();
+    static void writeAtomic(const std::string& filepath, const std::string& content,
+                            bool deferSync = false);
+    static void installFile(int fd, const std::string& tmp, const std::string& target,
+                            bool deferSync);
+    static void syncDeferred();
+    static void appendFile(const std::string& filepath, const std::string& content);
+    static bool copyFile(const std::string& from, const std::string& to, bool deferSync = false);
+
     // Directory operations
     static std::vector<std::string> plainFilenamesIn(const std::string& dirPath);
+    static std::vector<std::string> subdirectoriesIn(const std::string& dirPath);
+    static std::vector<std::string> filesUnder(const std::string& dirPath);
+    static std::string normalizePath(const std::string& path);
     static std::string join(const std::string& first, const std::string& second);
     static std::string join(const std::string& first, const std::string& second, const std::string& third);
 
@@ -71,7 +160,12 @@ public:
     static bool exists(const std::string& path);
     static bool isFile(const std::string& path);
     static bool isDirectory(const std::string& path);
+    static bool statFile(const std::string& path, FileStat& st);
     static bool createDirectories(const std::string& path);
+
+    // Parallel execution
+    static size_t workerCount();
+    static void parallelFor(size_t n, const std::function<void(size_t)>& body);
 };
 
 #endif // UTILS_H
@@ -1,9 +1,9 @@
 #include <iostream>
 #include <vector>
 #include <string>
-#include "include/SomeObj.h" 
 #include "include/Repository.h"
 #include "include/Utils.h"
+#include "include/GitliteException.h"
 
 void checkCWD() {
     if (!Utils::isDirectory(Repository::getGitliteDir())) {
@@ -23,14 +23,44 @@ void checkArgsNum(const std::vector<std::string>& args, int n) {
     }
 }
 
-int main(int argc, char* argv[]) {
+/** Splits a batch line into arguments at spaces.  Double quotes group
+ *  words, e.g. commit "fix the parser", and a backslash inside them
+ *  escapes the next character. */
+std::vector<std::string> splitLine(const std::string& line) {
     std::vector<std::string> args;
-    for (int i = 1; i < argc; ++i) {
-        args.push_back(std::string(argv[i]));
+    std::string arg;
+    bool inArg = false, quoted = false;
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (quoted) {
+            if (c == '\\' && i + 1 < line.size()) {
+                arg += line[++i];
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                arg += c;
+            }
+        } else if (c == '"') {
+            quoted = inArg = true;
+        } else if (c == ' ' || c == '\t' || c == '\r') {
+            if (inArg) {
+                args.push_back(arg);
+                arg.clear();
+                inArg = false;
+            }
+        } else {
+            arg += c;
+            inArg = true;
+        }
     }
-    
+    if (inArg) {
+        args.push_back(arg);
+    }
+    return args;
+}
+
+void runCommand(Repository& bloop, const std::vector<std::string>& args) {
     checkNoArgs(args);
-    SomeObj bloop;
     std::string firstArg = args[0];
     
     if (firstArg == "init") {
@@ -46,8 +76,10 @@ int main(int argc, char* argv[]) {
         bloop.rmRemote(args[1]);
     } else if (firstArg == "add") {
         checkCWD();
-        checkArgsNum(args, 2);
-        bloop.add(args[1]);
+        if (args.size() < 2) {
+            Utils::exitWithMessage("Incorrect operands.");
+        }
+        bloop.add(std::vector<std::string>(args.begin() + 1, args.end()));
     } else if (firstArg == "commit") {
         checkCWD();
         checkArgsNum(args, 2);
@@ -96,7 +128,7 @@ int main(int argc, char* argv[]) {
     } else if (firstArg == "rm-branch") {
         checkCWD();
         checkArgsNum(args, 2);
-        bloop.rmBranch(args[1]);
+        bloop.rm_branch(args[1]);
     } else if (firstArg == "reset") {
         checkCWD();
         checkArgsNum(args, 2);
@@ -105,6 +137,25 @@ int main(int argc, char* argv[]) {
         checkCWD();
         checkArgsNum(args, 2);
         bloop.merge(args[1]);
+    } else if (firstArg == "gc") {
+        checkCWD();
+        checkArgsNum(args, 1);
+        bloop.gc();
+    } else if (firstArg == "migrate") {
+        checkCWD();
+        checkArgsNum(args, 1);
+        bloop.migrate();
+    } else if (firstArg == "diff") {
+        checkCWD();
+        if (args.size() == 1) {
+            bloop.diff();
+        } else if (args.size() == 2) {
+            bloop.diff(args[1]);
+        } else if (args.size() == 3) {
+            bloop.diff(args[1], args[2]);
+        } else {
+            Utils::exitWithMessage("Incorrect operands.");
+        }
     } else if (firstArg == "push") {
         checkCWD();
         checkArgsNum(args, 3);
@@ -117,10 +168,66 @@ int main(int argc, char* argv[]) {
         checkCWD();
         checkArgsNum(args, 3);
         bloop.pull(args[1], args[2]);
+    } else if (firstArg == "bundle") {
+        checkCWD();
+        if (args.size() >= 3 && args[1] == "create") {
+            bloop.bundleCreate(args[2], std::vector<std::string>(args.begin() + 3, args.end()));
+        } else if (args.size() == 3 && args[1] == "unbundle") {
+            bloop.bundleUnbundle(args[2]);
+        } else {
+            Utils::exitWithMessage("Incorrect operands.");
+        }
     } else {
         std::cout << "No command with that name exists." << std::endl;
-        return 0;
     }
     
+}
+
+/** Runs one command per line of standard input against a single
+ *  repository object, so the parsed index, refs and recent commits stay
+ *  cached between commands.  Each command's output is followed by a NUL
+ *  byte and a newline; a command that fails with an internal error is
+ *  reported on standard error and the session goes on. */
+void runBatch(Repository& bloop) {
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::vector<std::string> args = splitLine(line);
+        if (args.empty()) {
+            continue;
+        }
+        try {
+            if (args[0] == "batch") {
+                Utils::exitWithMessage("Incorrect operands.");
+            }
+            runCommand(bloop, args);
+        } catch (const GitliteException& e) {
+            Utils::message(e.what());
+        } catch (const std::exception& e) {
+            std::cerr << "error: " << e.what() << std::endl;
+        }
+        std::cout << '\0' << std::endl;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        args.push_back(std::string(argv[i]));
+    }
+    
+    Repository bloop;
+    try {
+        if (args.size() == 1 && args[0] == "batch") {
+            runBatch(bloop);
+        } else {
+            runCommand(bloop, args);
+        }
+    } catch (const GitliteException& e) {
+        Utils::message(e.what());
+    } catch (const std::exception& e) {
+        // Unwinding releases the repository lock, which std::terminate would leave behind.
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
     return 0;
 }
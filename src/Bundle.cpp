@@ -0,0 +1,99 @@
+#include "../include/Bundle.h"
+#include "../include/Utils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+    const char MAGIC[4] = {'G', 'L', 'B', 'D'};
+    const uint32_t VERSION = 1;
+    const size_t TRAILER_SIZE = 16;
+}
+
+/** The header is built in memory; the pack goes from WRITE_PACK straight
+ *  to the file, followed by its index.  The file is written next to PATH
+ *  and renamed over it, so a failed write never leaves a truncated bundle
+ *  behind. */
+void Bundle::write(const std::string& path, const PackWriter& write_pack) const {
+    std::string header(MAGIC, 4);
+    Utils::putU32(header, VERSION);
+    Utils::putU32(header, static_cast<uint32_t>(refs.size()));
+    for (auto &ref : refs) {
+        Utils::putString(header, ref.name);
+        Utils::putString(header, ref.commit_id);
+    }
+    Utils::putU32(header, static_cast<uint32_t>(prerequisites.size()));
+    for (auto &id : prerequisites) {
+        Utils::putString(header, id);
+    }
+
+    std::string tmp = path + ".tmp";
+    FileStat st;
+    try {
+        Utils::writeFile(tmp, [&](const Utils::ByteSink& sink) {
+            sink(header.data(), header.size());
+            uint64_t written = 0;
+            std::string index;
+            write_pack([&](const char* data, size_t len) {
+                sink(data, len);
+                written += len;
+            }, index);
+            sink(index.data(), index.size());
+            std::string trailer;
+            Utils::putU64(trailer, written);
+            Utils::putU64(trailer, index.size());
+            sink(trailer.data(), trailer.size());
+        }, st);
+    } catch (...) {
+        std::remove(tmp.c_str());
+        throw;
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("cannot write bundle " + path);
+    }
+}
+
+Bundle Bundle::read(const std::string& path) {
+    Bundle b;
+    b.file = std::make_shared<MappedFile>(path);
+    const unsigned char* data = b.file->data();
+    size_t size = b.file->size();
+    if (size < 8 + TRAILER_SIZE || std::memcmp(data, MAGIC, 4) != 0
+        || Utils::getU32(data + 4) != VERSION) {
+        throw std::runtime_error("Bad bundle file");
+    }
+    size_t body = size - TRAILER_SIZE;
+    ByteReader in(data + 8, body - 8);
+    for (uint32_t n = in.u32(); n > 0; n--) {
+        Ref ref;
+        ref.name = in.str();
+        ref.commit_id = in.str();
+        b.refs.push_back(std::move(ref));
+    }
+    for (uint32_t n = in.u32(); n > 0; n--) {
+        b.prerequisites.push_back(in.str());
+    }
+    uint64_t pack_size = Utils::getU64(data + body);
+    uint64_t index_size = Utils::getU64(data + body + 8);
+    if (pack_size > in.remaining() || index_size != in.remaining() - pack_size) {
+        throw std::runtime_error("Bad bundle file");
+    }
+    b.pack = data + body - in.remaining();
+    b.pack_size = pack_size;
+    b.index = b.pack + pack_size;
+    b.index_size = index_size;
+    return b;
+}
+
+size_t Bundle::unpack_limit() {
+    static const size_t limit = [] {
+        const char* env = std::getenv("GITLITE_UNPACK_LIMIT");
+        if (env != nullptr && *env != '\0') {
+            return static_cast<size_t>(std::strtoull(env, nullptr, 10));
+        }
+        return static_cast<size_t>(100);
+    }();
+    return limit;
+}
@@ -0,0 +1,74 @@
+#include "../include/Chunker.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+    const uint64_t MASK_SMALL = ((1ULL << 18) - 1) << 40;
+    const uint64_t MASK_LARGE = ((1ULL << 14) - 1) << 40;
+
+    /** 256 pseudo-random words from a fixed splitmix64 sequence; fixed so
+     *  that boundaries, and with them chunk ids, never change. */
+    struct GearTable {
+        uint64_t gear[256];
+        GearTable() {
+            uint64_t x = 0x6769746c69746521ULL;
+            for (auto &g : gear) {
+                x += 0x9e3779b97f4a7c15ULL;
+                uint64_t z = x;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                g = z ^ (z >> 31);
+            }
+        }
+    };
+    const GearTable TABLE;
+}
+
+uint64_t Chunker::threshold() {
+    static const uint64_t bytes = [] {
+        const char* env = std::getenv("GITLITE_CHUNK_THRESHOLD");
+        if (env != nullptr && *env != '\0') {
+            return static_cast<uint64_t>(std::strtoull(env, nullptr, 10));
+        }
+        return static_cast<uint64_t>(4) << 20;
+    }();
+    return bytes;
+}
+
+Chunker::Chunker(const Emit& emit) : emit(emit), hash(0) {
+    chunk.reserve(MAX_SIZE);
+}
+
+/** Feeds LEN bytes at DATA, emitting every chunk completed by them.  The
+ *  first MIN_SIZE bytes of a chunk can never end it and are not hashed. */
+void Chunker::update(const char* data, size_t len) {
+    size_t start = 0;
+    size_t i = 0;
+    while (i < len) {
+        size_t size = chunk.size() + (i - start);
+        if (size + 1 < MIN_SIZE) {
+            i += std::min(MIN_SIZE - 1 - size, len - i);
+            continue;
+        }
+        unsigned char b = static_cast<unsigned char>(data[i++]);
+        size++;
+        hash = (hash << 1) + TABLE.gear[b];
+        uint64_t mask = size < AVG_SIZE ? MASK_SMALL : MASK_LARGE;
+        if ((hash & mask) == 0 || size >= MAX_SIZE) {
+            chunk.append(data + start, i - start);
+            emit(chunk);
+            chunk.clear();
+            start = i;
+            hash = 0;
+        }
+    }
+    chunk.append(data + start, len - start);
+}
+
+void Chunker::finish() {
+    if (!chunk.empty()) {
+        emit(chunk);
+        chunk.clear();
+    }
+    hash = 0;
+}
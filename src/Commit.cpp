@@ -8,46 +8,57 @@
 #include<string>
 #include<cmath>
 #include<ctime>
-
-Blob::Blob(const std::string& file,const std::string content):
-    file_name(file) , file_content(content) {
-        sha_blob = Utils::sha1(file, content);
+#include<cstdlib>
+#include<stdexcept>
+
+Blob::Blob(const std::string& content):
+    file_content(content) {
+        SHA1::SHA key = hasher();
+        key.update(content);
+        sha_blob = key.final();
     } 
 
 std::string Blob::get_sha() const {
     return sha_blob;
 }
 
-std::string Blob::get_file_name() const {
-    return file_name;
-}
-
 std::string Blob::get_file_content() const {
     return file_content;
 }
 
 std::string Blob::serialize() const {
-    std::ostringstream oss;
-    oss << sha_blob << "\n" << file_name << "\n";
-    oss << file_content;
-    return oss.str();
+    return file_content;
 }
 
-Blob Blob::deserialize(const std::string& content){
-    std::istringstream iss(content);
+/** Reads the stored object DATA of blob BLOB_ID, old format or new. */
+Blob Blob::deserialize(const std::string& blob_id, const std::string& data){
     Blob b;
-    std::getline(iss, b.sha_blob);
-    std::getline(iss, b.file_name);
-    std::string rest, all; 
-    while (std::getline(iss, rest)) { 
-        all += rest; 
-        if (!iss.eof()) 
-            all += "\n"; 
-    } 
-    b.file_content = all;
+    b.sha_blob = blob_id;
+    if(is_legacy(blob_id, data)){
+        size_t name_end = data.find('\n', blob_id.size() + 1);
+        b.file_content = name_end == std::string::npos ? "" : data.substr(name_end + 1);
+    } else {
+        b.file_content = data;
+    }
     return b;
 }
 
+/** Returns a hash already fed with the blob prefix; feeding it the
+ *  content yields the blob id without holding the content in memory. */
+SHA1::SHA Blob::hasher(){
+    SHA1::SHA key;
+    key.update("blob\n", 5);
+    return key;
+}
+
+/** True if DATA, the start of the stored object BLOB_ID, is in the old
+ *  "id\nname\ncontent" format.  A content-only blob cannot start with
+ *  its own id, so the first line tells the formats apart. */
+bool Blob::is_legacy(const std::string& blob_id, const std::string& data){
+    return data.size() > blob_id.size() && data.compare(0, blob_id.size(), blob_id) == 0
+        && data[blob_id.size()] == '\n';
+}
+
 
 
 void Stage_Area::add(const std::string& file_name , const std::string& blob_sha){
@@ -85,6 +96,30 @@ void Stage_Area::clear(){
     remove_staged.clear();
 }
 
+void Stage_Area::record(const std::string& file_name, const std::string& blob_id, const FileStat& st){
+    cache[file_name] = Cache_Entry{blob_id, st};
+}
+
+void Stage_Area::forget(const std::string& file_name){
+    cache.erase(file_name);
+}
+
+/** Looks up the blob id recorded for FILE_NAME when it had stat ST.  An
+ *  entry modified in the same second the index was written is "racily
+ *  clean": the file could have changed again without its mtime moving,
+ *  so it is not trusted. */
+bool Stage_Area::cached_blob(const std::string& file_name, const FileStat& st, std::string& blob_id) const {
+    auto it = cache.find(file_name);
+    if(it == cache.end() || it->second.stat != st){
+        return false;
+    }
+    if(st.mtimeNs / 1000000000 >= written_ns / 1000000000){
+        return false;
+    }
+    blob_id = it->second.blob_id;
+    return true;
+}
+
 const std::map<std::string,std::string>& Stage_Area::files() const {
     return add_staged;
 }
@@ -93,19 +128,77 @@ const std::set<std::string>& Stage_Area::removedFiles() const {
     return remove_staged;
 }
 
+/* The index is a binary file:
+ *   "GLIX" version(u32) written_ns(u64)
+ *   count(u32) { name blob_id }                  staged for addition
+ *   count(u32) { name }                          staged for removal
+ *   count(u32) { name blob_id mtime ctime size inode }   stat cache
+ * Strings are length-prefixed, numbers big-endian.  Indexes written in
+ * the older "A name blob" / "R name" text form are still read. */
+namespace {
+    const char INDEX_MAGIC[] = "GLIX";
+    const uint32_t INDEX_VERSION = 2;
+
+    int64_t now_ns(){
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+}
+
 std::string Stage_Area::serialize() const {
-    std::ostringstream oss;
+    std::string out(INDEX_MAGIC, 4);
+    Utils::putU32(out, INDEX_VERSION);
+    Utils::putU64(out, static_cast<uint64_t>(now_ns()));
+    Utils::putU32(out, static_cast<uint32_t>(add_staged.size()));
     for (auto &file : add_staged) {
-        oss <<"A " << file.first << " " << file.second << "\n";
+        Utils::putString(out, file.first);
+        Utils::putString(out, file.second);
     }
+    Utils::putU32(out, static_cast<uint32_t>(remove_staged.size()));
     for (auto &file : remove_staged) { 
-        oss << "R " << file << "\n";
+        Utils::putString(out, file);
     }
-    return oss.str();
+    Utils::putU32(out, static_cast<uint32_t>(cache.size()));
+    for (auto &entry : cache) {
+        Utils::putString(out, entry.first);
+        Utils::putString(out, entry.second.blob_id);
+        Utils::putU64(out, static_cast<uint64_t>(entry.second.stat.mtimeNs));
+        Utils::putU64(out, static_cast<uint64_t>(entry.second.stat.ctimeNs));
+        Utils::putU64(out, entry.second.stat.size);
+        Utils::putU64(out, entry.second.stat.inode);
+    }
+    return out;
 }
 
 Stage_Area Stage_Area::deserialize(const std::string& raw) {
     Stage_Area s;
+    if (raw.compare(0, 4, INDEX_MAGIC) == 0) {
+        ByteReader in(raw);
+        in.bytes(4);
+        if (in.u32() != INDEX_VERSION) {
+            throw std::runtime_error("Bad index version");
+        }
+        s.written_ns = static_cast<int64_t>(in.u64());
+        for (uint32_t n = in.u32(); n > 0; n--) {
+            std::string fname = in.str();
+            s.add_staged[fname] = in.str();
+        }
+        for (uint32_t n = in.u32(); n > 0; n--) {
+            s.remove_staged.insert(in.str());
+        }
+        for (uint32_t n = in.u32(); n > 0; n--) {
+            std::string fname = in.str();
+            Cache_Entry e;
+            e.blob_id = in.str();
+            e.stat.mtimeNs = static_cast<int64_t>(in.u64());
+            e.stat.ctimeNs = static_cast<int64_t>(in.u64());
+            e.stat.size = in.u64();
+            e.stat.inode = in.u64();
+            s.cache[fname] = e;
+        }
+        return s;
+    }
     std::istringstream iss(raw);
     std::string line;
     while (std::getline(iss, line)) { 
@@ -129,33 +222,18 @@ Stage_Area Stage_Area::deserialize(const std::string& raw) {
 Commit::Commit() : timestamp(0) {}
 
 Commit::Commit(const std::string& msg, const std::vector<std::string>& former,
-                const std::map<std::string,std::string>& blobs,const Stage_Area& stage,
-                const std::time_t& tm):
-                message(msg) , timestamp(tm) , formers(former) , blobs_commit(blobs){
-                    for(auto file:stage.files()){
-                        blobs_commit[file.first] = file.second;
-                    }
-                    for(auto file:stage.removedFiles()){
-                        blobs_commit.erase(file);
-                    }
-                    std::ostringstream key;
-                    key << message << "|" << timestamp;
-                    for(auto &f : formers){
-                        key << "|" << f;
-                    }
-                    for(auto &file : blobs_commit){
-                        key << "|"<< file.first << ":" << file.second;
-                    }
-                    id = Utils::sha1(key.str());
+                const std::string& tree_id, const std::time_t& tm):
+                message(msg) , timestamp(tm) , formers(former) , tree(tree_id){
+                    id = compute_id();
                 }
 
-Commit Commit::initial_commit(){
+Commit Commit::initial_commit(const std::string& tree_id){
     Commit c;
     c.message = "initial commit";
     c.timestamp = 0;
     c.formers = {};
-    c.blobs_commit = {};
-    c.id = Utils::sha1(c.message + "|" + std::to_string(c.timestamp));
+    c.tree = tree_id;
+    c.id = c.compute_id();
     return c;
 }
 
@@ -163,6 +241,31 @@ const std::string& Commit::get_id() const {
     return id;
 }
 
+/** Returns the id this commit's fields hash to.  The initial commit keeps
+ *  the id it always had, and a commit without a root tree, stored before
+ *  trees, hashes its file table in place of the tree id. */
+std::string Commit::compute_id() const {
+    if(formers.empty() && timestamp == 0 && message == "initial commit"){
+        return Utils::sha1(message + "|" + std::to_string(timestamp));
+    }
+    SHA1::SHA key;
+    key.update(message);
+    key.update("|" + std::to_string(timestamp));
+    for(auto &f : formers){
+        key.update("|", 1);
+        key.update(f);
+    }
+    if(tree.empty()){
+        for(auto &file : files.files()){
+            key.update("|" + file.first + ":" + file.second);
+        }
+        return key.final();
+    }
+    key.update("|", 1);
+    key.update(tree);
+    return key.final();
+}
+
 const std::string& Commit::get_message() const {
     return message;
 }
@@ -174,8 +277,16 @@ const std::vector<std::string> Commit::get_formers() const {
     return formers;
 }
 
-const std::map<std::string,std::string>& Commit::get_blobs_commit() const {
-    return blobs_commit;
+const std::string& Commit::get_tree() const {
+    return tree;
+}
+
+const FileTree& Commit::get_files() const {
+    return files;
+}
+
+void Commit::set_files(const FileTree& f){
+    files = f;
 }
 
 std::string Commit::serialize() const {
@@ -186,7 +297,11 @@ std::string Commit::serialize() const {
     for(auto former : formers){
         oss << "F " << former << "\n";
     }
-    for(auto blob : blobs_commit){
+    if(!tree.empty()){
+        oss << "T " << tree << "\n";
+        return oss.str();
+    }
+    for(auto blob : files.files()){
         oss << "B " << blob.first << "|" << blob.second << "\n";
     }
     return oss.str();
@@ -203,6 +318,7 @@ std::string Commit::Time( std::time_t t ){
 
 Commit Commit::deserialize(const std::string& raw) {
     Commit c;
+    std::map<std::string,std::string> table;
     std::istringstream iss(raw);
     std::string line;
     if (!std::getline(iss, c.id)) throw std::runtime_error("Bad commit data");
@@ -214,6 +330,8 @@ Commit Commit::deserialize(const std::string& raw) {
         if (line.rfind("F ", 0) == 0) {
             std::string pid = line.substr(2);
             c.formers.push_back(pid);
+        } else if (line.rfind("T ", 0) == 0) {
+            c.tree = line.substr(2);
         } else if (line.rfind("B ", 0) == 0) {
             std::string rest = line.substr(2);
             size_t pos = rest.find('|');
@@ -221,10 +339,212 @@ Commit Commit::deserialize(const std::string& raw) {
                 std::string fname = rest.substr(0, pos); 
                 std::string bid = rest.substr(pos + 1); 
                 if (!fname.empty() && !bid.empty()) { 
-                    c.blobs_commit[fname] = bid; 
+                    table[fname] = bid; 
                 } 
             }
         }
     }
+    c.files = FileTree(std::move(table));
     return c;
 }
+
+CommitView::CommitView(std::string data) : raw(std::move(data)) {
+    size_t id_end = raw.find('\n');
+    if (id_end == std::string::npos) throw std::runtime_error("Bad commit data");
+    message_begin = id_end + 1;
+    message_end = raw.find('\n', message_begin);
+    if (message_end == std::string::npos) throw std::runtime_error("Bad commit data");
+    size_t pos = message_end + 1;
+    char* end = nullptr;
+    timestamp = static_cast<std::time_t>(std::strtoll(raw.c_str() + pos, &end, 10));
+    if (end == raw.c_str() + pos || *end != '\n') throw std::runtime_error("Bad commit data");
+    pos = end - raw.c_str() + 1;
+    while (raw.compare(pos, 2, "F ") == 0) {
+        size_t eol = raw.find('\n', pos);
+        if (eol == std::string::npos) eol = raw.size();
+        formers.push_back(raw.substr(pos + 2, eol - pos - 2));
+        pos = std::min(eol + 1, raw.size());
+    }
+    if (raw.compare(pos, 2, "T ") == 0) {
+        size_t eol = raw.find('\n', pos);
+        if (eol == std::string::npos) eol = raw.size();
+        tree = raw.substr(pos + 2, eol - pos - 2);
+        pos = std::min(eol + 1, raw.size());
+    }
+    files_begin = pos;
+}
+
+std::string CommitView::get_id() const {
+    return raw.substr(0, message_begin - 1);
+}
+
+std::string CommitView::get_message() const {
+    return raw.substr(message_begin, message_end - message_begin);
+}
+
+bool CommitView::message_equals(const std::string& msg) const {
+    return raw.compare(message_begin, message_end - message_begin, msg) == 0;
+}
+
+const std::time_t& CommitView::get_timestamp() const {
+    return timestamp;
+}
+
+const std::vector<std::string>& CommitView::get_formers() const {
+    return formers;
+}
+
+const std::string& CommitView::get_tree() const {
+    return tree;
+}
+
+std::map<std::string,std::string> CommitView::get_blobs_commit() const {
+    std::map<std::string,std::string> blobs;
+    size_t pos = files_begin;
+    while (pos < raw.size()) {
+        size_t eol = raw.find('\n', pos);
+        if (eol == std::string::npos) eol = raw.size();
+        size_t bar = raw.find('|', pos);
+        if (raw.compare(pos, 2, "B ") == 0 && bar < eol && bar > pos + 2 && bar + 1 < eol) {
+            blobs.emplace_hint(blobs.end(), raw.substr(pos + 2, bar - pos - 2), raw.substr(bar + 1, eol - bar - 1));
+        }
+        pos = eol + 1;
+    }
+    return blobs;
+}
+
+void Tree::add_blob(const std::string& name, const std::string& blob_id){
+    blobs[name] = blob_id;
+}
+
+void Tree::add_tree(const std::string& name, const std::string& tree_id){
+    subtrees[name] = tree_id;
+}
+
+void Tree::remove_blob(const std::string& name){
+    blobs.erase(name);
+}
+
+void Tree::remove_tree(const std::string& name){
+    subtrees.erase(name);
+}
+
+bool Tree::empty() const {
+    return blobs.empty() && subtrees.empty();
+}
+
+const std::map<std::string,std::string>& Tree::get_blobs() const {
+    return blobs;
+}
+
+const std::map<std::string,std::string>& Tree::get_subtrees() const {
+    return subtrees;
+}
+
+std::string Tree::get_id() const {
+    return Utils::sha1("tree\n", serialize());
+}
+
+/* One line per entry: "B <blob id> <name>" or "T <tree id> <name>".  The
+ * name comes last so it may contain spaces. */
+std::string Tree::serialize() const {
+    std::string out;
+    for (auto &b : blobs) {
+        out += "B " + b.second + " " + b.first + "\n";
+    }
+    for (auto &t : subtrees) {
+        out += "T " + t.second + " " + t.first + "\n";
+    }
+    return out;
+}
+
+Tree Tree::deserialize(const std::string& raw){
+    Tree t;
+    size_t pos = 0;
+    while (pos < raw.size()) {
+        size_t eol = raw.find('\n', pos);
+        if (eol == std::string::npos) eol = raw.size();
+        size_t space = raw.find(' ', pos + 2);
+        if (eol - pos < 4 || raw[pos + 1] != ' ' || space >= eol) {
+            throw std::runtime_error("Bad tree data");
+        }
+        std::string id = raw.substr(pos + 2, space - pos - 2);
+        std::string name = raw.substr(space + 1, eol - space - 1);
+        if (raw[pos] == 'B') {
+            t.blobs[name] = id;
+        } else if (raw[pos] == 'T') {
+            t.subtrees[name] = id;
+        } else {
+            throw std::runtime_error("Bad tree data");
+        }
+        pos = eol + 1;
+    }
+    return t;
+}
+
+FileTree::FileTree(std::map<std::string,std::string> files) : table(std::move(files)) {}
+
+FileTree::FileTree(std::string root_id, Loader loader)
+    : root(std::move(root_id)), load(std::move(loader)),
+      trees(std::make_shared<std::map<std::string,Tree>>()) {}
+
+const Tree& FileTree::tree(const std::string& tree_id) const {
+    auto it = trees->find(tree_id);
+    if (it == trees->end()) {
+        it = trees->emplace(tree_id, Tree::deserialize(load(tree_id))).first;
+    }
+    return it->second;
+}
+
+const std::string& FileTree::get_root() const {
+    return root;
+}
+
+/** Stores in BLOB_ID the blob of file PATH and returns true, or returns
+ *  false if the commit has no such file. */
+bool FileTree::find(const std::string& path, std::string& blob_id) const {
+    if (root.empty()) {
+        auto it = table.find(path);
+        if (it == table.end()) return false;
+        blob_id = it->second;
+        return true;
+    }
+    const Tree* t = &tree(root);
+    size_t start = 0;
+    for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', start)) {
+        auto sub = t->get_subtrees().find(path.substr(start, slash - start));
+        if (sub == t->get_subtrees().end()) return false;
+        t = &tree(sub->second);
+        start = slash + 1;
+    }
+    auto b = t->get_blobs().find(path.substr(start));
+    if (b == t->get_blobs().end()) return false;
+    blob_id = b->second;
+    return true;
+}
+
+bool FileTree::contains(const std::string& path) const {
+    std::string blob_id;
+    return find(path, blob_id);
+}
+
+/** Returns every file of the commit, name -> blob id.  The trees read
+ *  for it are not kept, so one listing costs no lasting memory. */
+std::map<std::string,std::string> FileTree::files() const {
+    if (root.empty()) return table;
+    std::map<std::string,std::string> out;
+    flatten(root, "", out);
+    return out;
+}
+
+void FileTree::flatten(const std::string& tree_id, const std::string& prefix,
+                       std::map<std::string,std::string>& files) const {
+    auto it = trees->find(tree_id);
+    Tree t = it != trees->end() ? it->second : Tree::deserialize(load(tree_id));
+    for (auto &b : t.get_blobs()) {
+        files[prefix + b.first] = b.second;
+    }
+    for (auto &sub : t.get_subtrees()) {
+        flatten(sub.second, prefix + sub.first + "/", files);
+    }
+}
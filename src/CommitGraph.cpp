@@ -0,0 +1,376 @@
+#include "../include/CommitGraph.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <set>
+#include <stdexcept>
+
+namespace {
+    const char MAGIC[4] = {'G', 'L', 'C', 'G'};
+    const uint32_t VERSION = 1;
+    const size_t HEADER_SIZE = 12;
+    const size_t RAW_ID_SIZE = 20;
+    const size_t ENTRY_SIZE = RAW_ID_SIZE + 4 + 8 + 4 + 4;
+
+    struct Row {
+        std::string raw;
+        std::vector<std::string> parents; // raw ids
+        int64_t timestamp;
+        uint32_t generation;
+    };
+
+    std::string to_raw(const std::string& id) {
+        std::string raw;
+        if (id.size() != Utils::UID_LENGTH || !Utils::fromHex(id, raw)) {
+            throw std::invalid_argument("bad commit id");
+        }
+        return raw;
+    }
+
+    /** Fills in generation numbers and writes ROWS, which must be sorted
+     *  by id and closed under parents. */
+    void write_rows(const std::string& path, std::vector<Row>& rows) {
+        std::map<std::string, uint32_t> pos;
+        for (uint32_t i = 0; i < rows.size(); i++) {
+            pos[rows[i].raw] = i;
+        }
+        std::vector<uint32_t> stack;
+        for (uint32_t i = 0; i < rows.size(); i++) {
+            stack.push_back(i);
+            while (!stack.empty()) {
+                Row& r = rows[stack.back()];
+                if (r.generation != 0) {
+                    stack.pop_back();
+                    continue;
+                }
+                uint32_t gen = 1;
+                bool ready = true;
+                for (auto &p : r.parents) {
+                    uint32_t g = rows[pos.at(p)].generation;
+                    if (g == 0) {
+                        stack.push_back(pos.at(p));
+                        ready = false;
+                    }
+                    gen = std::max(gen, g + 1);
+                }
+                if (ready) {
+                    r.generation = gen;
+                    stack.pop_back();
+                }
+            }
+        }
+
+        std::string out(MAGIC, 4);
+        Utils::putU32(out, VERSION);
+        Utils::putU32(out, static_cast<uint32_t>(rows.size()));
+        out.reserve(HEADER_SIZE + rows.size() * ENTRY_SIZE);
+        for (auto &r : rows) {
+            out += r.raw;
+            Utils::putU32(out, r.generation);
+            Utils::putU64(out, static_cast<uint64_t>(r.timestamp));
+            for (size_t k = 0; k < 2; k++) {
+                Utils::putU32(out, k < r.parents.size() ? pos.at(r.parents[k]) : CommitGraph::NONE);
+            }
+        }
+        Utils::writeAtomic(path, out);
+    }
+
+    /** Orders NODES so that every node comes after those of its parents
+     *  that are among NODES. */
+    std::vector<const CommitGraph::Node*> parents_first(const std::map<std::string, const CommitGraph::Node*>& nodes) {
+        std::vector<const CommitGraph::Node*> order;
+        std::set<std::string> seen;
+        std::vector<std::pair<const CommitGraph::Node*, bool>> stack;
+        for (auto &n : nodes) {
+            stack.emplace_back(n.second, false);
+        }
+        while (!stack.empty()) {
+            std::pair<const CommitGraph::Node*, bool> top = stack.back();
+            stack.pop_back();
+            if (top.second) {
+                order.push_back(top.first);
+                continue;
+            }
+            if (!seen.insert(top.first->id).second) {
+                continue;
+            }
+            stack.emplace_back(top.first, true);
+            for (auto &p : top.first->parents) {
+                auto it = nodes.find(p);
+                if (it != nodes.end()) {
+                    stack.emplace_back(it->second, false);
+                }
+            }
+        }
+        return order;
+    }
+}
+
+CommitGraph::CommitGraph(const std::string& path) : graphPath(path) {}
+
+bool CommitGraph::exists() const {
+    return Utils::isFile(graphPath);
+}
+
+CommitGraph::View CommitGraph::view() const {
+    return View(graphPath);
+}
+
+/** Replaces the graph with NODES.  Parents that are not among NODES are
+ *  dropped. */
+void CommitGraph::rebuild(const std::vector<Node>& nodes) const {
+    std::vector<Row> rows;
+    rows.reserve(nodes.size());
+    for (auto &n : nodes) {
+        Row r{to_raw(n.id), {}, static_cast<int64_t>(n.timestamp), 0};
+        for (auto &p : n.parents) {
+            r.parents.push_back(to_raw(p));
+        }
+        rows.push_back(std::move(r));
+    }
+    std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) { return a.raw < b.raw; });
+    rows.erase(std::unique(rows.begin(), rows.end(),
+                           [](const Row& a, const Row& b) { return a.raw == b.raw; }), rows.end());
+    for (auto &r : rows) {
+        r.parents.erase(std::remove_if(r.parents.begin(), r.parents.end(), [&](const std::string& p) {
+            auto it = std::lower_bound(rows.begin(), rows.end(), p,
+                                       [](const Row& row, const std::string& key) { return row.raw < key; });
+            return it == rows.end() || it->raw != p;
+        }), r.parents.end());
+    }
+    write_rows(graphPath, rows);
+}
+
+/** Adds NODE to the graph.  Returns false, leaving the file untouched, if
+ *  one of its parents is not in the graph yet. */
+bool CommitGraph::add(const Node& node) const {
+    return add(std::vector<Node>{node});
+}
+
+/** Adds NODES, in any order, to the graph.  A node's parents must be in
+ *  the graph or among NODES; otherwise nothing is written and false is
+ *  returned.  The new commits are appended to the tail, or merged with
+ *  it into the sorted entries with one rewrite when the tail would grow
+ *  past TAIL_LIMIT. */
+bool CommitGraph::add(const std::vector<Node>& nodes) const {
+    View v(graphPath);
+    uint32_t pos;
+    std::map<std::string, const Node*> incoming;
+    for (auto &node : nodes) {
+        if (!v.find(node.id, pos)) {
+            incoming.emplace(node.id, &node);
+        }
+    }
+    for (auto &in : incoming) {
+        for (auto &p : in.second->parents) {
+            if (!v.find(p, pos) && !incoming.count(p)) {
+                return false;
+            }
+        }
+    }
+    if (incoming.empty()) {
+        return true;
+    }
+    std::vector<const Node*> order = parents_first(incoming);
+
+    // Append unless the tail would grow too long, or the file has no
+    // header or ends in a torn entry.
+    FileStat st;
+    if (Utils::statFile(graphPath, st) && st.size >= HEADER_SIZE
+        && st.size == HEADER_SIZE + static_cast<uint64_t>(v.size()) * ENTRY_SIZE
+        && v.size() - v.sorted_size() + order.size() <= TAIL_LIMIT) {
+        std::map<std::string, std::pair<uint32_t, uint32_t>> placed; // id -> position, generation
+        std::string out;
+        for (auto node : order) {
+            uint32_t gen = 1;
+            std::vector<uint32_t> parents;
+            for (auto &p : node->parents) {
+                uint32_t at, g;
+                auto it = placed.find(p);
+                if (it != placed.end()) {
+                    at = it->second.first;
+                    g = it->second.second;
+                } else {
+                    v.find(p, at);
+                    g = v.generation(at);
+                }
+                parents.push_back(at);
+                gen = std::max(gen, g + 1);
+            }
+            placed[node->id] = {static_cast<uint32_t>(v.size() + placed.size()), gen};
+            out += to_raw(node->id);
+            Utils::putU32(out, gen);
+            Utils::putU64(out, static_cast<uint64_t>(node->timestamp));
+            for (size_t k = 0; k < 2; k++) {
+                Utils::putU32(out, k < parents.size() ? parents[k] : NONE);
+            }
+        }
+        Utils::appendFile(graphPath, out);
+        return true;
+    }
+
+    std::vector<Row> rows;
+    rows.reserve(v.size() + order.size());
+    for (uint32_t i = 0; i < v.size(); i++) {
+        Row r{to_raw(v.id(i)), {}, static_cast<int64_t>(v.timestamp(i)), v.generation(i)};
+        for (int k = 0; k < 2 && v.parent(i, k) != NONE; k++) {
+            r.parents.push_back(to_raw(v.id(v.parent(i, k))));
+        }
+        rows.push_back(std::move(r));
+    }
+    for (auto node : order) {
+        Row r{to_raw(node->id), {}, static_cast<int64_t>(node->timestamp), 0};
+        for (auto &p : node->parents) {
+            r.parents.push_back(to_raw(p));
+        }
+        rows.push_back(std::move(r));
+    }
+    std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) { return a.raw < b.raw; });
+    write_rows(graphPath, rows);
+    return true;
+}
+
+/** Maps the graph at PATH.  A torn last tail entry is ignored. */
+CommitGraph::View::View(const std::string& path) : file(path), count(0), total(0) {
+    if (file.size() == 0) {
+        return;
+    }
+    if (file.size() < HEADER_SIZE || std::memcmp(file.data(), MAGIC, 4) != 0
+        || Utils::getU32(file.data() + 4) != VERSION) {
+        throw std::runtime_error("Bad commit graph");
+    }
+    count = Utils::getU32(file.data() + 8);
+    if (HEADER_SIZE + static_cast<size_t>(count) * ENTRY_SIZE > file.size()) {
+        throw std::runtime_error("Bad commit graph");
+    }
+    total = static_cast<uint32_t>((file.size() - HEADER_SIZE) / ENTRY_SIZE);
+}
+
+const unsigned char* CommitGraph::View::entry(uint32_t pos) const {
+    return file.data() + HEADER_SIZE + static_cast<size_t>(pos) * ENTRY_SIZE;
+}
+
+uint32_t CommitGraph::View::size() const {
+    return total;
+}
+
+uint32_t CommitGraph::View::sorted_size() const {
+    return count;
+}
+
+bool CommitGraph::View::find(const std::string& id, uint32_t& pos) const {
+    std::string raw;
+    if (id.size() != Utils::UID_LENGTH || !Utils::fromHex(id, raw)) {
+        return false;
+    }
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = std::memcmp(entry(mid), raw.data(), RAW_ID_SIZE);
+        if (c == 0) {
+            pos = mid;
+            return true;
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (uint32_t i = count; i < total; i++) {
+        if (std::memcmp(entry(i), raw.data(), RAW_ID_SIZE) == 0) {
+            pos = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string CommitGraph::View::id(uint32_t pos) const {
+    return Utils::toHex(entry(pos), RAW_ID_SIZE);
+}
+
+uint32_t CommitGraph::View::generation(uint32_t pos) const {
+    return Utils::getU32(entry(pos) + RAW_ID_SIZE);
+}
+
+std::time_t CommitGraph::View::timestamp(uint32_t pos) const {
+    return static_cast<std::time_t>(Utils::getU64(entry(pos) + RAW_ID_SIZE + 4));
+}
+
+uint32_t CommitGraph::View::parent(uint32_t pos, int k) const {
+    uint32_t p = Utils::getU32(entry(pos) + RAW_ID_SIZE + 12 + 4 * k);
+    if (p != NONE && p >= total) {
+        throw std::runtime_error("Bad commit graph");
+    }
+    return p;
+}
+
+/** True if ANCESTOR is DESCENDANT or one of its ancestors.  Commits with a
+ *  generation below ANCESTOR's cannot lead to it and are not expanded. */
+bool CommitGraph::View::is_ancestor(uint32_t ancestor, uint32_t descendant) const {
+    uint32_t floor = generation(ancestor);
+    std::vector<bool> seen(total, false);
+    std::vector<uint32_t> stack = {descendant};
+    while (!stack.empty()) {
+        uint32_t c = stack.back();
+        stack.pop_back();
+        if (c == ancestor) {
+            return true;
+        }
+        if (seen[c] || generation(c) <= floor) {
+            continue;
+        }
+        seen[c] = true;
+        for (int k = 0; k < 2; k++) {
+            uint32_t p = parent(c, k);
+            if (p != NONE) {
+                stack.push_back(p);
+            }
+        }
+    }
+    return false;
+}
+
+/** The split point of a merge: the first ancestor of HEAD reached by a
+ *  breadth-first walk from GIVEN, or NONE if the histories are
+ *  unrelated. */
+uint32_t CommitGraph::View::split_point(uint32_t head, uint32_t given) const {
+    std::vector<bool> head_side(total, false);
+    std::vector<uint32_t> stack = {head};
+    while (!stack.empty()) {
+        uint32_t c = stack.back();
+        stack.pop_back();
+        if (head_side[c]) {
+            continue;
+        }
+        head_side[c] = true;
+        for (int k = 0; k < 2; k++) {
+            uint32_t p = parent(c, k);
+            if (p != NONE) {
+                stack.push_back(p);
+            }
+        }
+    }
+    std::vector<bool> seen(total, false);
+    std::deque<uint32_t> queue = {given};
+    while (!queue.empty()) {
+        uint32_t c = queue.front();
+        queue.pop_front();
+        if (head_side[c]) {
+            return c;
+        }
+        if (seen[c]) {
+            continue;
+        }
+        seen[c] = true;
+        for (int k = 0; k < 2; k++) {
+            uint32_t p = parent(c, k);
+            if (p != NONE) {
+                queue.push_back(p);
+            }
+        }
+    }
+    return NONE;
+}
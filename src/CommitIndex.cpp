@@ -0,0 +1,228 @@
+#include "../include/CommitIndex.h"
+#include "../include/Utils.h"
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    const char MAGIC[4] = {'G', 'L', 'C', 'I'};
+    const uint32_t VERSION = 1;
+    const size_t HEADER_SIZE = 12;
+    const size_t RAW_ID_SIZE = 20;
+
+    /** Read-only mapping of an index file.  An empty or missing file maps
+     *  to zero entries.  A torn last tail entry is ignored. */
+    struct MappedIndex {
+        void* addr = MAP_FAILED;
+        size_t size = 0;
+        const unsigned char* entries = nullptr;
+        size_t count = 0;
+        size_t tail_count = 0;
+
+        explicit MappedIndex(const std::string& path) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return;
+            }
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(HEADER_SIZE)) {
+                size = static_cast<size_t>(st.st_size);
+                addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            close(fd);
+            if (addr == MAP_FAILED) {
+                return;
+            }
+            const unsigned char* base = static_cast<const unsigned char*>(addr);
+            if (std::memcmp(base, MAGIC, 4) != 0 || Utils::getU32(base + 4) != VERSION) {
+                throw std::runtime_error("Bad commit index");
+            }
+            count = Utils::getU32(base + 8);
+            if (HEADER_SIZE + count * RAW_ID_SIZE > size) {
+                throw std::runtime_error("Bad commit index");
+            }
+            entries = base + HEADER_SIZE;
+            tail_count = (size - HEADER_SIZE) / RAW_ID_SIZE - count;
+        }
+
+        ~MappedIndex() {
+            if (addr != MAP_FAILED) {
+                munmap(addr, size);
+            }
+        }
+
+        MappedIndex(const MappedIndex&) = delete;
+        MappedIndex& operator=(const MappedIndex&) = delete;
+
+        /** Entry I: sorted entries first, then the tail. */
+        const unsigned char* at(size_t i) const {
+            return entries + i * RAW_ID_SIZE;
+        }
+
+        /** True if the 20-byte KEY is a sorted or tail entry. */
+        bool contains(const unsigned char* key) const {
+            size_t i = lower_bound(key);
+            if (i < count && std::memcmp(at(i), key, RAW_ID_SIZE) == 0) {
+                return true;
+            }
+            for (size_t j = count; j < count + tail_count; j++) {
+                if (std::memcmp(at(j), key, RAW_ID_SIZE) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /** Index of the first entry not less than the 20-byte KEY. */
+        size_t lower_bound(const unsigned char* key) const {
+            size_t lo = 0, hi = count;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (std::memcmp(at(mid), key, RAW_ID_SIZE) < 0) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            return lo;
+        }
+    };
+
+    /** True if the raw id ENTRY starts with the first NIBBLES hex digits
+     *  packed into KEY. */
+    bool has_prefix(const unsigned char* entry, const unsigned char* key, size_t nibbles) {
+        size_t full = nibbles / 2;
+        if (std::memcmp(entry, key, full) != 0) {
+            return false;
+        }
+        return nibbles % 2 == 0 || (entry[full] & 0xf0) == (key[full] & 0xf0);
+    }
+}
+
+CommitIndex::CommitIndex(const std::string& path) : indexPath(path) {}
+
+bool CommitIndex::exists() const {
+    return Utils::isFile(indexPath);
+}
+
+std::vector<std::string> CommitIndex::read_all() const {
+    MappedIndex map(indexPath);
+    std::vector<std::string> raw_ids;
+    raw_ids.reserve(map.count + map.tail_count + 1);
+    for (size_t i = 0; i < map.count + map.tail_count; i++) {
+        raw_ids.emplace_back(reinterpret_cast<const char*>(map.at(i)), RAW_ID_SIZE);
+    }
+    return raw_ids;
+}
+
+/** Replaces the index with the sorted, distinct RAW_IDS and no tail. */
+void CommitIndex::write_all(const std::vector<std::string>& raw_ids) const {
+    std::string out(MAGIC, 4);
+    Utils::putU32(out, VERSION);
+    Utils::putU32(out, static_cast<uint32_t>(raw_ids.size()));
+    out.reserve(HEADER_SIZE + raw_ids.size() * RAW_ID_SIZE);
+    for (auto &raw : raw_ids) {
+        out += raw;
+    }
+    Utils::writeAtomic(indexPath, out);
+}
+
+/** Replaces the index with exactly the commits in IDS. */
+void CommitIndex::rebuild(const std::vector<std::string>& ids) const {
+    std::vector<std::string> raw_ids;
+    for (auto &id : ids) {
+        std::string raw;
+        if (id.size() == Utils::UID_LENGTH && Utils::fromHex(id, raw)) {
+            raw_ids.push_back(raw);
+        }
+    }
+    std::sort(raw_ids.begin(), raw_ids.end());
+    raw_ids.erase(std::unique(raw_ids.begin(), raw_ids.end()), raw_ids.end());
+    write_all(raw_ids);
+}
+
+void CommitIndex::add(const std::string& id) const {
+    add(std::vector<std::string>{id});
+}
+
+/** Adds every commit of IDS that the index lacks.  They are appended to
+ *  the tail, or merged with it into the sorted entries with one rewrite
+ *  when the tail would grow past TAIL_LIMIT. */
+void CommitIndex::add(const std::vector<std::string>& ids) const {
+    std::string tail;
+    bool rewrite;
+    {
+        MappedIndex map(indexPath);
+        std::set<std::string> added;
+        for (auto &id : ids) {
+            std::string raw;
+            if (id.size() != Utils::UID_LENGTH || !Utils::fromHex(id, raw)) {
+                throw std::invalid_argument("bad commit id");
+            }
+            if (!map.contains(reinterpret_cast<const unsigned char*>(raw.data()))
+                && added.insert(raw).second) {
+                tail += raw;
+            }
+        }
+        if (tail.empty()) {
+            return;
+        }
+        // A missing index or a torn tail entry cannot be appended to.
+        rewrite = map.addr == MAP_FAILED || (map.size - HEADER_SIZE) % RAW_ID_SIZE != 0
+                  || map.tail_count + tail.size() / RAW_ID_SIZE > TAIL_LIMIT;
+    }
+    if (!rewrite) {
+        Utils::appendFile(indexPath, tail);
+        return;
+    }
+    std::vector<std::string> raw_ids = read_all();
+    for (size_t i = 0; i < tail.size(); i += RAW_ID_SIZE) {
+        raw_ids.push_back(tail.substr(i, RAW_ID_SIZE));
+    }
+    std::sort(raw_ids.begin(), raw_ids.end());
+    write_all(raw_ids);
+}
+
+bool CommitIndex::contains(const std::string& id) const {
+    std::string found;
+    return id.size() == Utils::UID_LENGTH && resolve(id, found) == 1;
+}
+
+/** Looks up the commit whose id starts with PREFIX.  Returns the number of
+ *  matches, capped at 2; when it is 1 the full id is stored in ID. */
+int CommitIndex::resolve(const std::string& prefix, std::string& id) const {
+    if (prefix.empty() || prefix.size() > Utils::UID_LENGTH) {
+        return 0;
+    }
+    std::string padded = prefix + std::string(Utils::UID_LENGTH - prefix.size(), '0');
+    std::string key;
+    if (!Utils::fromHex(padded, key)) {
+        return 0;
+    }
+    const unsigned char* raw_key = reinterpret_cast<const unsigned char*>(key.data());
+    MappedIndex map(indexPath);
+    int matches = 0;
+    auto match = [&](size_t i) {
+        if (matches == 0) {
+            id = Utils::toHex(map.at(i), RAW_ID_SIZE);
+        }
+        matches++;
+    };
+    for (size_t i = map.lower_bound(raw_key); i < map.count && matches < 2; i++) {
+        if (!has_prefix(map.at(i), raw_key, prefix.size())) {
+            break;
+        }
+        match(i);
+    }
+    for (size_t i = map.count; i < map.count + map.tail_count && matches < 2; i++) {
+        if (has_prefix(map.at(i), raw_key, prefix.size())) {
+            match(i);
+        }
+    }
+    return matches;
+}
@@ -0,0 +1,133 @@
+#include "../include/Delta.h"
+#include "../include/Utils.h"
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+    const size_t BLOCK = 16;
+    const uint32_t MULT = 0x01000193;
+    const uint8_t OP_COPY = 0x00;
+    const uint8_t OP_INSERT = 0x01;
+
+    /** Delta offsets and lengths are 32-bit; longer copies are split. */
+    const size_t MAX_RUN = 0xffffffffu;
+
+    uint32_t block_hash(const unsigned char* p) {
+        uint32_t h = 0;
+        for (size_t i = 0; i < BLOCK; i++) {
+            h = h * MULT + p[i];
+        }
+        return h;
+    }
+
+    void emit_insert(std::string& out, const std::string& target, size_t from, size_t to) {
+        while (from < to) {
+            size_t len = std::min(to - from, MAX_RUN);
+            out += static_cast<char>(OP_INSERT);
+            Utils::putU32(out, static_cast<uint32_t>(len));
+            out.append(target, from, len);
+            from += len;
+        }
+    }
+
+    void emit_copy(std::string& out, size_t offset, size_t len) {
+        while (len > 0) {
+            size_t run = std::min(len, MAX_RUN);
+            out += static_cast<char>(OP_COPY);
+            Utils::putU32(out, static_cast<uint32_t>(offset));
+            Utils::putU32(out, static_cast<uint32_t>(run));
+            offset += run;
+            len -= run;
+        }
+    }
+}
+
+std::string Delta::create(const std::string& base, const std::string& target) {
+    if (base.size() > MAX_RUN) {
+        throw std::invalid_argument("delta base too large");
+    }
+    std::string out;
+    Utils::putU64(out, base.size());
+    Utils::putU64(out, target.size());
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(base.data());
+    const unsigned char* t = reinterpret_cast<const unsigned char*>(target.data());
+    size_t n = target.size();
+    if (base.size() < BLOCK || n < BLOCK) {
+        emit_insert(out, target, 0, n);
+        return out;
+    }
+
+    std::unordered_map<uint32_t, uint32_t> blocks;
+    blocks.reserve(base.size() / BLOCK);
+    for (size_t off = 0; off + BLOCK <= base.size(); off += BLOCK) {
+        blocks.emplace(block_hash(b + off), static_cast<uint32_t>(off));
+    }
+
+    uint32_t top = 1;
+    for (size_t i = 1; i < BLOCK; i++) {
+        top *= MULT;
+    }
+    size_t pending = 0;
+    size_t i = 0;
+    uint32_t h = block_hash(t);
+    while (i + BLOCK <= n) {
+        auto it = blocks.find(h);
+        if (it != blocks.end() && std::memcmp(b + it->second, t + i, BLOCK) == 0) {
+            size_t src = it->second;
+            size_t start = i;
+            while (start > pending && src > 0 && b[src - 1] == t[start - 1]) {
+                start--;
+                src--;
+            }
+            size_t end = i + BLOCK;
+            size_t src_end = it->second + BLOCK;
+            while (end < n && src_end < base.size() && b[src_end] == t[end]) {
+                end++;
+                src_end++;
+            }
+            emit_insert(out, target, pending, start);
+            emit_copy(out, src, end - start);
+            pending = i = end;
+            if (i + BLOCK <= n) {
+                h = block_hash(t + i);
+            }
+            continue;
+        }
+        if (i + BLOCK < n) {
+            h = (h - t[i] * top) * MULT + t[i + BLOCK];
+        }
+        i++;
+    }
+    emit_insert(out, target, pending, n);
+    return out;
+}
+
+std::string Delta::apply(const std::string& base, const std::string& delta) {
+    ByteReader in(delta);
+    if (in.u64() != base.size()) {
+        throw std::runtime_error("delta base mismatch");
+    }
+    uint64_t size = in.u64();
+    std::string out;
+    out.reserve(size);
+    while (in.remaining() > 0) {
+        uint8_t op = in.u8();
+        if (op == OP_COPY) {
+            uint64_t offset = in.u32();
+            uint64_t len = in.u32();
+            if (offset + len > base.size()) {
+                throw std::runtime_error("corrupt delta");
+            }
+            out.append(base, offset, len);
+        } else if (op == OP_INSERT) {
+            out += in.bytes(in.u32());
+        } else {
+            throw std::runtime_error("corrupt delta");
+        }
+    }
+    if (out.size() != size) {
+        throw std::runtime_error("corrupt delta");
+    }
+    return out;
+}
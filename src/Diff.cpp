@@ -0,0 +1,301 @@
+#include "../include/Diff.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/** Mixes a line eight bytes per step; the tail is zero-padded into one
+ *  last word. */
+size_t LineInterner::LineHash::operator()(std::string_view line) const {
+    const uint64_t K = 0x9e3779b97f4a7c15ULL;
+    const char* p = line.data();
+    size_t n = line.size();
+    uint64_t h = n * K;
+    uint64_t w;
+    for (; n >= 8; n -= 8, p += 8) {
+        std::memcpy(&w, p, 8);
+        h = (h ^ w) * K;
+        h ^= h >> 32;
+    }
+    w = 0;
+    std::memcpy(&w, p, n);
+    h = (h ^ w) * K;
+    return static_cast<size_t>(h ^ (h >> 29));
+}
+
+void LineInterner::add(std::string_view line, std::vector<uint32_t>& result,
+                       std::vector<std::string_view>* lines) {
+    auto it = ids.emplace(line, static_cast<uint32_t>(ids.size())).first;
+    result.push_back(it->second);
+    if (lines != nullptr) {
+        lines->push_back(line);
+    }
+}
+
+/** Appends the line ids of TEXT, splitting after every newline; a last
+ *  line without one is a line of its own.  If LINES is given the lines
+ *  themselves are appended to it. */
+std::vector<uint32_t> LineInterner::intern(const std::string& text, std::vector<std::string_view>* lines) {
+    std::vector<uint32_t> result;
+    const char* start = text.data();
+    const char* p = start;
+    const char* end = p + text.size();
+#if defined(__SSE2__)
+    // Every newline of a 16-byte block comes out of one compare, so short
+    // lines cost a bit scan each instead of a memchr call.
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+        while (mask != 0) {
+            const char* next = p + __builtin_ctz(mask) + 1;
+            add(std::string_view(start, next - start), result, lines);
+            start = next;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while (p < end) {
+        const char* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (nl == nullptr) {
+            break;
+        }
+        p = nl + 1;
+        add(std::string_view(start, p - start), result, lines);
+        start = p;
+    }
+    if (start < end) {
+        add(std::string_view(start, end - start), result, lines);
+    }
+    return result;
+}
+
+size_t LineInterner::size() const {
+    return ids.size();
+}
+
+namespace {
+    const long SNAKE_SHORTCUT_MIN = 256;
+
+    struct Split {
+        long i1, i2;
+    };
+
+    /** Walks the edit graph of A[off1, lim1) and B[off2, lim2) from both
+     *  corners at once until the paths meet, and returns a point on an
+     *  optimal path (or, past MAX_COST, a good one).  KVDF and KVDB are
+     *  indexed by diagonal k = i1 - i2. */
+    Split split(const uint32_t* a, long off1, long lim1, const uint32_t* b, long off2, long lim2,
+                long* kvdf, long* kvdb, long max_cost) {
+        long dmin = off1 - lim2, dmax = lim1 - off2;
+        long fmid = off1 - off2, bmid = lim1 - lim2;
+        bool odd = ((fmid - bmid) & 1) != 0;
+        long fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+        kvdf[fmid] = off1;
+        kvdb[bmid] = lim1;
+        for (long cost = 1;; cost++) {
+            if (fmin > dmin) {
+                kvdf[--fmin - 1] = -1;
+            } else {
+                ++fmin;
+            }
+            if (fmax < dmax) {
+                kvdf[++fmax + 1] = -1;
+            } else {
+                --fmax;
+            }
+            for (long d = fmax; d >= fmin; d -= 2) {
+                long i1 = kvdf[d - 1] >= kvdf[d + 1] ? kvdf[d - 1] + 1 : kvdf[d + 1];
+                long i2 = i1 - d;
+                while (i1 < lim1 && i2 < lim2 && a[i1] == b[i2]) {
+                    i1++;
+                    i2++;
+                }
+                kvdf[d] = i1;
+                if (odd && bmin <= d && d <= bmax && kvdb[d] <= i1) {
+                    return Split{i1, i2};
+                }
+            }
+
+            if (bmin > dmin) {
+                kvdb[--bmin - 1] = lim1 + 1;
+            } else {
+                ++bmin;
+            }
+            if (bmax < dmax) {
+                kvdb[++bmax + 1] = lim1 + 1;
+            } else {
+                --bmax;
+            }
+            for (long d = bmax; d >= bmin; d -= 2) {
+                long i1 = kvdb[d - 1] < kvdb[d + 1] ? kvdb[d - 1] : kvdb[d + 1] - 1;
+                long i2 = i1 - d;
+                while (i1 > off1 && i2 > off2 && a[i1 - 1] == b[i2 - 1]) {
+                    i1--;
+                    i2--;
+                }
+                kvdb[d] = i1;
+                if (!odd && fmin <= d && d <= fmax && i1 <= kvdf[d]) {
+                    return Split{i1, i2};
+                }
+            }
+
+            if (cost >= max_cost) {
+                // Too expensive: split where either search got furthest.
+                long fbest = -1, fbest1 = -1;
+                for (long d = fmax; d >= fmin; d -= 2) {
+                    long i1 = std::min(kvdf[d], lim1);
+                    long i2 = i1 - d;
+                    if (lim2 < i2) {
+                        i1 = lim2 + d;
+                        i2 = lim2;
+                    }
+                    if (fbest < i1 + i2) {
+                        fbest = i1 + i2;
+                        fbest1 = i1;
+                    }
+                }
+                long bbest = lim1 + lim2 + 1, bbest1 = lim1;
+                for (long d = bmax; d >= bmin; d -= 2) {
+                    long i1 = std::max(off1, kvdb[d]);
+                    long i2 = i1 - d;
+                    if (i2 < off2) {
+                        i1 = off2 + d;
+                        i2 = off2;
+                    }
+                    if (i1 + i2 < bbest) {
+                        bbest = i1 + i2;
+                        bbest1 = i1;
+                    }
+                }
+                if ((lim1 + lim2) - bbest < fbest - (off1 + off2)) {
+                    return Split{fbest1, fbest - fbest1};
+                }
+                return Split{bbest1, bbest - bbest1};
+            }
+        }
+    }
+}
+
+std::vector<Diff::Hunk> Diff::compute(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+    long n = static_cast<long>(a.size()), m = static_cast<long>(b.size());
+    std::vector<char> deleted(n + 1, 0), inserted(m + 1, 0);
+    std::vector<long> kv(2 * (n + m + 3));
+    long* kvdf = kv.data() + m + 1;
+    long* kvdb = kvdf + n + m + 3;
+    long max_cost = 1;
+    while (max_cost * max_cost < n + m + 3) {
+        max_cost *= 2;
+    }
+    max_cost = std::max(max_cost, SNAKE_SHORTCUT_MIN);
+
+    struct Range {
+        long off1, lim1, off2, lim2;
+    };
+    std::vector<Range> pending{Range{0, n, 0, m}};
+    while (!pending.empty()) {
+        Range r = pending.back();
+        pending.pop_back();
+        while (r.off1 < r.lim1 && r.off2 < r.lim2 && a[r.off1] == b[r.off2]) {
+            r.off1++;
+            r.off2++;
+        }
+        while (r.off1 < r.lim1 && r.off2 < r.lim2 && a[r.lim1 - 1] == b[r.lim2 - 1]) {
+            r.lim1--;
+            r.lim2--;
+        }
+        if (r.off1 == r.lim1) {
+            std::fill(inserted.begin() + r.off2, inserted.begin() + r.lim2, 1);
+        } else if (r.off2 == r.lim2) {
+            std::fill(deleted.begin() + r.off1, deleted.begin() + r.lim1, 1);
+        } else {
+            Split s = split(a.data(), r.off1, r.lim1, b.data(), r.off2, r.lim2, kvdf, kvdb, max_cost);
+            pending.push_back(Range{s.i1, r.lim1, s.i2, r.lim2});
+            pending.push_back(Range{r.off1, s.i1, r.off2, s.i2});
+        }
+    }
+
+    std::vector<Hunk> hunks;
+    size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size()) {
+        if (i < a.size() && j < b.size() && !deleted[i] && !inserted[j]) {
+            i++;
+            j++;
+            continue;
+        }
+        Hunk h{i, i, j, j};
+        while (h.a_end < a.size() && deleted[h.a_end]) {
+            h.a_end++;
+        }
+        while (h.b_end < b.size() && inserted[h.b_end]) {
+            h.b_end++;
+        }
+        hunks.push_back(h);
+        i = h.a_end;
+        j = h.b_end;
+    }
+    return hunks;
+}
+
+namespace {
+    /** Writes a unified range: the first line (or, when empty, the line
+     *  before it) and the length, which is left out when it is 1. */
+    void write_range(std::ostream& out, size_t begin, size_t length) {
+        out << (length == 0 ? begin : begin + 1);
+        if (length != 1) {
+            out << ',' << length;
+        }
+    }
+
+    void write_line(std::ostream& out, char tag, std::string_view line) {
+        out << tag;
+        out.write(line.data(), line.size());
+        if (line.empty() || line.back() != '\n') {
+            out << "\n\\ No newline at end of file\n";
+        }
+    }
+}
+
+void Diff::unified(const std::string& a, const std::string& b, std::ostream& out, size_t context) {
+    LineInterner interner;
+    std::vector<std::string_view> a_lines, b_lines;
+    std::vector<uint32_t> a_ids = interner.intern(a, &a_lines);
+    std::vector<uint32_t> b_ids = interner.intern(b, &b_lines);
+    std::vector<Hunk> hunks = compute(a_ids, b_ids);
+    for (size_t first = 0; first < hunks.size();) {
+        // Hunks whose contexts would touch are printed as one.
+        size_t last = first;
+        while (last + 1 < hunks.size() && hunks[last + 1].a_begin - hunks[last].a_end <= 2 * context) {
+            last++;
+        }
+        size_t a_begin = hunks[first].a_begin - std::min(context, hunks[first].a_begin);
+        size_t a_end = std::min(a_lines.size(), hunks[last].a_end + context);
+        size_t b_begin = hunks[first].b_begin - (hunks[first].a_begin - a_begin);
+        size_t b_end = hunks[last].b_end + (a_end - hunks[last].a_end);
+        out << "@@ -";
+        write_range(out, a_begin, a_end - a_begin);
+        out << " +";
+        write_range(out, b_begin, b_end - b_begin);
+        out << " @@\n";
+        size_t pos = a_begin;
+        for (size_t k = first; k <= last; k++) {
+            const Hunk& h = hunks[k];
+            for (; pos < h.a_begin; pos++) {
+                write_line(out, ' ', a_lines[pos]);
+            }
+            for (size_t i = h.a_begin; i < h.a_end; i++) {
+                write_line(out, '-', a_lines[i]);
+            }
+            for (size_t j = h.b_begin; j < h.b_end; j++) {
+                write_line(out, '+', b_lines[j]);
+            }
+            pos = h.a_end;
+        }
+        for (; pos < a_end; pos++) {
+            write_line(out, ' ', a_lines[pos]);
+        }
+        first = last + 1;
+    }
+}
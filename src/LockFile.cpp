@@ -0,0 +1,171 @@
+#include "../include/LockFile.h"
+#include "../include/Utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <mutex>
+#include <set>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+    /** A lock file that is still empty or unreadable after this long was
+     *  left by a process that died between creating and filling it. */
+    const int TORN_AGE_SECONDS = 10;
+
+    std::mutex heldLock;
+    std::set<std::string>& heldPaths() {
+        static std::set<std::string>* paths = new std::set<std::string>();
+        return *paths;
+    }
+
+    void releaseAllAtExit() {
+        std::lock_guard<std::mutex> guard(heldLock);
+        for (auto &p : heldPaths()) {
+            unlink(p.c_str());
+        }
+        heldPaths().clear();
+    }
+
+    std::string hostName() {
+        char name[256] = {0};
+        gethostname(name, sizeof(name) - 1);
+        return name;
+    }
+}
+
+LockFile::LockFile(const std::string& path) : lockPath(path), held(false) {}
+
+LockFile::~LockFile() {
+    release();
+}
+
+/** How long commands wait for a lock: GITLITE_LOCK_TIMEOUT milliseconds
+ *  if set, else ten seconds. */
+int LockFile::timeout_ms() {
+    const char* env = std::getenv("GITLITE_LOCK_TIMEOUT");
+    if (env != nullptr && *env != '\0') {
+        return std::max(0, std::atoi(env));
+    }
+    return 10000;
+}
+
+const std::string& LockFile::path() const {
+    return lockPath;
+}
+
+bool LockFile::held_by_us() const {
+    return held;
+}
+
+bool LockFile::try_create() {
+    int fd = open(lockPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        if (errno != EEXIST) {
+            throw std::runtime_error("cannot create " + lockPath);
+        }
+        return false;
+    }
+    std::string owner = std::to_string(getpid()) + " " + hostName() + "\n";
+    ssize_t n = write(fd, owner.data(), owner.size());
+    close(fd);
+    if (n != static_cast<ssize_t>(owner.size())) {
+        unlink(lockPath.c_str());
+        throw std::runtime_error("cannot write " + lockPath);
+    }
+    {
+        static std::once_flag registered;
+        std::call_once(registered, [] { std::atexit(releaseAllAtExit); });
+        std::lock_guard<std::mutex> guard(heldLock);
+        heldPaths().insert(lockPath);
+    }
+    held = true;
+    return true;
+}
+
+/** Removes the lock file if its holder is gone: a process on this host
+ *  that no longer exists, or a lock that was never filled in.  The file
+ *  is first renamed to a name of our own, so of several waiters only one
+ *  breaks it, and a lock taken in the meantime is put back. */
+bool LockFile::break_if_stale() {
+    std::string owner;
+    struct stat st;
+    if (stat(lockPath.c_str(), &st) != 0) {
+        return errno == ENOENT;
+    }
+    try {
+        owner = Utils::readContentsAsString(lockPath);
+    } catch (const std::exception&) {
+        return false;
+    }
+    size_t space = owner.find(' ');
+    bool stale;
+    if (space == std::string::npos || owner.back() != '\n') {
+        stale = time(nullptr) - st.st_mtime > TORN_AGE_SECONDS;
+    } else {
+        pid_t pid = static_cast<pid_t>(std::atol(owner.substr(0, space).c_str()));
+        std::string host = owner.substr(space + 1, owner.size() - space - 2);
+        stale = host == hostName() && pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+    }
+    if (!stale) {
+        return false;
+    }
+    std::string claimed = lockPath + ".stale-" + std::to_string(getpid());
+    if (std::rename(lockPath.c_str(), claimed.c_str()) != 0) {
+        return false;
+    }
+    std::string taken;
+    try {
+        taken = Utils::readContentsAsString(claimed);
+    } catch (const std::exception&) {
+    }
+    if (taken != owner) {
+        // Someone locked between our check and the rename; restore theirs.
+        link(claimed.c_str(), lockPath.c_str());
+    }
+    unlink(claimed.c_str());
+    return true;
+}
+
+/** Takes the lock if nobody holds it, breaking a stale one; never waits. */
+bool LockFile::try_acquire() {
+    if (held) {
+        return true;
+    }
+    if (try_create()) {
+        return true;
+    }
+    return break_if_stale() && try_create();
+}
+
+/** Takes the lock, waiting up to TIMEOUT_MS milliseconds for its holder to
+ *  release it.  Returns false if it is still held after that. */
+bool LockFile::acquire(int timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    auto pause = std::chrono::milliseconds(1);
+    while (!try_acquire()) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(pause, deadline - now));
+        pause = std::min(pause * 2, std::chrono::milliseconds(100));
+    }
+    return true;
+}
+
+void LockFile::release() {
+    if (!held) {
+        return;
+    }
+    unlink(lockPath.c_str());
+    std::lock_guard<std::mutex> guard(heldLock);
+    heldPaths().erase(lockPath);
+    held = false;
+}
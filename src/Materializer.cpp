@@ -0,0 +1,39 @@
+#include "../include/Materializer.h"
+#include <set>
+#include <stdexcept>
+
+Materializer::Materializer(const Loader& load) : load(load) {}
+
+void Materializer::add(const std::string& path, const std::string& blob_id) {
+    pending.push_back(File{path, blob_id, FileStat()});
+}
+
+size_t Materializer::size() const {
+    return pending.size();
+}
+
+const std::vector<Materializer::File>& Materializer::files() const {
+    return pending;
+}
+
+void Materializer::run() {
+    std::set<std::string> dirs;
+    for (auto &f : pending) {
+        for (size_t slash = f.path.find('/'); slash != std::string::npos;
+             slash = f.path.find('/', slash + 1)) {
+            dirs.insert(f.path.substr(0, slash));
+        }
+    }
+    // A parent sorts before its children, so each mkdir finds its parent.
+    for (auto &d : dirs) {
+        if (mkdir(d.c_str(), 0755) != 0 && !Utils::isDirectory(d)) {
+            throw std::runtime_error("cannot create directory " + d);
+        }
+    }
+    Utils::parallelFor(pending.size(), [&](size_t i) {
+        File& f = pending[i];
+        Utils::writeFile(f.path, [&](const Utils::ByteSink& sink) {
+            load(f.blob_id, sink);
+        }, f.stat);
+    });
+}
@@ -0,0 +1,104 @@
+#include "../include/Merge3.h"
+#include "../include/Diff.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+    typedef std::vector<std::string_view> Lines;
+
+    void append(std::string& out, const Lines& lines, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            out.append(lines[i].data(), lines[i].size());
+        }
+    }
+
+    /** Appends one side of a conflict, ending it with a newline so the
+     *  next marker starts a line of its own. */
+    void append_side(std::string& out, const Lines& lines, size_t begin, size_t end) {
+        append(out, lines, begin, end);
+        if (begin < end && out.back() != '\n') {
+            out += '\n';
+        }
+    }
+
+    /** The range of a side's lines that replaces base lines [LO, HI), given
+     *  the side's hunks [FIRST, LAST] inside that range. */
+    void side_range(const std::vector<Diff::Hunk>& hunks, size_t first, size_t last,
+                    size_t lo, size_t hi, size_t& begin, size_t& end) {
+        begin = hunks[first].b_begin - (hunks[first].a_begin - lo);
+        end = hunks[last].b_end + (hi - hunks[last].a_end);
+    }
+}
+
+bool Merge3::is_binary(const std::string& content) {
+    return std::memchr(content.data(), '\0', std::min<size_t>(content.size(), 8000)) != nullptr;
+}
+
+Merge3::Result Merge3::merge(const std::string& base, const std::string& ours, const std::string& theirs) {
+    LineInterner interner;
+    Lines base_lines, our_lines, their_lines;
+    std::vector<uint32_t> b = interner.intern(base, &base_lines);
+    std::vector<uint32_t> o = interner.intern(ours, &our_lines);
+    std::vector<uint32_t> t = interner.intern(theirs, &their_lines);
+    std::vector<Diff::Hunk> mine = Diff::compute(b, o);
+    std::vector<Diff::Hunk> other = Diff::compute(b, t);
+
+    Result result;
+    result.text.reserve(std::max(ours.size(), theirs.size()));
+    size_t i = 0, j = 0, pos = 0;
+    while (i < mine.size() || j < other.size()) {
+        // Start a group at the earliest hunk and pull in every hunk of
+        // either side that overlaps or touches its base range.
+        bool take_mine = j == other.size()
+            || (i < mine.size() && mine[i].a_begin <= other[j].a_begin);
+        size_t lo = take_mine ? mine[i].a_begin : other[j].a_begin;
+        size_t hi = lo;
+        size_t i0 = i, j0 = j;
+        for (;;) {
+            if (i < mine.size() && mine[i].a_begin <= hi) {
+                hi = std::max(hi, mine[i++].a_end);
+            } else if (j < other.size() && other[j].a_begin <= hi) {
+                hi = std::max(hi, other[j++].a_end);
+            } else {
+                break;
+            }
+        }
+        append(result.text, base_lines, pos, lo);
+        pos = hi;
+        size_t o_begin, o_end, t_begin, t_end;
+        if (j == j0) {
+            side_range(mine, i0, i - 1, lo, hi, o_begin, o_end);
+            append(result.text, our_lines, o_begin, o_end);
+            continue;
+        }
+        if (i == i0) {
+            side_range(other, j0, j - 1, lo, hi, t_begin, t_end);
+            append(result.text, their_lines, t_begin, t_end);
+            continue;
+        }
+        side_range(mine, i0, i - 1, lo, hi, o_begin, o_end);
+        side_range(other, j0, j - 1, lo, hi, t_begin, t_end);
+        while (o_begin < o_end && t_begin < t_end && o[o_begin] == t[t_begin]) {
+            append(result.text, our_lines, o_begin, o_begin + 1);
+            o_begin++;
+            t_begin++;
+        }
+        size_t common_end = 0;
+        while (o_begin < o_end && t_begin < t_end && o[o_end - 1] == t[t_end - 1]) {
+            o_end--;
+            t_end--;
+            common_end++;
+        }
+        if (o_begin < o_end || t_begin < t_end) {
+            result.conflicts++;
+            result.text += "<<<<<<< HEAD\n";
+            append_side(result.text, our_lines, o_begin, o_end);
+            result.text += "=======\n";
+            append_side(result.text, their_lines, t_begin, t_end);
+            result.text += ">>>>>>>\n";
+        }
+        append(result.text, our_lines, o_end, o_end + common_end);
+    }
+    append(result.text, base_lines, pos, base_lines.size());
+    return result;
+}
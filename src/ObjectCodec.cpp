@@ -0,0 +1,498 @@
+#include "../include/ObjectCodec.h"
+#include "../include/Utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#ifdef GITLITE_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef GITLITE_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+    const char MAGIC[4] = {'\x7f', 'G', 'L', 'O'};
+    const uint8_t VERSION = 1;
+
+    /** Payloads smaller than this are stored uncompressed; the codec
+     *  framing would outweigh the savings. */
+    const size_t MIN_COMPRESS_SIZE = 64;
+
+    std::string compress(Codec codec, const std::string& data) {
+        std::string out;
+        switch (codec) {
+#ifdef GITLITE_HAVE_ZLIB
+        case Codec::Zlib: {
+            uLongf len = compressBound(static_cast<uLong>(data.size()));
+            out.resize(len);
+            if (compress2(reinterpret_cast<Bytef*>(&out[0]), &len,
+                          reinterpret_cast<const Bytef*>(data.data()),
+                          static_cast<uLong>(data.size()), Z_BEST_SPEED) != Z_OK) {
+                throw std::runtime_error("zlib compression failed");
+            }
+            out.resize(len);
+            return out;
+        }
+#endif
+#ifdef GITLITE_HAVE_ZSTD
+        case Codec::Zstd: {
+            out.resize(ZSTD_compressBound(data.size()));
+            size_t len = ZSTD_compress(&out[0], out.size(), data.data(), data.size(), 3);
+            if (ZSTD_isError(len)) {
+                throw std::runtime_error("zstd compression failed");
+            }
+            out.resize(len);
+            return out;
+        }
+#endif
+        default:
+            throw std::runtime_error("codec not available");
+        }
+    }
+
+    /** No payload of SIZE bytes inflates to more than this under CODEC:
+     *  deflate expands at most 1032 times, and a zstd block of 128 KiB
+     *  takes at least 4 bytes. */
+    uint64_t max_expansion(Codec codec, size_t size) {
+        uint64_t ratio = codec == Codec::Zstd ? 32768 : 1032;
+        return static_cast<uint64_t>(size) * ratio + 1024;
+    }
+
+    std::string decompress(Codec codec, const char* data, size_t size, uint64_t expected) {
+        // A corrupt size must fail here rather than be allocated.
+        if (expected > max_expansion(codec, size)) {
+            throw std::runtime_error("corrupt object size");
+        }
+        std::string out(expected, '\0');
+        switch (codec) {
+#ifdef GITLITE_HAVE_ZLIB
+        case Codec::Zlib: {
+            uLongf len = static_cast<uLongf>(expected);
+            if (uncompress(reinterpret_cast<Bytef*>(&out[0]), &len,
+                           reinterpret_cast<const Bytef*>(data), static_cast<uLong>(size)) != Z_OK
+                || len != expected) {
+                throw std::runtime_error("corrupt zlib object");
+            }
+            return out;
+        }
+#endif
+#ifdef GITLITE_HAVE_ZSTD
+        case Codec::Zstd: {
+            size_t len = ZSTD_decompress(&out[0], out.size(), data, size);
+            if (ZSTD_isError(len) || len != expected) {
+                throw std::runtime_error("corrupt zstd object");
+            }
+            return out;
+        }
+#endif
+        default:
+            throw std::runtime_error(std::string("object uses unsupported codec ")
+                                     + ObjectCodec::name(codec));
+        }
+    }
+}
+
+bool ObjectCodec::available(Codec codec) {
+    switch (codec) {
+    case Codec::None:
+        return true;
+    case Codec::Zlib:
+#ifdef GITLITE_HAVE_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    case Codec::Zstd:
+#ifdef GITLITE_HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+const char* ObjectCodec::name(Codec codec) {
+    switch (codec) {
+    case Codec::None:
+        return "none";
+    case Codec::Zlib:
+        return "zlib";
+    case Codec::Zstd:
+        return "zstd";
+    }
+    return "unknown";
+}
+
+Codec ObjectCodec::preferred() {
+    static const Codec chosen = [] {
+        const char* env = std::getenv("GITLITE_COMPRESSION");
+        if (env != nullptr) {
+            for (Codec c : {Codec::None, Codec::Zlib, Codec::Zstd}) {
+                if (std::strcmp(env, name(c)) == 0 && available(c)) {
+                    return c;
+                }
+            }
+        }
+        if (available(Codec::Zstd)) {
+            return Codec::Zstd;
+        }
+        return available(Codec::Zlib) ? Codec::Zlib : Codec::None;
+    }();
+    return chosen;
+}
+
+std::string ObjectCodec::encode(ObjectType type, const std::string& data, Codec codec) {
+    std::string payload;
+    if (codec != Codec::None && data.size() >= MIN_COMPRESS_SIZE) {
+        payload = compress(codec, data);
+        if (payload.size() >= data.size()) {
+            codec = Codec::None;
+        }
+    } else {
+        codec = Codec::None;
+    }
+    std::string out(MAGIC, 4);
+    out += static_cast<char>(VERSION);
+    out += static_cast<char>(type);
+    out += static_cast<char>(codec);
+    Utils::putU64(out, data.size());
+    out.reserve(HEADER_SIZE + (codec == Codec::None ? data.size() : payload.size()));
+    out += codec == Codec::None ? data : payload;
+    return out;
+}
+
+bool ObjectCodec::is_encoded(const std::string& raw) {
+    return raw.size() >= HEADER_SIZE && std::memcmp(raw.data(), MAGIC, 4) == 0;
+}
+
+bool ObjectCodec::is_encoded(const std::string& raw, ObjectType type) {
+    return is_encoded(raw) && static_cast<uint8_t>(raw[5]) == static_cast<uint8_t>(type);
+}
+
+/** Returns the uncompressed content of the stored object RAW. */
+std::string ObjectCodec::decode(const std::string& raw) {
+    if (!is_encoded(raw)) {
+        return raw;
+    }
+    if (static_cast<uint8_t>(raw[4]) != VERSION) {
+        throw std::runtime_error("unknown object format version");
+    }
+    Codec codec = static_cast<Codec>(raw[6]);
+    uint64_t size = Utils::getU64(reinterpret_cast<const unsigned char*>(raw.data()) + 7);
+    if (codec == Codec::None) {
+        if (raw.size() - HEADER_SIZE != size) {
+            throw std::runtime_error("truncated object");
+        }
+        return raw.substr(HEADER_SIZE);
+    }
+    return decompress(codec, raw.data() + HEADER_SIZE, raw.size() - HEADER_SIZE, size);
+}
+
+namespace {
+    const size_t STREAM_BUFFER = 64 * 1024;
+
+    void write_all(int fd, const char* data, size_t len) {
+        while (len > 0) {
+            ssize_t n = ::write(fd, data, len);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("cannot write object");
+            }
+            data += n;
+            len -= static_cast<size_t>(n);
+        }
+    }
+}
+
+struct ObjectEncoder::State {
+    std::string out;
+#ifdef GITLITE_HAVE_ZLIB
+    z_stream z;
+#endif
+#ifdef GITLITE_HAVE_ZSTD
+    ZSTD_CStream* zs = nullptr;
+#endif
+    const char* in = nullptr;
+    size_t inLen = 0;
+};
+
+ObjectEncoder::ObjectEncoder(int fd, ObjectType type, Codec codec)
+    : fd(fd), codec(codec), total(0), state(new State) {
+    if (!ObjectCodec::available(codec)) {
+        throw std::runtime_error("codec not available");
+    }
+    std::string header(MAGIC, 4);
+    header += static_cast<char>(VERSION);
+    header += static_cast<char>(type);
+    header += static_cast<char>(codec);
+    Utils::putU64(header, 0);
+    put(header.data(), header.size());
+    state->out.resize(STREAM_BUFFER);
+#ifdef GITLITE_HAVE_ZLIB
+    if (codec == Codec::Zlib) {
+        std::memset(&state->z, 0, sizeof(state->z));
+        if (deflateInit(&state->z, Z_BEST_SPEED) != Z_OK) {
+            throw std::runtime_error("zlib compression failed");
+        }
+    }
+#endif
+#ifdef GITLITE_HAVE_ZSTD
+    if (codec == Codec::Zstd) {
+        state->zs = ZSTD_createCStream();
+        if (state->zs == nullptr || ZSTD_isError(ZSTD_initCStream(state->zs, 3))) {
+            throw std::runtime_error("zstd compression failed");
+        }
+    }
+#endif
+}
+
+ObjectEncoder::~ObjectEncoder() {
+#ifdef GITLITE_HAVE_ZLIB
+    if (codec == Codec::Zlib) {
+        deflateEnd(&state->z);
+    }
+#endif
+#ifdef GITLITE_HAVE_ZSTD
+    if (codec == Codec::Zstd) {
+        ZSTD_freeCStream(state->zs);
+    }
+#endif
+}
+
+void ObjectEncoder::put(const char* data, size_t len) {
+    write_all(fd, data, len);
+}
+
+/** Runs the compressor over the buffered input, writing out each full
+ *  output buffer.  With LAST set the stream is flushed and closed. */
+void ObjectEncoder::pump(bool last) {
+    switch (codec) {
+#ifdef GITLITE_HAVE_ZLIB
+    case Codec::Zlib: {
+        char* out = &state->out[0];
+        z_stream& z = state->z;
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(state->in));
+        z.avail_in = static_cast<uInt>(state->inLen);
+        int ret;
+        do {
+            z.next_out = reinterpret_cast<Bytef*>(out);
+            z.avail_out = static_cast<uInt>(STREAM_BUFFER);
+            ret = deflate(&z, last ? Z_FINISH : Z_NO_FLUSH);
+            if (ret == Z_STREAM_ERROR) {
+                throw std::runtime_error("zlib compression failed");
+            }
+            put(out, STREAM_BUFFER - z.avail_out);
+        } while (z.avail_out == 0 || (last && ret != Z_STREAM_END));
+        break;
+    }
+#endif
+#ifdef GITLITE_HAVE_ZSTD
+    case Codec::Zstd: {
+        char* out = &state->out[0];
+        ZSTD_inBuffer in = {state->in, state->inLen, 0};
+        size_t remaining;
+        do {
+            ZSTD_outBuffer o = {out, STREAM_BUFFER, 0};
+            remaining = last ? ZSTD_endStream(state->zs, &o) : ZSTD_compressStream(state->zs, &o, &in);
+            if (ZSTD_isError(remaining)) {
+                throw std::runtime_error("zstd compression failed");
+            }
+            put(out, o.pos);
+            if (!last && in.pos == in.size && o.pos < o.size) {
+                break;
+            }
+        } while (last ? remaining != 0 : true);
+        break;
+    }
+#endif
+    default:
+        put(state->in, state->inLen);
+    }
+    state->in = nullptr;
+    state->inLen = 0;
+}
+
+void ObjectEncoder::write(const char* data, size_t len) {
+    total += len;
+    state->in = data;
+    state->inLen = len;
+    pump(false);
+}
+
+void ObjectEncoder::write(const std::string& data) {
+    write(data.data(), data.size());
+}
+
+/** Flushes the compressor and fills in the uncompressed size. */
+void ObjectEncoder::finish() {
+    if (codec != Codec::None) {
+        pump(true);
+    }
+    std::string size;
+    Utils::putU64(size, total);
+    if (pwrite(fd, size.data(), size.size(), 7) != static_cast<ssize_t>(size.size())) {
+        throw std::runtime_error("cannot write object");
+    }
+}
+
+struct ObjectDecoder::State {
+    std::string in;
+#ifdef GITLITE_HAVE_ZLIB
+    z_stream z;
+#endif
+#ifdef GITLITE_HAVE_ZSTD
+    ZSTD_DStream* zs = nullptr;
+    ZSTD_inBuffer zin = {nullptr, 0, 0};
+#endif
+    bool started = false;
+};
+
+ObjectDecoder::ObjectDecoder(int fd)
+    : fd(fd), codec(Codec::None), left(UINT64_MAX), pendingPos(0), state(new State) {
+    char header[ObjectCodec::HEADER_SIZE];
+    size_t got = read_raw(header, sizeof(header));
+    pending.assign(header, got);
+    if (!ObjectCodec::is_encoded(pending)) {
+        return;
+    }
+    if (static_cast<uint8_t>(pending[4]) != VERSION) {
+        throw std::runtime_error("unknown object format version");
+    }
+    codec = static_cast<Codec>(pending[6]);
+    left = Utils::getU64(reinterpret_cast<const unsigned char*>(pending.data()) + 7);
+    pending.clear();
+    if (!ObjectCodec::available(codec)) {
+        throw std::runtime_error(std::string("object uses unsupported codec ")
+                                 + ObjectCodec::name(codec));
+    }
+    state->in.resize(STREAM_BUFFER);
+#ifdef GITLITE_HAVE_ZLIB
+    if (codec == Codec::Zlib) {
+        std::memset(&state->z, 0, sizeof(state->z));
+        if (inflateInit(&state->z) != Z_OK) {
+            throw std::runtime_error("corrupt zlib object");
+        }
+    }
+#endif
+#ifdef GITLITE_HAVE_ZSTD
+    if (codec == Codec::Zstd) {
+        state->zs = ZSTD_createDStream();
+        if (state->zs == nullptr || ZSTD_isError(ZSTD_initDStream(state->zs))) {
+            throw std::runtime_error("corrupt zstd object");
+        }
+    }
+#endif
+}
+
+ObjectDecoder::ObjectDecoder(std::string data)
+    : fd(-1), codec(Codec::None), left(0), pending(std::move(data)), pendingPos(0), state(new State) {}
+
+ObjectDecoder::~ObjectDecoder() {
+#ifdef GITLITE_HAVE_ZLIB
+    if (codec == Codec::Zlib) {
+        inflateEnd(&state->z);
+    }
+#endif
+#ifdef GITLITE_HAVE_ZSTD
+    if (codec == Codec::Zstd) {
+        ZSTD_freeDStream(state->zs);
+    }
+#endif
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+size_t ObjectDecoder::read_raw(char* buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = ::read(fd, buf + got, len - got);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("cannot read object");
+        }
+        if (n == 0) {
+            break;
+        }
+        got += static_cast<size_t>(n);
+    }
+    return got;
+}
+
+size_t ObjectDecoder::read(char* buf, size_t len) {
+    if (pendingPos < pending.size()) {
+        size_t n = std::min(len, pending.size() - pendingPos);
+        std::memcpy(buf, pending.data() + pendingPos, n);
+        pendingPos += n;
+        return n;
+    }
+    if (fd < 0 || left == 0 || len == 0) {
+        return 0;
+    }
+    size_t n = 0;
+    switch (codec) {
+#ifdef GITLITE_HAVE_ZLIB
+    case Codec::Zlib: {
+        z_stream& z = state->z;
+        z.next_out = reinterpret_cast<Bytef*>(buf);
+        z.avail_out = static_cast<uInt>(std::min<uint64_t>(len, left));
+        while (z.avail_out > 0) {
+            if (z.avail_in == 0) {
+                size_t got = read_raw(&state->in[0], state->in.size());
+                if (got == 0) {
+                    throw std::runtime_error("truncated object");
+                }
+                z.next_in = reinterpret_cast<Bytef*>(&state->in[0]);
+                z.avail_in = static_cast<uInt>(got);
+            }
+            int ret = inflate(&z, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                break;
+            }
+            if (ret != Z_OK) {
+                throw std::runtime_error("corrupt zlib object");
+            }
+        }
+        n = std::min<uint64_t>(len, left) - z.avail_out;
+        break;
+    }
+#endif
+#ifdef GITLITE_HAVE_ZSTD
+    case Codec::Zstd: {
+        ZSTD_outBuffer out = {buf, static_cast<size_t>(std::min<uint64_t>(len, left)), 0};
+        while (out.pos < out.size) {
+            if (state->zin.pos == state->zin.size) {
+                size_t got = read_raw(&state->in[0], state->in.size());
+                if (got == 0) {
+                    throw std::runtime_error("truncated object");
+                }
+                state->zin = {state->in.data(), got, 0};
+            }
+            if (ZSTD_isError(ZSTD_decompressStream(state->zs, &out, &state->zin))) {
+                throw std::runtime_error("corrupt zstd object");
+            }
+        }
+        n = out.pos;
+        break;
+    }
+#endif
+    default:
+        n = read_raw(buf, static_cast<size_t>(std::min<uint64_t>(len, left)));
+    }
+    if (n == 0 && left != UINT64_MAX) {
+        throw std::runtime_error("truncated object");
+    }
+    if (left != UINT64_MAX) {
+        left -= n;
+    }
+    return n;
+}
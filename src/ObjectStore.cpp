@@ -0,0 +1,502 @@
+#include "../include/ObjectStore.h"
+#include "../include/ObjectCodec.h"
+#include "../include/Pack.h"
+#include "../include/Utils.h"
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <set>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    const uint64_t MAX_PACKED_SIZE = 32 << 20;
+
+    /** How many objects a transfer loads ahead of the pack it writes. */
+    const size_t RAW_BATCH = 64;
+
+    std::vector<Pack::Object> pack_objects(const std::vector<std::pair<ObjectType, std::string>>& list) {
+        std::vector<Pack::Object> objects;
+        objects.reserve(list.size());
+        for (auto &o : list) {
+            objects.push_back(Pack::Object{o.first, o.second});
+        }
+        return objects;
+    }
+
+    /** Returns the stored payloads (see ObjectStore::load_raw) of OBJECTS
+     *  from STORE, in the order Pack::build asks for them.  They are read
+     *  in parallel a batch at a time, so memory stays bounded by one
+     *  batch however many objects there are. */
+    Pack::Encoded raw_reader(const ObjectStore& store, const std::vector<Pack::Object>& objects) {
+        auto batch = std::make_shared<std::vector<std::string>>();
+        auto first = std::make_shared<size_t>(0);
+        return [&store, &objects, batch, first](size_t i) {
+            if (i < *first || i >= *first + batch->size()) {
+                *first = i;
+                batch->assign(std::min(RAW_BATCH, objects.size() - i), std::string());
+                Utils::parallelFor(batch->size(), [&](size_t k) {
+                    const Pack::Object& o = objects[i + k];
+                    if (!store.load_raw(o.type, o.id, (*batch)[k])) {
+                        throw std::runtime_error("missing object " + o.id);
+                    }
+                });
+            }
+            return std::move((*batch)[i - *first]);
+        };
+    }
+}
+
+ObjectStore::ObjectStore(const std::string& dir)
+    : objectDir(dir),
+      commitDir(Utils::join(dir, "commits")),
+      blobDir(Utils::join(dir, "blobs")),
+      treeDir(Utils::join(dir, "trees")),
+      chunkDir(Utils::join(dir, "chunks")),
+      manifestDir(Utils::join(dir, "manifests")),
+      packDir(Utils::join(dir, "pack")),
+      packsLoaded(false) {}
+
+ObjectStore::~ObjectStore() = default;
+
+const std::string& ObjectStore::type_dir(ObjectType type) const {
+    switch (type) {
+    case ObjectType::Commit:
+        return commitDir;
+    case ObjectType::Tree:
+        return treeDir;
+    case ObjectType::Chunk:
+        return chunkDir;
+    case ObjectType::Manifest:
+        return manifestDir;
+    default:
+        return blobDir;
+    }
+}
+
+void ObjectStore::init() const {
+    Utils::createDirectories(commitDir);
+    Utils::createDirectories(blobDir);
+    Utils::createDirectories(treeDir);
+    Utils::createDirectories(chunkDir);
+    Utils::createDirectories(manifestDir);
+}
+
+/** Returns the fan-out path of object ID, e.g. commits/ab/cdef... */
+std::string ObjectStore::path(ObjectType type, const std::string& id) const {
+    if (id.size() < 3) {
+        throw std::invalid_argument("object id too short");
+    }
+    return Utils::join(type_dir(type), id.substr(0, 2), id.substr(2));
+}
+
+/** Opens every pack on first use and returns the open packs.  The list
+ *  is a snapshot, so a concurrent rescan never invalidates it. */
+std::vector<std::shared_ptr<Pack>> ObjectStore::loaded_packs() const {
+    {
+        std::lock_guard<std::mutex> guard(packLock);
+        if (packsLoaded) {
+            return packs;
+        }
+    }
+    rescan_packs();
+    std::lock_guard<std::mutex> guard(packLock);
+    return packs;
+}
+
+/** Brings the open packs in line with the pack directory, keeping packs
+ *  that are already open.  A pack is only picked up once its .idx exists,
+ *  which Pack::write installs last.  Returns true if a pack was added. */
+bool ObjectStore::rescan_packs() const {
+    std::vector<std::string> names;
+    for (auto &name : Utils::plainFilenamesIn(packDir)) {
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".idx") == 0
+            && name.find(".tmp") == std::string::npos) {
+            names.push_back(name.substr(0, name.size() - 4));
+        }
+    }
+    std::lock_guard<std::mutex> guard(packLock);
+    std::vector<std::shared_ptr<Pack>> now;
+    bool added = false;
+    for (auto &base : names) {
+        auto it = std::find(packNames.begin(), packNames.end(), base);
+        if (it != packNames.end()) {
+            now.push_back(packs[it - packNames.begin()]);
+            continue;
+        }
+        try {
+            now.push_back(std::make_shared<Pack>(Utils::join(packDir, base + ".pack")));
+            added = true;
+        } catch (const std::exception&) {
+            if (packsLoaded) {
+                continue; // removed by a concurrent gc since it was listed
+            }
+            throw;
+        }
+    }
+    packs.swap(now);
+    packNames.swap(names);
+    packsLoaded = true;
+    return added;
+}
+
+void ObjectStore::close_packs() const {
+    std::lock_guard<std::mutex> guard(packLock);
+    packs.clear();
+    packNames.clear();
+    packsLoaded = false;
+}
+
+void ObjectStore::save(ObjectType type, const std::string& id, const std::string& data) const {
+    Utils::writeAtomic(path(type, id), ObjectCodec::encode(type, data, ObjectCodec::preferred()), true);
+}
+
+std::string ObjectStore::load(ObjectType type, const std::string& id) const {
+    if (id.size() < 3) {
+        return "";
+    }
+    std::string p = path(type, id);
+    if (Utils::exists(p)) {
+        try {
+            return ObjectCodec::decode(Utils::readContentsAsString(p));
+        } catch (const std::invalid_argument&) {
+            // packed and removed by a concurrent gc; look in the packs
+        }
+    }
+    std::string data;
+    if (read_packed(type, id, data)) {
+        return data;
+    }
+    return "";
+}
+
+/** Reads packed object ID into DATA, rescanning the pack directory once
+ *  if no open pack has it. */
+bool ObjectStore::read_packed(ObjectType type, const std::string& id, std::string& data) const {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        for (auto &pack : loaded_packs()) {
+            if (pack->read(type, id, data)) {
+                return true;
+            }
+        }
+        if (attempt == 0 && !rescan_packs()) {
+            break;
+        }
+    }
+    return false;
+}
+
+/** Opens object ID for streaming, or returns null if it does not exist.
+ *  Loose objects are decoded straight from the file; packed objects are
+ *  bounded by the repack size limit and are decoded in memory. */
+std::unique_ptr<ObjectDecoder> ObjectStore::open(ObjectType type, const std::string& id) const {
+    if (id.size() < 3) {
+        return nullptr;
+    }
+    int fd = ::open(path(type, id).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        return std::unique_ptr<ObjectDecoder>(new ObjectDecoder(fd));
+    }
+    std::string data;
+    if (read_packed(type, id, data)) {
+        return std::unique_ptr<ObjectDecoder>(new ObjectDecoder(std::move(data)));
+    }
+    return nullptr;
+}
+
+/** Streams object ID into the store: PRODUCE writes the content into the
+ *  encoder it is given.  The object is assembled in a temporary file and
+ *  renamed into place, so readers never see a partial object.  If
+ *  PRODUCE returns false the object is discarded and false returned. */
+bool ObjectStore::save_stream(ObjectType type, const std::string& id,
+                              const std::function<bool(ObjectEncoder&)>& produce) const {
+    std::string target = path(type, id);
+    std::string dir = target.substr(0, target.find_last_of('/'));
+    Utils::createDirectories(dir);
+    std::string tmp = Utils::join(dir, "tmp-XXXXXX");
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) {
+        throw std::runtime_error("cannot create object " + id);
+    }
+    bool keep = false;
+    try {
+        ObjectEncoder enc(fd, type, ObjectCodec::preferred());
+        keep = produce(enc);
+        if (keep) {
+            enc.finish();
+        }
+    } catch (...) {
+        close(fd);
+        std::remove(tmp.c_str());
+        throw;
+    }
+    if (!keep) {
+        close(fd);
+        std::remove(tmp.c_str());
+        return false;
+    }
+    Utils::installFile(fd, tmp, target, true);
+    return true;
+}
+
+/** Copies object ID of SOURCE, another repository's store, into this
+ *  one.  A loose object is linked or copied as it is, and a packed one
+ *  stored loose from its packed bytes, so neither is decoded.  Returns
+ *  false if SOURCE does not have the object. */
+bool ObjectStore::copy_from(const ObjectStore& source, ObjectType type, const std::string& id) const {
+    if (Utils::isFile(source.path(type, id))
+        && Utils::copyFile(source.path(type, id), path(type, id), true)) {
+        return true;
+    }
+    std::string raw;
+    if (!source.load_raw(type, id, raw)) {
+        return false;
+    }
+    Utils::writeAtomic(path(type, id), raw, true);
+    return true;
+}
+
+/** Stores in RAW object ID as it is written on disk: the bytes of a
+ *  loose object file or of a whole packed entry.  Only a packed delta is
+ *  resolved and encoded again.  Returns false if the object does not
+ *  exist. */
+bool ObjectStore::load_raw(ObjectType type, const std::string& id, std::string& raw) const {
+    if (id.size() < 3) {
+        return false;
+    }
+    raw.clear();
+    try {
+        Utils::readChunks(path(type, id), [&](const char* data, size_t len) {
+            raw.append(data, len);
+        });
+        if (!ObjectCodec::is_encoded(raw)) {
+            raw = ObjectCodec::encode(type, ObjectCodec::decode(raw), ObjectCodec::preferred());
+        }
+        return true;
+    } catch (const std::invalid_argument&) {
+        // not loose, or packed and removed by a concurrent gc
+    }
+    for (auto &pack : loaded_packs()) {
+        if (pack->read_encoded(type, id, raw)) {
+            return true;
+        }
+    }
+    std::string data;
+    if (!read_packed(type, id, data)) {
+        return false;
+    }
+    raw = ObjectCodec::encode(type, data, ObjectCodec::preferred());
+    return true;
+}
+
+/** Streams the objects of LIST to SINK as a pack, for another store to
+ *  import, and stores its index in INDEX.  Objects are read in parallel
+ *  and copied without being recompressed. */
+void ObjectStore::export_pack(const std::vector<std::pair<ObjectType, std::string>>& list,
+                              const Utils::ByteSink& sink, std::string& index) const {
+    std::vector<Pack::Object> objects = pack_objects(list);
+    Pack::build(objects, raw_reader(*this, objects), sink, index);
+}
+
+/** Writes the objects of LIST in SOURCE straight into a new pack of this
+ *  store, as export_pack and import_pack would without the copy between. */
+void ObjectStore::copy_pack(const ObjectStore& source,
+                            const std::vector<std::pair<ObjectType, std::string>>& list) const {
+    std::vector<Pack::Object> objects = pack_objects(list);
+    Pack::write_encoded(packDir, objects, raw_reader(source, objects));
+    rescan_packs();
+}
+
+/** Installs the pack of PACK_SIZE bytes at PACK with its index at INDEX,
+ *  as produced by export_pack, among the packs of this store and returns
+ *  the ids of the commits in it.  Once the pack opens and its entries are
+ *  well formed, CHECK is given it to inspect the objects themselves.  A
+ *  pack that fails any of this, CHECK throwing, is removed again and
+ *  std::runtime_error thrown.  A pack of the same objects that is already
+ *  installed is checked instead, and kept. */
+std::vector<std::string> ObjectStore::import_pack(const unsigned char* pack, size_t pack_size,
+                                                  const unsigned char* index, size_t index_size,
+                                                  const std::function<void(const Pack&)>& check) const {
+    std::string written = Pack::path_for(packDir, index, index_size);
+    std::string base = written.substr(0, written.size() - 5);
+    bool installed = !Utils::exists(base + ".idx");
+    if (installed) {
+        Pack::install(packDir, pack, pack_size, index, index_size);
+    }
+    std::vector<std::string> commits;
+    try {
+        Pack imported(written);
+        imported.verify();
+        check(imported);
+        imported.ids(ObjectType::Commit, commits);
+    } catch (const std::exception&) {
+        if (installed) {
+            std::remove((base + ".idx").c_str());
+            std::remove(written.c_str());
+            rescan_packs();
+        }
+        throw std::runtime_error("Bad pack file");
+    }
+    rescan_packs();
+    return commits;
+}
+
+/** Stores in SIZE the uncompressed size of loose object ID, read from its
+ *  header.  Returns false if the object is not loose. */
+bool ObjectStore::loose_size(ObjectType type, const std::string& id, uint64_t& size) const {
+    if (id.size() < 3) {
+        return false;
+    }
+    std::string p = path(type, id);
+    int fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    std::string header(ObjectCodec::HEADER_SIZE, '\0');
+    ssize_t n = pread(fd, &header[0], header.size(), 0);
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    close(fd);
+    if (!ok) {
+        return false;
+    }
+    if (n == static_cast<ssize_t>(header.size()) && ObjectCodec::is_encoded(header)) {
+        size = Utils::getU64(reinterpret_cast<const unsigned char*>(header.data()) + 7);
+    } else {
+        size = static_cast<uint64_t>(st.st_size);
+    }
+    return true;
+}
+
+bool ObjectStore::exists(ObjectType type, const std::string& id) const {
+    if (id.size() < 3) {
+        return false;
+    }
+    if (Utils::exists(path(type, id))) {
+        return true;
+    }
+    for (auto &pack : loaded_packs()) {
+        if (pack->contains(type, id)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Returns the ids of every object of TYPE in sorted order.  Only the
+ *  subtree of that type is read.  Objects still being written, under the
+ *  temporary names of save_stream and Utils::writeAtomic, are skipped. */
+std::vector<std::string> ObjectStore::ids(ObjectType type) const {
+    std::vector<std::string> result;
+    const std::string& base = type_dir(type);
+    for (auto &fan : Utils::subdirectoriesIn(base)) {
+        for (auto &rest : Utils::plainFilenamesIn(Utils::join(base, fan))) {
+            if (rest.compare(0, 4, "tmp-") != 0 && rest.find(".tmp-") == std::string::npos) {
+                result.push_back(fan + rest);
+            }
+        }
+    }
+    for (auto &pack : loaded_packs()) {
+        pack->ids(type, result);
+    }
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+/** Rewrites the store as a single pack holding exactly KEEP, in that
+ *  order, and removes every loose object and older pack.  Objects not in
+ *  KEEP are pruned.  Loose objects larger than MAX_PACKED_SIZE stay loose
+ *  so that they never have to be held in memory. */
+void ObjectStore::repack(const std::vector<std::pair<ObjectType, std::string>>& keep) const {
+    Utils::createDirectories(packDir);
+    std::vector<Pack::Object> list;
+    std::set<std::string> loose;
+    list.reserve(keep.size());
+    for (auto &k : keep) {
+        uint64_t size;
+        if (loose_size(k.first, k.second, size) && size > MAX_PACKED_SIZE) {
+            loose.insert(path(k.first, k.second));
+            continue;
+        }
+        list.push_back(Pack::Object{k.first, k.second});
+    }
+    std::string written = Pack::write(packDir, list, [this](ObjectType type, const std::string& id) {
+        if (!exists(type, id)) {
+            throw std::runtime_error("missing object " + id);
+        }
+        return load(type, id);
+    });
+    close_packs();
+
+    std::string keepBase = written.substr(0, written.size() - 5);
+    for (auto &name : Utils::plainFilenamesIn(packDir)) {
+        std::string p = Utils::join(packDir, name);
+        if (p.compare(0, keepBase.size() + 1, keepBase + ".") != 0) {
+            std::remove(p.c_str());
+        }
+    }
+    for (ObjectType type : {ObjectType::Blob, ObjectType::Commit, ObjectType::Tree,
+                            ObjectType::Chunk, ObjectType::Manifest}) {
+        const std::string& base = type_dir(type);
+        for (auto &fan : Utils::subdirectoriesIn(base)) {
+            std::string dir = Utils::join(base, fan);
+            for (auto &rest : Utils::plainFilenamesIn(dir)) {
+                std::string p = Utils::join(dir, rest);
+                if (!loose.count(p)) {
+                    std::remove(p.c_str());
+                }
+            }
+            rmdir(dir.c_str());
+        }
+    }
+}
+
+/** A repository written before the typed layout keeps its objects as flat
+ *  files directly in objects/ and has no commits/ subtree. */
+bool ObjectStore::needs_migration() const {
+    return Utils::isDirectory(objectDir) && !Utils::isDirectory(commitDir);
+}
+
+/** Old blobs are stored as "<id>\n<file name>\n<content>" with
+ *  id = sha1(file name + content); commits also start with their id but
+ *  never hash that way. */
+bool ObjectStore::is_legacy_blob(const std::string& id, const std::string& raw) {
+    size_t first = raw.find('\n');
+    if (first == std::string::npos || raw.compare(0, first, id) != 0) {
+        return false;
+    }
+    size_t second = raw.find('\n', first + 1);
+    if (second == std::string::npos) {
+        return false;
+    }
+    std::string name = raw.substr(first + 1, second - first - 1);
+    return Utils::sha1(name, raw.substr(second + 1)) == id;
+}
+
+/** Moves every flat object into its typed, fanned-out location.  Objects
+ *  are renamed in place, so the migration is cheap and can be resumed if
+ *  it is interrupted: commits/ is only created once all objects moved. */
+void ObjectStore::migrate() const {
+    Utils::createDirectories(blobDir);
+    std::string staging = Utils::join(objectDir, "commits.migrating");
+    Utils::createDirectories(staging);
+    for (auto &id : Utils::plainFilenamesIn(objectDir)) {
+        std::string from = Utils::join(objectDir, id);
+        std::string raw = Utils::readContentsAsString(from);
+        std::string to;
+        if (is_legacy_blob(id, raw)) {
+            to = path(ObjectType::Blob, id);
+        } else {
+            to = Utils::join(staging, id.substr(0, 2), id.substr(2));
+        }
+        Utils::createDirectories(to.substr(0, to.find_last_of('/')));
+        if (std::rename(from.c_str(), to.c_str()) != 0) {
+            throw std::runtime_error("cannot migrate object " + id);
+        }
+    }
+    if (std::rename(staging.c_str(), commitDir.c_str()) != 0) {
+        throw std::runtime_error("cannot migrate object store");
+    }
+}
@@ -0,0 +1,400 @@
+#include "../include/Pack.h"
+#include "../include/Delta.h"
+#include "../include/ObjectCodec.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    const char PACK_MAGIC[4] = {'G', 'L', 'P', 'K'};
+    const char IDX_MAGIC[4] = {'G', 'L', 'P', 'I'};
+    const uint32_t VERSION = 1;
+    const size_t HEADER_SIZE = 12;
+    const size_t RAW_ID_SIZE = 20;
+    const size_t IDX_ENTRY_SIZE = RAW_ID_SIZE + 1 + 8;
+
+    const uint8_t KIND_FULL = 0;
+    const uint8_t KIND_DELTA = 1;
+
+    /** How many preceding objects are tried as delta bases, and how long
+     *  a chain of deltas may grow before an object is stored in full. */
+    const size_t WINDOW = 10;
+    const int MAX_DEPTH = 16;
+
+    void check_header(const MappedFile& file, const char magic[4]) {
+        if (file.size() < HEADER_SIZE || std::memcmp(file.data(), magic, 4) != 0
+            || Utils::getU32(file.data() + 4) != VERSION) {
+            throw std::runtime_error("Bad pack file");
+        }
+    }
+
+    std::string raw_id(const std::string& id) {
+        std::string raw;
+        if (id.size() != Utils::UID_LENGTH || !Utils::fromHex(id, raw)) {
+            throw std::invalid_argument("bad object id");
+        }
+        return raw;
+    }
+
+    typedef std::vector<std::pair<std::string, std::pair<ObjectType, uint64_t>>> IndexEntries;
+
+    /** Sorts ENTRIES (raw id, type and offset) into the index bytes OUT
+     *  and returns the pack name, the hash of the sorted ids. */
+    std::string make_index(IndexEntries& entries, std::string& out) {
+        std::sort(entries.begin(), entries.end());
+        out.assign(IDX_MAGIC, 4);
+        Utils::putU32(out, VERSION);
+        Utils::putU32(out, static_cast<uint32_t>(entries.size()));
+        out.reserve(HEADER_SIZE + entries.size() * IDX_ENTRY_SIZE);
+        SHA1::SHA name;
+        for (auto &e : entries) {
+            out += e.first;
+            out += static_cast<char>(e.second.first);
+            Utils::putU64(out, e.second.second);
+            name.update(e.first);
+        }
+        return name.final();
+    }
+
+    struct Candidate {
+        std::string id;
+        std::string data;
+        int depth;
+    };
+
+    /** Pack bytes on their way to SINK, passed on a chunk at a time so a
+     *  pack is never held whole. */
+    struct PackOutput {
+        Utils::ByteSink sink;
+        std::string buffer;
+        uint64_t written = 0;
+
+        PackOutput(const Utils::ByteSink& out, uint32_t count)
+            : sink(out), buffer(PACK_MAGIC, 4) {
+            Utils::putU32(buffer, VERSION);
+            Utils::putU32(buffer, count);
+        }
+        uint64_t offset() const {
+            return written + buffer.size();
+        }
+        /** Passes on the buffer once it holds a chunk, or always if ALL. */
+        void flush(bool all) {
+            if (!all && buffer.size() < Utils::CHUNK_SIZE) {
+                return;
+            }
+            sink(buffer.data(), buffer.size());
+            written += buffer.size();
+            buffer.clear();
+        }
+    };
+
+    /** Appends OBJECTS to OUT as full entries with the payloads ENCODED
+     *  returns for them, recording each in ENTRIES. */
+    void put_full(PackOutput& out, IndexEntries& entries, const std::vector<Pack::Object>& objects,
+                  const Pack::Encoded& encoded) {
+        entries.reserve(objects.size());
+        for (size_t i = 0; i < objects.size(); i++) {
+            entries.push_back({raw_id(objects[i].id), {objects[i].type, out.offset()}});
+            out.buffer += static_cast<char>(KIND_FULL);
+            Utils::putString(out.buffer, encoded(i));
+            out.flush(false);
+        }
+    }
+
+    /** Streams a pack into a temporary file in DIR: PRODUCE writes the
+     *  pack to its sink, stores its index in the string and returns the
+     *  pack's name.  Then installs the pack and, last, its index under
+     *  that name, and returns the pack's path. */
+    std::string install_pack(const std::string& dir,
+                             const std::function<std::string(const Utils::ByteSink&, std::string&)>& produce) {
+        Utils::createDirectories(dir);
+        std::string tmp = Utils::join(dir, "tmp-XXXXXX");
+        int fd = mkstemp(&tmp[0]);
+        if (fd < 0) {
+            throw std::runtime_error("cannot create pack in " + dir);
+        }
+        std::string name, index;
+        try {
+            name = produce([&](const char* p, size_t left) {
+                while (left > 0) {
+                    ssize_t n = ::write(fd, p, left);
+                    if (n < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        throw std::runtime_error("cannot write pack");
+                    }
+                    p += n;
+                    left -= static_cast<size_t>(n);
+                }
+            }, index);
+        } catch (...) {
+            close(fd);
+            std::remove(tmp.c_str());
+            throw;
+        }
+        fchmod(fd, 0644);
+        std::string base_path = Utils::join(dir, "pack-" + name);
+        Utils::installFile(fd, tmp, base_path + ".pack", true);
+        Utils::writeAtomic(base_path + ".idx", index);
+        return base_path + ".pack";
+    }
+
+    /** Returns the name of the pack whose index of INDEX_SIZE bytes is at
+     *  INDEX, the hash of the ids it lists, after checking that the index
+     *  parses. */
+    std::string index_name(const unsigned char* index, size_t index_size) {
+        if (index_size < HEADER_SIZE || std::memcmp(index, IDX_MAGIC, 4) != 0
+            || Utils::getU32(index + 4) != VERSION
+            || HEADER_SIZE + Utils::getU32(index + 8) * IDX_ENTRY_SIZE != index_size) {
+            throw std::runtime_error("Bad pack index");
+        }
+        SHA1::SHA name;
+        for (size_t pos = HEADER_SIZE; pos < index_size; pos += IDX_ENTRY_SIZE) {
+            name.update(index + pos, RAW_ID_SIZE);
+        }
+        return name.final();
+    }
+
+    /** Streams a pack of COUNT objects into DIR: WRITE_ENTRIES appends
+     *  every entry to the output and records its id, type and offset in
+     *  the index entries.  Returns the pack's path. */
+    std::string write_pack(const std::string& dir, uint32_t count,
+                           const std::function<void(PackOutput&, IndexEntries&)>& write_entries) {
+        return install_pack(dir, [&](const Utils::ByteSink& sink, std::string& index) {
+            PackOutput out(sink, count);
+            IndexEntries entries;
+            write_entries(out, entries);
+            out.flush(true);
+            return make_index(entries, index);
+        });
+    }
+}
+
+Pack::Pack(const std::string& packPath)
+    : pack(packPath),
+      idx(packPath.substr(0, packPath.size() - 5) + ".idx") {
+    check_header(pack, PACK_MAGIC);
+    check_header(idx, IDX_MAGIC);
+    count = Utils::getU32(idx.data() + 8);
+    if (HEADER_SIZE + count * IDX_ENTRY_SIZE > idx.size()) {
+        throw std::runtime_error("Bad pack index");
+    }
+}
+
+const unsigned char* Pack::entry(size_t i) const {
+    return idx.data() + HEADER_SIZE + i * IDX_ENTRY_SIZE;
+}
+
+bool Pack::locate(const std::string& id, size_t& pos) const {
+    std::string raw;
+    if (id.size() != Utils::UID_LENGTH || !Utils::fromHex(id, raw)) {
+        return false;
+    }
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = std::memcmp(entry(mid), raw.data(), RAW_ID_SIZE);
+        if (c == 0) {
+            pos = mid;
+            return true;
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return false;
+}
+
+bool Pack::contains(ObjectType type, const std::string& id) const {
+    size_t pos;
+    return locate(id, pos) && entry(pos)[RAW_ID_SIZE] == static_cast<uint8_t>(type);
+}
+
+std::string Pack::read_at(uint64_t offset, ObjectType type, int depth) const {
+    if (offset >= pack.size() || depth > MAX_DEPTH) {
+        throw std::runtime_error("Bad pack entry");
+    }
+    ByteReader in(pack.data() + offset, pack.size() - offset);
+    uint8_t kind = in.u8();
+    std::string base_raw;
+    if (kind == KIND_DELTA) {
+        base_raw = in.bytes(RAW_ID_SIZE);
+    } else if (kind != KIND_FULL) {
+        throw std::runtime_error("Bad pack entry");
+    }
+    std::string payload = in.str();
+    if (!ObjectCodec::is_encoded(payload)) {
+        throw std::runtime_error("Bad pack entry");
+    }
+    payload = ObjectCodec::decode(payload);
+    if (kind == KIND_FULL) {
+        return payload;
+    }
+    size_t pos;
+    if (!locate(Utils::toHex(reinterpret_cast<const unsigned char*>(base_raw.data()), RAW_ID_SIZE), pos)) {
+        throw std::runtime_error("Missing delta base");
+    }
+    std::string base = read_at(Utils::getU64(entry(pos) + RAW_ID_SIZE + 1), type, depth + 1);
+    return Delta::apply(base, payload);
+}
+
+bool Pack::read(ObjectType type, const std::string& id, std::string& data) const {
+    size_t pos;
+    if (!locate(id, pos) || entry(pos)[RAW_ID_SIZE] != static_cast<uint8_t>(type)) {
+        return false;
+    }
+    data = read_at(Utils::getU64(entry(pos) + RAW_ID_SIZE + 1), type, 0);
+    return true;
+}
+
+/** Stores in RAW the payload of object ID as it is stored, in ObjectCodec
+ *  form.  Returns false if the object is not here or is stored as a
+ *  delta, which only read() can resolve. */
+bool Pack::read_encoded(ObjectType type, const std::string& id, std::string& raw) const {
+    size_t pos;
+    if (!locate(id, pos) || entry(pos)[RAW_ID_SIZE] != static_cast<uint8_t>(type)) {
+        return false;
+    }
+    uint64_t offset = Utils::getU64(entry(pos) + RAW_ID_SIZE + 1);
+    if (offset >= pack.size()) {
+        throw std::runtime_error("Bad pack entry");
+    }
+    ByteReader in(pack.data() + offset, pack.size() - offset);
+    if (in.u8() != KIND_FULL) {
+        return false;
+    }
+    raw = in.str();
+    if (!ObjectCodec::is_encoded(raw)) {
+        throw std::runtime_error("Bad pack entry");
+    }
+    return true;
+}
+
+void Pack::ids(ObjectType type, std::vector<std::string>& out) const {
+    for (size_t i = 0; i < count; i++) {
+        if (entry(i)[RAW_ID_SIZE] == static_cast<uint8_t>(type)) {
+            out.push_back(Utils::toHex(entry(i), RAW_ID_SIZE));
+        }
+    }
+}
+
+void Pack::verify() const {
+    if (Utils::getU32(pack.data() + 8) != count) {
+        throw std::runtime_error("Bad pack entry");
+    }
+    std::vector<std::pair<uint64_t, uint8_t>> entries; // offset, type
+    entries.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        entries.emplace_back(Utils::getU64(entry(i) + RAW_ID_SIZE + 1), entry(i)[RAW_ID_SIZE]);
+    }
+    std::sort(entries.begin(), entries.end());
+    uint64_t next = HEADER_SIZE;
+    for (auto &e : entries) {
+        if (e.first != next) {
+            throw std::runtime_error("Bad pack entry");
+        }
+        ByteReader in(pack.data() + e.first, pack.size() - e.first);
+        uint8_t kind = in.u8();
+        if (kind == KIND_DELTA) {
+            in.bytes(RAW_ID_SIZE);
+        } else if (kind != KIND_FULL) {
+            throw std::runtime_error("Bad pack entry");
+        }
+        uint32_t size = in.u32();
+        if (size > in.remaining() || size < ObjectCodec::HEADER_SIZE) {
+            throw std::runtime_error("Bad pack entry");
+        }
+        next = pack.size() - in.remaining();
+        std::string header(reinterpret_cast<const char*>(pack.data() + next), ObjectCodec::HEADER_SIZE);
+        if (!ObjectCodec::is_encoded(header, static_cast<ObjectType>(e.second))) {
+            throw std::runtime_error("Bad pack entry");
+        }
+        next += size;
+    }
+    if (next != pack.size()) {
+        throw std::runtime_error("Bad pack entry");
+    }
+}
+
+std::string Pack::write(const std::string& dir, const std::vector<Object>& objects,
+                        const Loader& load) {
+    return write_pack(dir, static_cast<uint32_t>(objects.size()), [&](PackOutput& out, IndexEntries& index) {
+        std::deque<Candidate> window;
+        ObjectType window_type = ObjectType::Blob;
+        Codec codec = ObjectCodec::preferred();
+        for (auto &obj : objects) {
+            std::string data = load(obj.type, obj.id);
+            if (obj.type != window_type) {
+                window.clear();
+                window_type = obj.type;
+            }
+            std::string best;
+            const Candidate* base = nullptr;
+            for (auto &c : window) {
+                if (c.depth >= MAX_DEPTH) {
+                    continue;
+                }
+                std::string d = Delta::create(c.data, data);
+                if (d.size() < data.size() / 2 && (base == nullptr || d.size() < best.size())) {
+                    best.swap(d);
+                    base = &c;
+                }
+            }
+            index.push_back({raw_id(obj.id), {obj.type, out.offset()}});
+            int depth = 0;
+            if (base != nullptr) {
+                out.buffer += static_cast<char>(KIND_DELTA);
+                out.buffer += raw_id(base->id);
+                Utils::putString(out.buffer, ObjectCodec::encode(obj.type, best, codec));
+                depth = base->depth + 1;
+            } else {
+                out.buffer += static_cast<char>(KIND_FULL);
+                Utils::putString(out.buffer, ObjectCodec::encode(obj.type, data, codec));
+            }
+            out.flush(false);
+            window.push_back(Candidate{obj.id, std::move(data), depth});
+            if (window.size() > WINDOW) {
+                window.pop_front();
+            }
+        }
+    });
+}
+
+std::string Pack::build(const std::vector<Object>& objects, const Encoded& encoded,
+                        const Utils::ByteSink& sink, std::string& index) {
+    PackOutput out(sink, static_cast<uint32_t>(objects.size()));
+    IndexEntries entries;
+    put_full(out, entries, objects, encoded);
+    out.flush(true);
+    return make_index(entries, index);
+}
+
+std::string Pack::write_encoded(const std::string& dir, const std::vector<Object>& objects,
+                                const Encoded& encoded) {
+    return write_pack(dir, static_cast<uint32_t>(objects.size()), [&](PackOutput& out, IndexEntries& entries) {
+        put_full(out, entries, objects, encoded);
+    });
+}
+
+std::string Pack::path_for(const std::string& dir, const unsigned char* index, size_t index_size) {
+    return Utils::join(dir, "pack-" + index_name(index, index_size) + ".pack");
+}
+
+std::string Pack::install(const std::string& dir, const unsigned char* pack, size_t pack_size,
+                          const unsigned char* index, size_t index_size) {
+    std::string name = index_name(index, index_size);
+    return install_pack(dir, [&](const Utils::ByteSink& sink, std::string& out) {
+        sink(reinterpret_cast<const char*>(pack), pack_size);
+        out.assign(reinterpret_cast<const char*>(index), index_size);
+        return name;
+    });
+}
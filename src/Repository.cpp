@@ -1,11 +1,19 @@
 #include "../include/Repository.h"
 #include "../include/Utils.h"
 #include "../include/GitliteException.h"
+#include "../include/Materializer.h"
+#include "../include/Chunker.h"
+#include "../include/LockFile.h"
+#include "../include/ObjectCodec.h"
+#include "../include/Merge3.h"
+#include "../include/Diff.h"
+#include "../include/Pack.h"
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
 #include <vector>
+#include <cstdlib>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -14,98 +22,622 @@ Repository::Repository(const std::string& dir)
       objectDir(Utils::join(dir, "objects")),
       refsDir(Utils::join(dir, "refs")),
       headPath(Utils::join(dir, "HEAD")),
-      indexPath(Utils::join(dir, "index")) {}
+      indexPath(Utils::join(dir, "index")),
+      remotesDir(Utils::join(dir, "remotes")),
+      objects(objectDir),
+      commitIndex(Utils::join(dir, "commit-index")),
+      commitGraph(Utils::join(dir, "commit-graph")),
+      lockPath(Utils::join(dir, "index.lock")),
+      stageCached(false) {}
 
 std::string Repository::branch_now() const {
     if(!Utils::exists(headPath)){
         return "master";
     }
     else {
-        return Utils::readContentsAsString(headPath);
+        return read_cached(headPath);
     }
 }
 
+/** Returns the content of the small metadata file PATH, or "" if it does
+ *  not exist.  The copy read last time is reused while the file's stat
+ *  data is unchanged; every write replaces the file, so its inode and
+ *  ctime change whenever its content does. */
+std::string Repository::read_cached(const std::string& path) const {
+    FileStat st;
+    if(!Utils::statFile(path,st)){
+        fileCache.erase(path);
+        return "";
+    }
+    auto it = fileCache.find(path);
+    if(it != fileCache.end() && it->second.stat == st){
+        return it->second.content;
+    }
+    std::string content = Utils::readContentsAsString(path);
+    fileCache[path] = Cached_File{st,content};
+    return content;
+}
+
+/** Replaces metadata file PATH with CONTENT and remembers it for
+ *  read_cached.  Callers hold the lock that guards PATH. */
+void Repository::write_cached(const std::string& path, const std::string& content) const {
+    Utils::writeAtomic(path,content);
+    FileStat st;
+    if(Utils::statFile(path,st)){
+        fileCache[path] = Cached_File{st,content};
+    }
+}
+
+/** Checks that this is a repository and brings the data derived from its
+ *  objects up to date: the object store layout, the commit index and the
+ *  commit graph.  Rewriting any of them takes the repository lock, so a
+ *  read-only command that finds one out of date never races a writer;
+ *  the checks are repeated under the lock in case another command did
+ *  the work first.  Callers must not hold the lock yet. */
 void Repository::ensure() const {
     if(!Utils::isDirectory(repoDir)){
         Utils::exitWithMessage("Not in an initialized Gitlite directory.");
     }
+    if(!objects.needs_migration() && commitIndex.exists() && commitGraph.exists()){
+        return;
+    }
+    std::unique_ptr<LockFile> lock = lock_repository();
+    if(objects.needs_migration()){
+        objects.migrate();
+    }
+    if(!commitIndex.exists()){
+        commitIndex.rebuild(all_commit_ids());
+    }
+    if(!commitGraph.exists()){
+        rebuild_graph();
+    }
+}
+
+void Repository::rebuild_graph() const {
+    std::vector<CommitGraph::Node> nodes;
+    for(auto &id : all_commit_ids()){
+        CommitView c = load_commit_view(id);
+        nodes.push_back(CommitGraph::Node{id,c.get_formers(),c.get_timestamp()});
+    }
+    commitGraph.rebuild(nodes);
+}
+
+/** Returns the split point of merging GIVEN_ID into HEAD_ID, or "" if
+ *  they share no history. */
+std::string Repository::split_point(const std::string& head_id, const std::string& given_id) const {
+    uint32_t head, given;
+    {
+        CommitGraph::View g = commitGraph.view();
+        if(g.find(head_id,head) && g.find(given_id,given)){
+            uint32_t split = g.split_point(head,given);
+            return split == CommitGraph::NONE ? "" : g.id(split);
+        }
+    }
+    rebuild_graph();
+    CommitGraph::View g = commitGraph.view();
+    if(!g.find(head_id,head) || !g.find(given_id,given)){
+        throw std::runtime_error("commit missing from commit graph");
+    }
+    uint32_t split = g.split_point(head,given);
+    return split == CommitGraph::NONE ? "" : g.id(split);
 }
 
+/** True if commit ANCESTOR_ID is COMMIT_ID or one of its ancestors.
+ *  Read-only commands call this without the repository lock, so a
+ *  commit missing from the graph is answered by walking the commits
+ *  themselves rather than by rebuilding the graph. */
+bool Repository::is_ancestor(const std::string& ancestor_id, const std::string& commit_id) const {
+    uint32_t ancestor, commit;
+    {
+        CommitGraph::View g = commitGraph.view();
+        if(g.find(ancestor_id,ancestor) && g.find(commit_id,commit)){
+            return g.is_ancestor(ancestor,commit);
+        }
+    }
+    if(!commitIndex.contains(ancestor_id) || !commitIndex.contains(commit_id)){
+        return false;
+    }
+    std::set<std::string> seen;
+    std::vector<std::string> stack = {commit_id};
+    while(!stack.empty()){
+        std::string id = stack.back();
+        stack.pop_back();
+        if(id == ancestor_id){
+            return true;
+        }
+        if(!seen.insert(id).second){
+            continue;
+        }
+        for(auto &p : load_commit_view(id).get_formers()){
+            stack.push_back(p);
+        }
+    }
+    return false;
+}
+
+/** Takes the repository lock held by every command that changes the
+ *  index, refs or objects until it returns, waiting up to
+ *  LockFile::timeout_ms() for another such command to finish.  Read-only
+ *  commands only take it to rebuild derived data (see ensure). */
+std::unique_ptr<LockFile> Repository::lock_repository() const {
+    std::unique_ptr<LockFile> lock(new LockFile(lockPath));
+    if(!lock->acquire(LockFile::timeout_ms())){
+        Utils::exitWithMessage("Another gitlite command is running in this repository.");
+    }
+    return lock;
+}
+
+/** Points ref BRANCH at COMMIT_ID while holding refs/BRANCH.lock, so ref
+ *  updates from different repositories' commands (such as a push into
+ *  this one) never interleave. */
 void Repository::write_ref(const std::string& branch , const std::string& commit_id) const {
-    Utils::writeContents(Utils::join(refsDir,branch),commit_id);
+    std::string path = Utils::join(refsDir,branch);
+    size_t slash = path.find_last_of('/');
+    Utils::createDirectories(path.substr(0,slash));
+    LockFile lock(path + ".lock");
+    if(!lock.acquire(LockFile::timeout_ms())){
+        Utils::exitWithMessage("Another gitlite command is updating " + branch + ".");
+    }
+    write_cached(path,commit_id);
+}
+
+/** True if NAME, a file below refs/, is a ref rather than a lock or a
+ *  temporary file of a ref update in progress. */
+bool Repository::is_ref_name(const std::string& name){
+    return name.find(".tmp-") == std::string::npos && name.find(".stale-") == std::string::npos
+        && (name.size() < 5 || name.compare(name.size() - 5,5,".lock") != 0);
+}
+
+/** Returns every ref below refs/, relative to it, in sorted order. */
+std::vector<std::string> Repository::ref_names() const {
+    std::vector<std::string> refs;
+    for(auto &ref : Utils::filesUnder(refsDir)){
+        if(is_ref_name(ref)){
+            refs.push_back(ref);
+        }
+    }
+    return refs;
 }
 
 std::string Repository::read_ref(const std::string& branch) const {
-    std::string path = Utils::join(refsDir, branch);
-    if (!Utils::exists(path)) {
-        return "";
+    return read_cached(Utils::join(refsDir, branch));
+}
+
+void Repository::save_object(ObjectType type, const std::string& id , const std::string& data) const {
+    objects.save(type,id,data);
+}
+
+std::string Repository::load_object(ObjectType type, const std::string& id) const {
+    return objects.load(type,id);
+}
+
+bool Repository::object_exist(ObjectType type, const std::string& id) const {
+    return objects.exists(type,id);
+}
+
+/** True if blob BLOB_ID is stored, either whole or as a chunk manifest. */
+bool Repository::blob_exist(const std::string& blob_id) const {
+    return objects.exists(ObjectType::Blob,blob_id) || objects.exists(ObjectType::Manifest,blob_id);
+}
+
+void Repository::save_blob(const Blob& b) const {
+    if(!blob_exist(b.get_sha())){
+        save_object(ObjectType::Blob,b.get_sha(),b.serialize());
     }
-    return Utils::readContentsAsString(path);
 }
 
-void Repository::save_object(const std::string& id , const std::string& data) const {
-    Utils::writeContents(Utils::join(objectDir,id),data);
+Blob Repository::load_blob(const std::string& blob_id) const {
+    if(!object_exist(ObjectType::Blob,blob_id) && object_exist(ObjectType::Manifest,blob_id)){
+        std::string content;
+        stream_blob(blob_id,[&](const char* data, size_t len){
+            content.append(data,len);
+        });
+        return Blob::deserialize(blob_id,content);
+    }
+    std::string content = load_object(ObjectType::Blob,blob_id);
+    return Blob::deserialize(blob_id,content); 
 }
 
-std::string Repository::load_object(const std::string& id) const {
-    std::string path = Utils::join(objectDir,id);
-    if(!Utils::exists(path)){
+/** Writes the tree for the files in [BEGIN, END), whose paths all share
+ *  a directory prefix of PREFIX characters, and returns its id.  Trees
+ *  that already exist are not rewritten. */
+std::string Repository::save_tree(FileIter begin, FileIter end, size_t prefix) const {
+    Tree t;
+    while(begin != end){
+        const std::string& path = begin->first;
+        size_t slash = path.find('/',prefix);
+        if(slash == std::string::npos){
+            t.add_blob(path.substr(prefix),begin->second);
+            ++begin;
+            continue;
+        }
+        std::string dir = path.substr(0,slash + 1);
+        FileIter last = begin;
+        while(last != end && last->first.compare(0,dir.size(),dir) == 0){
+            ++last;
+        }
+        t.add_tree(dir.substr(prefix,slash - prefix),save_tree(begin,last,slash + 1));
+        begin = last;
+    }
+    std::string id = t.get_id();
+    if(!object_exist(ObjectType::Tree,id)){
+        save_object(ObjectType::Tree,id,t.serialize());
+    }
+    return id;
+}
+
+/** Writes the trees of PARENT with the changes staged in S applied and
+ *  returns the new root tree id.  Only the directories on the paths of
+ *  changed files are read and rehashed; every other subtree keeps the id
+ *  it has in PARENT.  A parent without trees is written out whole. */
+std::string Repository::save_tree(const FileTree& parent, const Stage_Area& s) const {
+    std::map<std::string,std::string> changes = s.files(); // "" removes the file
+    for(auto &f : s.removedFiles()){
+        changes[f] = "";
+    }
+    if(!parent.get_root().empty()){
+        return update_tree(parent.get_root(),changes.begin(),changes.end(),0);
+    }
+    std::map<std::string,std::string> files = parent.files();
+    for(auto &f : changes){
+        if(f.second.empty()){
+            files.erase(f.first);
+        }
+        else {
+            files[f.first] = f.second;
+        }
+    }
+    return save_tree(files.begin(),files.end(),0);
+}
+
+/** Returns the id of tree TREE_ID ("" for none) with the changes in
+ *  [BEGIN, END) applied, writing it if it is new.  The changed paths all
+ *  share a directory prefix of PREFIX characters and map to their new
+ *  blob id, or to "" if removed.  A subdirectory left empty is dropped
+ *  and yields "". */
+std::string Repository::update_tree(const std::string& tree_id, FileIter begin, FileIter end,
+                                    size_t prefix) const {
+    Tree t;
+    if(!tree_id.empty()){
+        t = Tree::deserialize(load_object(ObjectType::Tree,tree_id));
+    }
+    while(begin != end){
+        const std::string& path = begin->first;
+        size_t slash = path.find('/',prefix);
+        if(slash == std::string::npos){
+            if(begin->second.empty()){
+                t.remove_blob(path.substr(prefix));
+            }
+            else {
+                t.add_blob(path.substr(prefix),begin->second);
+            }
+            ++begin;
+            continue;
+        }
+        std::string dir = path.substr(0,slash + 1);
+        FileIter last = begin;
+        while(last != end && last->first.compare(0,dir.size(),dir) == 0){
+            ++last;
+        }
+        std::string name = dir.substr(prefix,slash - prefix);
+        auto sub = t.get_subtrees().find(name);
+        std::string sub_id = update_tree(sub == t.get_subtrees().end() ? "" : sub->second,begin,last,slash + 1);
+        if(sub_id.empty()){
+            t.remove_tree(name);
+        }
+        else {
+            t.add_tree(name,sub_id);
+        }
+        begin = last;
+    }
+    if(prefix > 0 && t.empty()){
         return "";
     }
-    return Utils::readContentsAsString(path);
+    std::string id = t.get_id();
+    if(!object_exist(ObjectType::Tree,id)){
+        save_object(ObjectType::Tree,id,t.serialize());
+    }
+    return id;
 }
 
-bool Repository::object_exist(const std::string& id) const {
-    return Utils::exists(Utils::join(objectDir,id));
+void Repository::save_commit(const Commit& c) const {
+    save_object(ObjectType::Commit,c.get_id(),c.serialize());
+    commitIndex.add(c.get_id());
+    if(commitGraph.exists()
+       && !commitGraph.add(CommitGraph::Node{c.get_id(),c.get_formers(),c.get_timestamp()})){
+        rebuild_graph();
+    }
 }
 
-void Repository::save_blob(const Blob& b) const {
-    if(!object_exist(b.get_sha())){
-        save_object(b.get_sha(),b.serialize());
+/** Loads commit COMMIT_ID.  Its files are read through its trees only as
+ *  they are looked up (see FileTree).  Commits never change, so the most
+ *  recent ones are kept, with the trees they loaded, for later commands
+ *  of a batch session. */
+Commit Repository::load_commit(const std::string& commit_id) const {
+    auto it = commitCache.find(commit_id);
+    if(it != commitCache.end()){
+        return it->second;
+    }
+    Commit c = Commit::deserialize(load_object(ObjectType::Commit,commit_id));
+    if(!c.get_tree().empty()){
+        c.set_files(FileTree(c.get_tree(),[this](const std::string& tree_id){
+            return load_object(ObjectType::Tree,tree_id);
+        }));
+    }
+    if(commitCache.size() >= COMMIT_CACHE_SIZE){
+        commitCache.clear();
     }
+    commitCache.emplace(commit_id,c);
+    return c;
 }
 
-Blob Repository::load_blob(const std::string& blob_id) const {
-    std::string content = load_object(blob_id);
-    return Blob::deserialize(content); 
+CommitView Repository::load_commit_view(const std::string& commit_id) const {
+    return CommitView(load_object(ObjectType::Commit,commit_id));
 }
 
+/** Reads the index, reusing the copy parsed last time while the file's
+ *  stat data is unchanged (see read_cached). */
 Stage_Area Repository::read_stage() const {
-    if(Utils::exists(indexPath) == false){
+    FileStat st;
+    if(!Utils::statFile(indexPath,st)){
+        stageCached = false;
         return Stage_Area();
     }
-    std::string s = Utils::readContentsAsString(indexPath);
-    return Stage_Area::deserialize(s);
+    if(!stageCached || stageStat != st){
+        stageCache = Stage_Area::deserialize(Utils::readContentsAsString(indexPath));
+        stageStat = st;
+        stageCached = true;
+    }
+    return stageCache;
 }
 
 void Repository::write_stage(const Stage_Area& s) const {
-    Utils::writeContents(indexPath,s.serialize());
+    std::string raw = s.serialize();
+    Utils::writeAtomic(indexPath,raw);
+    stageCached = Utils::statFile(indexPath,stageStat);
+    if(stageCached){
+        stageCache = Stage_Area::deserialize(raw);
+    }
 }
 
 void Repository::clear_stage() const {
-    if(Utils::exists(indexPath)){
-        Utils::restrictedDelete(indexPath);
+    Stage_Area s = read_stage();
+    s.clear();
+    write_stage(s);
+}
+
+/** Makes the working tree match TARGET when it currently matches NOW,
+ *  touching only paths whose content differs: files whose blob is the
+ *  same in both commits are skipped once the stat cache (or, failing
+ *  that, a rehash) confirms the working copy still holds it.  The rest
+ *  are written in parallel and recorded in the cache of S.  Returns the
+ *  number of files written or deleted. */
+size_t Repository::switch_files(const std::map<std::string,std::string>& now,
+                                const std::map<std::string,std::string>& target,
+                                Stage_Area& s) const {
+    std::vector<std::pair<std::string,std::string>> same;
+    Materializer out([this](const std::string& blob_id, const Utils::ByteSink& sink){
+        stream_blob(blob_id,sink);
+    });
+    for(auto &f : target){
+        auto cur = now.find(f.first);
+        if(cur != now.end() && cur->second == f.second){
+            same.push_back(f);
+        }
+        else {
+            out.add(f.first,f.second);
+        }
     }
+    std::vector<char> intact(same.size());
+    Utils::parallelFor(same.size(),[&](size_t i){
+        FileStat st;
+        intact[i] = Utils::isFile(same[i].first)
+                    && (working_blob_id(same[i].first,s,st,false) == same[i].second
+                        || legacy_match(same[i].first,same[i].second));
+    });
+    for(size_t i = 0; i < same.size(); i++){
+        if(!intact[i]){
+            out.add(same[i].first,same[i].second);
+        }
+    }
+    out.run();
+    size_t touched = out.size();
+    for(auto &f : out.files()){
+        s.record(f.path,f.blob_id,f.stat);
+    }
+    for(auto &f : now){
+        if(target.find(f.first) == target.end()){
+            s.forget(f.first);
+            if(Utils::isFile(f.first)){
+                Utils::restrictedDelete(f.first);
+                touched++;
+            }
+        }
+    }
+    return touched;
 }
 
-Commit Repository::load_commit_by_id(const std::string& idcommit) const {
-    if(idcommit.size() == Utils::UID_LENGTH){
-        std::string raw = load_object(idcommit);
-        return Commit::deserialize(raw);
+/** Prints how many working files a checkout or reset touched to standard
+ *  error when GITLITE_VERBOSE is set; normal output stays as specified. */
+void Repository::report_touched(size_t touched) const {
+    const char* verbose = std::getenv("GITLITE_VERBOSE");
+    if(verbose != nullptr && *verbose != '\0' && std::string(verbose) != "0"){
+        std::cerr<<"Touched "<<touched<<" files.\n";
+    }
+}
+
+/** Returns the blob id of working file FILE_NAME, reusing the id cached in
+ *  S when the file's stat data still matches and only rehashing otherwise.
+ *  The file's current stat is stored in ST.  With SAVE set, a rehashed
+ *  blob is also written to the object store. */
+std::string Repository::working_blob_id(const std::string& file_name, const Stage_Area& s,
+                                        FileStat& st, bool save) const {
+    std::string blob_id;
+    if(Utils::statFile(file_name,st) && s.cached_blob(file_name,st,blob_id)
+       && (!save || blob_exist(blob_id))){
+        return blob_id;
+    }
+    blob_id = hash_working_file(file_name);
+    if(save && !blob_exist(blob_id)){
+        save_working_file(file_name,blob_id);
+    }
+    return blob_id;
+}
+
+/** Hashes working file FILE_NAME into its blob id one chunk at a time. */
+std::string Repository::hash_working_file(const std::string& file_name) const {
+    SHA1::SHA key = Blob::hasher();
+    Utils::readChunks(file_name,[&](const char* data, size_t len){
+        key.update(data,len);
+    });
+    return key.final();
+}
+
+/** Streams working file FILE_NAME into the store as blob BLOB_ID.  The
+ *  content is hashed again on the way, and the object is dropped if the
+ *  file changed since BLOB_ID was computed.  Files of at least
+ *  Chunker::threshold() bytes are stored chunked instead. */
+void Repository::save_working_file(const std::string& file_name, const std::string& blob_id) const {
+    FileStat st;
+    uint64_t threshold = Chunker::threshold();
+    if(threshold > 0 && Utils::statFile(file_name,st) && st.size >= threshold){
+        save_chunked_file(file_name,blob_id);
+        return;
+    }
+    bool stored = objects.save_stream(ObjectType::Blob,blob_id,[&](ObjectEncoder& out){
+        SHA1::SHA key = Blob::hasher();
+        Utils::readChunks(file_name,[&](const char* data, size_t len){
+            key.update(data,len);
+            out.write(data,len);
+        });
+        return key.final() == blob_id;
+    });
+    if(!stored){
+        throw std::runtime_error(file_name + " changed while it was being added");
+    }
+}
+
+/** Stores working file FILE_NAME as a manifest of content-defined chunks.
+ *  Each chunk is keyed by the hash of its bytes alone and written only if
+ *  no file stored it before, so an edit costs the chunks around it.  The
+ *  manifest has one "C <id> <size>" line per chunk and is written last,
+ *  after every chunk it names. */
+void Repository::save_chunked_file(const std::string& file_name, const std::string& blob_id) const {
+    SHA1::SHA key = Blob::hasher();
+    std::string manifest;
+    Chunker chunker([&](const std::string& chunk){
+        SHA1::SHA chunk_key;
+        chunk_key.update(chunk);
+        std::string chunk_id = chunk_key.final();
+        if(!objects.exists(ObjectType::Chunk,chunk_id)){
+            objects.save(ObjectType::Chunk,chunk_id,chunk);
+        }
+        manifest += "C " + chunk_id + " " + std::to_string(chunk.size()) + "\n";
+    });
+    Utils::readChunks(file_name,[&](const char* data, size_t len){
+        key.update(data,len);
+        chunker.update(data,len);
+    });
+    chunker.finish();
+    if(key.final() != blob_id){
+        throw std::runtime_error(file_name + " changed while it was being added");
+    }
+    objects.save(ObjectType::Manifest,blob_id,manifest);
+}
+
+/** Returns the chunk ids listed by the manifest of blob BLOB_ID, in order. */
+std::vector<std::string> Repository::load_manifest(const std::string& blob_id) const {
+    return manifest_chunks(blob_id,load_object(ObjectType::Manifest,blob_id));
+}
+
+/** Returns the chunk ids listed by MANIFEST, the stored manifest of blob
+ *  BLOB_ID, in order.  Manifests of old-format blobs start with the blob
+ *  id and file name. */
+std::vector<std::string> Repository::manifest_chunks(const std::string& blob_id, const std::string& manifest){
+    std::istringstream in(manifest);
+    std::vector<std::string> chunks;
+    std::string line;
+    if(Blob::is_legacy(blob_id,manifest)){
+        std::getline(in,line);
+        std::getline(in,line);
+    }
+    while(std::getline(in,line)){
+        if(line.size() < 2 + Utils::UID_LENGTH || line.compare(0,2,"C ") != 0){
+            throw std::runtime_error("bad manifest " + blob_id);
+        }
+        chunks.push_back(line.substr(2,Utils::UID_LENGTH));
     }
-    auto file = Utils::plainFilenamesIn(objectDir);
-    for(auto &f : file){
-        if(f.rfind(idcommit,0) == 0){
-            std::string raw = load_object(f);
-            return Commit::deserialize(raw);
+    return chunks;
+}
+
+/** Passes the content of blob BLOB_ID to SINK in chunks, skipping the id
+ *  and file name lines in front of an old-format blob.  A chunked blob is
+ *  replayed from its manifest one chunk at a time. */
+void Repository::stream_blob(const std::string& blob_id, const Utils::ByteSink& sink) const {
+    std::unique_ptr<ObjectDecoder> in = objects.open(ObjectType::Blob,blob_id);
+    if(!in && object_exist(ObjectType::Manifest,blob_id)){
+        for(auto &chunk_id : load_manifest(blob_id)){
+            if(!object_exist(ObjectType::Chunk,chunk_id)){
+                throw std::runtime_error("missing chunk " + chunk_id);
+            }
+            std::string chunk = load_object(ObjectType::Chunk,chunk_id);
+            sink(chunk.data(),chunk.size());
         }
+        return;
+    }
+    if(!in){
+        throw std::runtime_error("missing blob " + blob_id);
+    }
+    std::vector<char> buffer(Utils::CHUNK_SIZE);
+    std::string head;
+    size_t n = 0;
+    while(head.size() <= blob_id.size() && (n = in->read(buffer.data(),buffer.size())) > 0){
+        head.append(buffer.data(),n);
+    }
+    int header_lines = Blob::is_legacy(blob_id,head) ? 0 : 2;
+    auto feed = [&](const char* data, size_t len){
+        size_t start = 0;
+        while(header_lines < 2 && start < len){
+            if(data[start++] == '\n'){
+                header_lines++;
+            }
+        }
+        if(start < len){
+            sink(data + start,len - start);
+        }
+    };
+    feed(head.data(),head.size());
+    while((n = in->read(buffer.data(),buffer.size())) > 0){
+        feed(buffer.data(),n);
     }
-    Utils::exitWithMessage("No commit with that id exists.");
-    return Commit();
+}
+
+/** Writes blob BLOB_ID to working file FILE_NAME without loading it whole. */
+void Repository::write_working_file(const std::string& file_name, const std::string& blob_id) const {
+    size_t slash = file_name.find_last_of('/');
+    if(slash != std::string::npos){
+        Utils::createDirectories(file_name.substr(0,slash));
+    }
+    FileStat st;
+    Utils::writeFile(file_name,[&](const Utils::ByteSink& sink){
+        stream_blob(blob_id,sink);
+    },st);
+}
+
+Commit Repository::load_commit_by_id(const std::string& idcommit) const {
+    std::string id;
+    int matches = commitIndex.resolve(idcommit,id);
+    if(matches == 0){
+        Utils::exitWithMessage("No commit with that id exists.");
+    }
+    if(matches > 1){
+        Utils::exitWithMessage("Ambiguous commit id.");
+    }
+    return load_commit(id);
 }
 
 std::vector<std::string> Repository::all_commit_ids() const {
-    return Utils::plainFilenamesIn(objectDir);
+    return objects.ids(ObjectType::Commit);
 }
 
 std::string Repository::getGitliteDir() {
@@ -129,49 +661,63 @@ void Repository::init() {
         Utils::exitWithMessage("A Gitlite version-control system already exists in the current directory.");
     }
     Utils::createDirectories(repoDir);
-    Utils::createDirectories(objectDir);
+    objects.init();
     Utils::createDirectories(refsDir);
-    Utils::writeContents(headPath, "master");
+    write_cached(headPath, "master");
 
-    Commit initial = Commit::initial_commit();
-    save_object(initial.get_id(), initial.serialize());
+    Commit initial = Commit::initial_commit(save_tree(FileTree(),Stage_Area()));
+    save_commit(initial);
     write_ref("master", initial.get_id());
 }
 
-void Repository::add(const std::string& file_name){
+void Repository::add(const std::vector<std::string>& paths){
     ensure();
-    if(!Utils::isFile(file_name)){
-        Utils::exitWithMessage("File does not exist.");
+    std::unique_ptr<LockFile> lock = lock_repository();
+    std::vector<std::string> files;
+    for(auto &p : paths){
+        if(Utils::isFile(p)){
+            files.push_back(Utils::normalizePath(p));
+        }
+        else if(Utils::isDirectory(p)){
+            for(auto &f : Utils::filesUnder(p)){
+                files.push_back(Utils::normalizePath(Utils::join(p,f)));
+            }
+        }
+        else {
+            Utils::exitWithMessage("File does not exist.");
+        }
     }
-    std::string content = Utils::readContentsAsString(file_name); 
-    Blob b(file_name,content);
-    save_blob(b);
-    std::string sha_blob = b.get_sha();
+    std::sort(files.begin(),files.end());
+    files.erase(std::unique(files.begin(),files.end()),files.end());
+
+    Stage_Area s = read_stage();
+    std::vector<std::string> blob_ids(files.size());
+    std::vector<FileStat> stats(files.size());
+    Utils::parallelFor(files.size(),[&](size_t i){
+        blob_ids[i] = working_blob_id(files[i],s,stats[i],true);
+    });
 
     std::string branch = branch_now();
     std::string head_id = read_ref(branch);
-    std::map<std::string,std::string> tracked;
+    FileTree tracked;
     if(!head_id.empty()){
-        Commit head = Commit::deserialize(load_object(head_id));
-        tracked = head.get_blobs_commit();
+        tracked = load_commit(head_id).get_files();
     }
 
-    Stage_Area s = read_stage();
-
-    if(s.isRemoved(file_name)){
-        s.unmark_remove(file_name);
+    for(size_t i = 0; i < files.size(); i++){
+        const std::string& file_name = files[i];
+        const std::string& sha_blob = blob_ids[i];
+        s.record(file_name,sha_blob,stats[i]);
+        if(s.isRemoved(file_name)){
+            s.unmark_remove(file_name);
+        }
+        std::string tracked_id;
+        if(tracked.find(file_name,tracked_id) && (tracked_id == sha_blob || legacy_match(file_name,tracked_id))){
+            s.remove_from_add_staged(file_name);
+            continue;
+        }
         s.add(file_name,sha_blob);
-        write_stage(s);
-        return;
-    }
-
-    if(tracked.find(file_name) != tracked.end() && tracked[file_name] == sha_blob){
-        s.remove_from_add_staged(file_name);
-        write_stage(s);
-        return;
     }
-
-    s.add(file_name,sha_blob);
     write_stage(s);
 }
 
@@ -196,6 +742,7 @@ void Repository::add(const std::string& file_name){
 
 void Repository::commit(const std::string& message) {
     ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
     Stage_Area s = read_stage();
     if(s.empty()){
         Utils::exitWithMessage("No changes added to the commit.");
@@ -205,31 +752,29 @@ void Repository::commit(const std::string& message) {
     }
     std::string branch = branch_now();
     std::string former = read_ref(branch);
-    std::map<std::string,std::string> blob_commit;
+    FileTree parent;
     if (!former.empty()) {
-        std::string raw = load_object(former);
-        Commit parent = Commit::deserialize(raw);
-        blob_commit = parent.get_blobs_commit();
+        parent = load_commit(former).get_files();
     }
     Commit new_commit(message,former.empty() ? std::vector<std::string>() : std::vector<std::string> {former} ,
-                        blob_commit,s);
-    save_object(new_commit.get_id() , new_commit.serialize() );
+                        save_tree(parent,s));
+    save_commit(new_commit);
     write_ref(branch,new_commit.get_id());
     clear_stage();
 }
 
 void Repository::rm(const std::string& file_name){
     ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
     Stage_Area s = read_stage();
     std::string branch = branch_now();
     std::string head_id = read_ref(branch);
-    std::map<std::string,std::string> t;
+    FileTree t;
     if(head_id.empty() == false){
-        Commit head = Commit::deserialize(load_object(head_id));
-        t = head.get_blobs_commit();
+        t = load_commit(head_id).get_files();
     }
     bool flag_stage = s.contains(file_name);
-    bool flag_t = (t.find(file_name) != t.end());
+    bool flag_t = t.contains(file_name);
     if(flag_stage == false && flag_t == false){
         Utils::exitWithMessage("No reason to remove the file.");
     }
@@ -240,6 +785,7 @@ void Repository::rm(const std::string& file_name){
     }
     if(flag_t == true){
         s.mark_remove(file_name);
+        s.forget(file_name);
         write_stage(s);
         if(Utils::isFile(file_name)){
             Utils::restrictedDelete(file_name);
@@ -249,17 +795,16 @@ void Repository::rm(const std::string& file_name){
 
 void Repository::log() const {
     ensure();
-    std::string branch = Utils::readContentsAsString(headPath);
+    std::string branch = read_cached(headPath);
     std::string commit_id = read_ref(branch);
     while(commit_id.empty() == false){
-        std::string raw = load_object(commit_id);
-        Commit c = Commit::deserialize(raw);
+        CommitView c = load_commit_view(commit_id);
         std::cout<<"===\n";
         std::cout<<"commit "<<c.get_id()<<"\n";
         if(c.get_formers().size() >= 2){
-            std::cout<<"Merge:"<<c.get_formers()[0].substr(0,7)<<" "<<c.get_formers()[1].substr(0,7)<<"\n";
+            std::cout<<"Merge: "<<c.get_formers()[0].substr(0,7)<<" "<<c.get_formers()[1].substr(0,7)<<"\n";
         }
-        std::cout<<"Date:"<<Commit::Time(c.get_timestamp())<<"\n";
+        std::cout<<"Date: "<<Commit::Time(c.get_timestamp())<<"\n";
         std::cout<<c.get_message()<<"\n\n";
         if(c.get_formers().empty()){
             break;
@@ -272,14 +817,13 @@ void Repository::globalLog() const {
     ensure();
     auto files = all_commit_ids();
     for(auto &f : files ){
-        std::string raw = load_object(f);
-        Commit c = Commit::deserialize(raw);
+        CommitView c = load_commit_view(f);
         std::cout<<"===\n";
         std::cout<<"commit "<<c.get_id()<<"\n";
         if(c.get_formers().size() >= 2){
-            std::cout<<"Merge:"<<c.get_formers()[0].substr(0,7)<<" "<<c.get_formers()[1].substr(0,7)<<"\n";
+            std::cout<<"Merge: "<<c.get_formers()[0].substr(0,7)<<" "<<c.get_formers()[1].substr(0,7)<<"\n";
         }
-        std::cout<<"Date:"<<Commit::Time(c.get_timestamp())<<"\n";
+        std::cout<<"Date: "<<Commit::Time(c.get_timestamp())<<"\n";
         std::cout<<c.get_message()<<"\n\n";
     }
 }
@@ -289,10 +833,10 @@ void Repository::find(const std::string& message) const {
     auto files = all_commit_ids();
     bool flag = false;
     for(auto &f : files){
-        Commit c = Commit::deserialize(load_object(f));
-        if(c.get_message() == message){
+        CommitView c = load_commit_view(f);
+        if(c.message_equals(message)){
             flag = true;
-            std::cout<<c.get_id()<<"\n";
+            std::cout<<f<<"\n";
         }
     }
     if(flag == false){
@@ -302,18 +846,18 @@ void Repository::find(const std::string& message) const {
 
 void Repository::checkoutFile(const std::string& commit_id , const std::string& file_name){
     ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
     Commit c = load_commit_by_id(commit_id);
-    auto b = c.get_blobs_commit();
-    if(b.find(file_name) == b.end()){
+    std::string blob_id;
+    if(!c.get_files().find(file_name,blob_id)){
         Utils::exitWithMessage("File does not exist in that commit.");
     }
-    std::string blob_id = b.at(file_name);
-    std::string content = load_object(blob_id);
-    Utils::writeContents(file_name,content);
+    write_working_file(file_name,blob_id);
 }
 
 void Repository::checkoutBranch(const std::string& branch_name){
     ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
     std::string path = Utils::join(refsDir,branch_name);
     if(Utils::exists(path) == false){
         Utils::exitWithMessage("No such branch exists.");
@@ -326,14 +870,13 @@ void Repository::checkoutBranch(const std::string& branch_name){
     if(target_id.empty()){
         Utils::exitWithMessage("No commit with that id exists.");
     }
-    Commit target = Commit::deserialize(load_object(target_id));
+    std::map<std::string,std::string> blob_target = load_commit(target_id).get_files().files();
     std::string now_commit_id = read_ref(now);
     std::map<std::string,std::string> blob_now;
     if(now_commit_id.empty() == false){
-        Commit now_commit = Commit::deserialize(load_object(now_commit_id));
-        blob_now = now_commit.get_blobs_commit();
+        blob_now = load_commit(now_commit_id).get_files().files();
     }
-    for(auto &f : target.get_blobs_commit()){
+    for(auto &f : blob_target){
         const std::string& f_name = f.first;
         if(Utils::exists(f_name) == false){
             continue;
@@ -342,58 +885,46 @@ void Repository::checkoutBranch(const std::string& branch_name){
             Utils::exitWithMessage("There is an untracked file in the way; delete it, or add and commit it first.");
         }
     }
-    for(auto &f : target.get_blobs_commit()){
-        std::string f_name = f.first;
-        std::string blob_id = f.second;
-        std::string content = load_object(blob_id);
-        Utils::writeContents(f_name, content);
-    }
-    for(auto &f : blob_now){
-        if(target.get_blobs_commit().find(f.first) == target.get_blobs_commit().end()){
-            if(Utils::isFile(f.first)){
-                Utils::restrictedDelete(f.first);
-            }
-        }
-    }
-    Utils::writeContents(headPath,branch_name);
-    clear_stage();
+    Stage_Area s = read_stage();
+    report_touched(switch_files(blob_now,blob_target,s));
+    s.clear();
+    write_stage(s);
+    write_cached(headPath,branch_name);
 }
 
 void Repository::checkoutFile(const std::string& file_name){
     ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
     std::string now_branch = branch_now();
     std::string commit_id = read_ref(now_branch);
     if(commit_id.empty()){
         Utils::exitWithMessage("No commit with that id exists.");
     }
-    Commit c = Commit::deserialize(load_object(commit_id));
-    auto blob = c.get_blobs_commit();
-    if(blob.find(file_name) == blob.end()){
+    Commit c = load_commit(commit_id);
+    std::string blob_id;
+    if(!c.get_files().find(file_name,blob_id)){
         Utils::exitWithMessage("File does not exist in that commit.");
     }
-    std::string blob_id = blob.at(file_name);
-    std::string content = load_object(blob_id);
-    Utils::writeContents(file_name,content);
+    write_working_file(file_name,blob_id);
 }
 
 void Repository::checkoutFileInCommit(const std::string& commit_id , const std::string& file_name){
     ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
     Commit c = load_commit_by_id(commit_id);
-    auto blob = c.get_blobs_commit();
-    if(blob.find(file_name) == blob.end()){
+    std::string blob_id;
+    if(!c.get_files().find(file_name,blob_id)){
         Utils::exitWithMessage("File does not exist in that commit.");
     }
-    std::string blob_id = blob.at(file_name);
-    std::string content = load_object(blob_id);
-    Utils::writeContents(file_name,content);
+    write_working_file(file_name,blob_id);
 }
 
 void Repository::status() const {
     ensure();
     //branch
     std::cout<<"=== Branches ===\n";
-    auto branches = Utils::plainFilenamesIn(refsDir);
-    std::string now = Utils::readContentsAsString(headPath);
+    std::vector<std::string> branches = ref_names();
+    std::string now = read_cached(headPath);
     std::sort(branches.begin(),branches.end());
     for(auto &b : branches){
         if(b == now){
@@ -406,6 +937,8 @@ void Repository::status() const {
     std::cout<<"\n";
     //stage
     std::cout<<"=== Staged Files ===\n";
+    FileStat index_stat;
+    bool had_index = Utils::statFile(indexPath,index_stat);
     Stage_Area s = read_stage();
     for(auto &f : s.files()){
         std::cout<<f.first<<"\n";
@@ -417,13 +950,86 @@ void Repository::status() const {
         std::cout<<f<<"\n";
     }
     std::cout<<"\n";
-
+    //modified & untracked
+    std::map<std::string,std::string> tracked;
+    std::string head_id = read_ref(now);
+    if(!head_id.empty()){
+        tracked = load_commit(head_id).get_files().files();
+    }
+    const std::map<std::string,std::string>& staged = s.files();
+    std::vector<std::string> working = Utils::filesUnder(".");
+    std::vector<std::string> known;
+    for(auto &f : working){
+        if(staged.count(f) || (tracked.count(f) && !s.isRemoved(f))){
+            known.push_back(f);
+        }
+    }
+    std::vector<std::string> blob_ids(known.size());
+    std::vector<FileStat> stats(known.size());
+    Utils::parallelFor(known.size(),[&](size_t i){
+        blob_ids[i] = working_blob_id(known[i],s,stats[i],false);
+    });
+
+    std::map<std::string,std::string> modified;
+    std::set<std::string> present(working.begin(),working.end());
+    bool refreshed = false;
+    for(size_t i = 0; i < known.size(); i++){
+        const std::string& f = known[i];
+        std::string cached;
+        if(!s.cached_blob(f,stats[i],cached)){
+            s.record(f,blob_ids[i],stats[i]);
+            refreshed = true;
+        }
+        auto st = staged.find(f);
+        const std::string& expected = st != staged.end() ? st->second : tracked[f];
+        if(blob_ids[i] != expected){
+            if(!legacy_match(f,expected)){
+                modified[f] = "modified";
+                continue;
+            }
+            s.record(f,expected,stats[i]);
+            refreshed = true;
+        }
+    }
+    for(auto &f : staged){
+        if(!present.count(f.first)){
+            modified[f.first] = "deleted";
+        }
+    }
+    for(auto &f : tracked){
+        if(!s.isRemoved(f.first) && !present.count(f.first)){
+            modified[f.first] = "deleted";
+        }
+    }
+    if(refreshed){
+        // The refreshed stat cache is only a hint: skip saving it rather
+        // than wait for a writer, or overwrite an index changed meanwhile.
+        LockFile lock(lockPath);
+        FileStat now_stat;
+        if(lock.try_acquire() && Utils::statFile(indexPath,now_stat) == had_index
+           && (!had_index || now_stat == index_stat)){
+            write_stage(s);
+        }
+    }
+    std::cout<<"=== Modifications Not Staged For Commit ===\n";
+    for(auto &f : modified){
+        std::cout<<f.first<<" ("<<f.second<<")\n";
+    }
+    std::cout<<"\n";
+    std::cout<<"=== Untracked Files ===\n";
+    for(auto &f : working){
+        if((!staged.count(f) && !tracked.count(f)) || s.isRemoved(f)){
+            std::cout<<f<<"\n";
+        }
+    }
+    std::cout<<"\n";
 }
 
 
 
 void Repository::branch(const std::string& name){
     ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
     std::string path = Utils::join(refsDir,name);
     if(Utils::exists(path)){
         Utils::exitWithMessage("A branch with that name already exists.");
@@ -435,6 +1041,7 @@ void Repository::branch(const std::string& name){
 
 void Repository::rm_branch(const std::string& name){
     ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
     std::string path = Utils::join(refsDir,name);
     if(!Utils::exists(path)){
         Utils::exitWithMessage("A branch with that name does not exist.");
@@ -448,15 +1055,16 @@ void Repository::rm_branch(const std::string& name){
 
 void Repository::reset(const std::string& commit_id){
     ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
     Commit target = load_commit_by_id(commit_id);
     std::string now_branch = branch_now();
     std::string now_commit_id = read_ref(now_branch);
+    std::map<std::string,std::string> target_blob = target.get_files().files();
     std::map<std::string,std::string> now_blob;
     if(!now_commit_id.empty()){
-        Commit now_commit = Commit::deserialize(load_object(now_commit_id));
-        now_blob = now_commit.get_blobs_commit();
+        now_blob = load_commit(now_commit_id).get_files().files();
     }
-    for(auto &f: target.get_blobs_commit()){
+    for(auto &f: target_blob){
         const std::string& f_name = f.first;
         if(!Utils::exists(f_name)){
             continue;
@@ -465,23 +1073,16 @@ void Repository::reset(const std::string& commit_id){
             Utils::exitWithMessage("There is an untracked file in the way; delete it, or add and commit it first.");
         }
     }
-    for(auto &f : target.get_blobs_commit()){
-        std::string content = load_object(f.second);
-        Utils::writeContents(f.first,content);
-    }
-    for(auto &f : now_blob){
-        if(target.get_blobs_commit().find(f.first) == target.get_blobs_commit().end()){
-            if(Utils::isFile(f.first)){
-                Utils::restrictedDelete(f.first);
-            }
-        }
-    }
+    Stage_Area s = read_stage();
+    report_touched(switch_files(now_blob,target_blob,s));
+    s.clear();
+    write_stage(s);
     write_ref(now_branch,target.get_id());
-    clear_stage();
 }
 
 void Repository::merge(const std::string& branch_name){
     ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
     Stage_Area s = read_stage();
     if(!s.empty()){
         Utils::exitWithMessage("You have uncommitted changes.");
@@ -495,180 +1096,959 @@ void Repository::merge(const std::string& branch_name){
         Utils::exitWithMessage("Cannot merge a branch with itself.");
     }
     std::string head_id = read_ref(now);
-    Commit head = Commit::deserialize(load_object(head_id));
-    Commit given = Commit::deserialize(load_object(given_ref));
-    std::set<std::string> head_former;
-    std::vector<std::string> stack = {head.get_id()};
-    while(!stack.empty()){
-        std::string id = stack.back();
-        stack.pop_back();
-        if(head_former.count(id)){
-            continue;
-        }
-        head_former.insert(id);
-        Commit c = Commit::deserialize(load_object(id));
-        for(auto &p : c.get_formers()){
-            stack.push_back(p);
-        }
-    }
-    std::string split_id;
-    std::vector<std::string> q = {given.get_id()};
-    std::set<std::string> v;
-    while(!q.empty()){
-        std::string id = q.front();
-        q.erase(q.begin());
-        if(head_former.count(id)){
-            split_id = id;
-            break;
-        }
-        if(v.count(id)){
-            continue;
-        }
-        v.insert(id);
-        Commit c = Commit::deserialize(load_object(id));
-        for(auto &p : c.get_formers()){
-            q.push_back(p);
-        }
-    }
+    Commit head = load_commit(head_id);
+    Commit given = load_commit(given_ref);
+    std::string split_id = split_point(head_id,given.get_id());
     if(split_id == given.get_id()){
         Utils::exitWithMessage("Given branch is an ancestor of the current branch.");
         return;
     }
+    const std::map<std::string,std::string> head_blob = head.get_files().files();
+    const std::map<std::string,std::string> given_blob = given.get_files().files();
     if(split_id == head_id){
+        for(auto &f : given_blob){
+            if(!head_blob.count(f.first) && Utils::isFile(f.first)){
+                Utils::exitWithMessage("There is an untracked file in the way; delete it, or add and commit it first.");
+            }
+        }
+        report_touched(switch_files(head_blob,given_blob,s));
+        write_stage(s);
         write_ref(now,given.get_id());
         Utils::exitWithMessage("Current branch fast-forwarded.");
         return;
     }
-    Commit split = Commit::deserialize(load_object(split_id));
-    auto split_blob = split.get_blobs_commit();
-    auto head_blob = head.get_blobs_commit();
-    auto given_blob = given.get_blobs_commit();
-    bool flag = false;
-    Stage_Area now_stage;
-    std::set<std::string> all_files;
-    for(auto &f : split_blob){
-        all_files.insert(f.first);
-    }
-    for(auto &f : head_blob){
-        all_files.insert(f.first);
-    }
-    for(auto &f : given_blob){
-        all_files.insert(f.first);
-    }
-    for(auto &f_name : all_files){
-        bool in_s = false;
-        if(split_blob.find(f_name) != split_blob.end()){
-            in_s = true;
-        }
-        bool in_h = false;
-        if(head_blob.find(f_name) != head_blob.end()){
-            in_h = true;
-        }
-        bool in_g = false;
-        if(given_blob.find(f_name) != given_blob.end()){
-            in_g = true;
-        }
-        std::string content_s = "";
-        if(in_s == true){
-            content_s = split_blob[f_name];
-        }
-        std::string content_h = "";
-        if(in_h == true){
-            content_h = head_blob[f_name];
-        }
-        std::string content_g = "";
-        if(in_g == true){
-            content_g = given_blob[f_name];
-        }
-        bool h_c = (in_s ? (content_s != content_h) : in_h);
-        bool g_c = (in_s ? (content_s != content_g) : in_g);
-        if(g_c == true && h_c == false){
-            if(in_g){
-                std::string content = load_object(content_g);
-                Utils::writeContents(f_name,content);
-                now_stage.add(f_name,content_g);
+    const std::map<std::string,std::string> split_blob = load_commit(split_id).get_files().files();
+
+    // One ordered pass over the three file lists sorts every path into
+    // files taken from the given branch, files it removed, and files
+    // changed on both sides.  Absent files have null ids.
+    struct Merge_File{
+        const std::string* name;
+        const std::string* split_id;
+        const std::string* head_id;
+        const std::string* given_id;
+        std::string merged_id;
+        bool conflict;
+    };
+    std::vector<std::pair<std::string,std::string>> taken;
+    std::vector<std::string> removed;
+    std::vector<Merge_File> both;
+    auto si = split_blob.begin();
+    auto hi = head_blob.begin();
+    auto gi = given_blob.begin();
+    while(si != split_blob.end() || hi != head_blob.end() || gi != given_blob.end()){
+        const std::string* f_name = nullptr;
+        if(si != split_blob.end()){
+            f_name = &si->first;
+        }
+        if(hi != head_blob.end() && (f_name == nullptr || hi->first < *f_name)){
+            f_name = &hi->first;
+        }
+        if(gi != given_blob.end() && (f_name == nullptr || gi->first < *f_name)){
+            f_name = &gi->first;
+        }
+        const std::string* s_id = nullptr;
+        const std::string* h_id = nullptr;
+        const std::string* g_id = nullptr;
+        if(si != split_blob.end() && si->first == *f_name){
+            s_id = &(si++)->second;
+        }
+        if(hi != head_blob.end() && hi->first == *f_name){
+            h_id = &(hi++)->second;
+        }
+        if(gi != given_blob.end() && gi->first == *f_name){
+            g_id = &(gi++)->second;
+        }
+        bool h_c = s_id ? (h_id == nullptr || *h_id != *s_id) : h_id != nullptr;
+        bool g_c = s_id ? (g_id == nullptr || *g_id != *s_id) : g_id != nullptr;
+        if(g_c && !h_c){
+            if(g_id){
+                taken.emplace_back(*f_name,*g_id);
             }
             else {
-                if(Utils::isFile(f_name)){
-                    Utils::restrictedDelete(f_name);
-                }
-                now_stage.mark_remove(f_name);
+                removed.push_back(*f_name);
             }
         }
+        else if(g_c && h_c && (h_id ? !g_id || *h_id != *g_id : g_id != nullptr)){
+            both.push_back(Merge_File{f_name,s_id,h_id,g_id,"",false});
+        }
+    }
+    for(auto &f : taken){
+        if(!head_blob.count(f.first) && Utils::isFile(f.first)){
+            Utils::exitWithMessage("There is an untracked file in the way; delete it, or add and commit it first.");
+        }
+    }
+    for(auto &f : both){
+        if(f.head_id == nullptr && Utils::isFile(*f.name)){
+            Utils::exitWithMessage("There is an untracked file in the way; delete it, or add and commit it first.");
+        }
+    }
+
+    // Merge the contents changed on both sides in parallel; each result
+    // is stored as a blob and written out with the taken files below.
+    Utils::parallelFor(both.size(),[&](size_t i){
+        Merge_File& f = both[i];
+        std::string head_c = f.head_id ? load_blob(*f.head_id).get_file_content() : "";
+        std::string given_c = f.given_id ? load_blob(*f.given_id).get_file_content() : "";
+        std::string merge_str;
+        if(f.head_id && f.given_id && !Merge3::is_binary(head_c) && !Merge3::is_binary(given_c)){
+            std::string split_c = f.split_id ? load_blob(*f.split_id).get_file_content() : "";
+            Merge3::Result result = Merge3::merge(split_c,head_c,given_c);
+            merge_str = std::move(result.text);
+            f.conflict = result.conflicts > 0;
+        }
         else {
-            if(h_c == true && g_c == false){
-                continue;
+            f.conflict = true;
+            std::ostringstream merge;
+            merge<<"<<<<<<< HEAD\n";
+            merge<<head_c;
+            if(!head_c.empty() && head_c.back() != '\n'){
+                merge<<"\n";
             }
-            else {
-                if(h_c == false && g_c == false){
-                    continue;
-                }
-                else {
-                    flag = true;
-                    std::string head_c = in_h ? load_object(content_h) : "";
-                    std::string given_c = in_g ? load_object(content_g) : "";
-                    std::ostringstream merge;
-                    merge<<"<<<<<<< HEAD\n";
-                    merge<<head_c;
-                    if(!head_c.empty() && head_c.back() != '\n'){
-                        merge<<"\n";
-                    }
-                    merge<<"=======\n";
-                    merge<<given_c;
-                    if(!given_c.empty() && given_c.back() != '\n'){
-                        merge<<"\n";
-                    }
-                    merge<<">>>>>>>\n";
-                    std::string merge_str = merge.str();
-                    Utils::writeContents(f_name,merge_str);
-                    Blob b(f_name,merge_str);
-                    save_blob(b);
-                    now_stage.add(f_name,b.get_sha());
-                }
+            merge<<"=======\n";
+            merge<<given_c;
+            if(!given_c.empty() && given_c.back() != '\n'){
+                merge<<"\n";
             }
+            merge<<">>>>>>>\n";
+            merge_str = merge.str();
         }
-        write_stage(now_stage);
-        if(flag){
-            Utils::message("Encountered a merge conflict.");
-            return;
+        Blob b(merge_str);
+        save_blob(b);
+        f.merged_id = b.get_sha();
+    });
+
+    Materializer out([this](const std::string& blob_id, const Utils::ByteSink& sink){
+        stream_blob(blob_id,sink);
+    });
+    bool flag = false;
+    for(auto &f : taken){
+        out.add(f.first,f.second);
+        s.add(f.first,f.second);
+    }
+    for(auto &f : both){
+        out.add(*f.name,f.merged_id);
+        s.add(*f.name,f.merged_id);
+        flag = flag || f.conflict;
+    }
+    out.run();
+    for(auto &f : out.files()){
+        s.record(f.path,f.blob_id,f.stat);
+    }
+    for(auto &f_name : removed){
+        if(Utils::isFile(f_name)){
+            Utils::restrictedDelete(f_name);
         }
-        std::string branch = now;
-        std::string former1 = head.get_id();
-        std::string former2 = given.get_id();
-        std::map<std::string,std::string> blob = head.get_blobs_commit();
-        Commit merge_commit("Merged"+branch_name+"into"+branch,
-                            std::vector<std::string>{former1,former2},blob,now_stage);
-        save_object(merge_commit.get_id(),merge_commit.serialize());
-        write_ref(branch,merge_commit.get_id());
-        clear_stage();
+        s.forget(f_name);
+        s.mark_remove(f_name);
     }
+    if(flag){
+        Utils::message("Encountered a merge conflict.");
+    }
+    Commit merge_commit("Merged "+branch_name+" into "+now+".",
+                        std::vector<std::string>{head_id,given.get_id()},save_tree(head.get_files(),s));
+    save_commit(merge_commit);
+    write_ref(now,merge_commit.get_id());
+    s.clear();
+    write_stage(s);
 }
 
+/** Packs every object reachable from a branch or the staging area into
+ *  one packfile and prunes the rest. */
+void Repository::gc(){
+    ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
+    std::vector<std::string> roots;
+    for(auto &ref : ref_names()){
+        roots.push_back(Utils::readContentsAsString(Utils::join(refsDir,ref)));
+    }
+    prune(roots);
+}
 
+/** Packs every object reachable from the commits ROOTS or the staging
+ *  area into one packfile and drops the rest.  Blobs are ordered by file
+ *  name so successive versions of a file sit next to each other and delta
+ *  well; within a name the newest version comes first and stays whole. */
+void Repository::prune(const std::vector<std::string>& roots) const {
+    std::vector<std::string> commits;
+    std::set<std::string> seen;
+    std::vector<std::string> trees;
+    std::set<std::string> seen_trees;
+    std::vector<std::pair<std::string,std::string>> blobs; // file name, blob id
+    std::set<std::string> seen_blobs;
+    std::vector<std::string> pending = roots;
+    for(size_t i = 0; i < pending.size(); i++){
+        const std::string id = pending[i];
+        if(id.empty() || !seen.insert(id).second){
+            continue;
+        }
+        Commit c = Commit::deserialize(load_object(ObjectType::Commit,id));
+        commits.push_back(id);
+        for(auto &f : c.get_files().files()){
+            if(seen_blobs.insert(f.second).second){
+                blobs.push_back({f.first,f.second});
+            }
+        }
+        std::vector<std::pair<std::string,std::string>> dirs; // path prefix, tree id
+        if(!c.get_tree().empty()){
+            dirs.push_back({"",c.get_tree()});
+        }
+        while(!dirs.empty()){
+            auto dir = dirs.back();
+            dirs.pop_back();
+            if(!seen_trees.insert(dir.second).second){
+                continue;
+            }
+            trees.push_back(dir.second);
+            Tree t = Tree::deserialize(load_object(ObjectType::Tree,dir.second));
+            for(auto &b : t.get_blobs()){
+                if(seen_blobs.insert(b.second).second){
+                    blobs.push_back({dir.first + b.first,b.second});
+                }
+            }
+            for(auto &sub : t.get_subtrees()){
+                dirs.push_back({dir.first + sub.first + "/",sub.second});
+            }
+        }
+        for(auto &p : c.get_formers()){
+            pending.push_back(p);
+        }
+    }
+    Stage_Area stage = read_stage();
+    for(auto &f : stage.files()){
+        if(seen_blobs.insert(f.second).second){
+            blobs.push_back({f.first,f.second});
+        }
+    }
+    std::stable_sort(blobs.begin(),blobs.end(),[](const std::pair<std::string,std::string>& a,
+                                                  const std::pair<std::string,std::string>& b){
+        return a.first < b.first;
+    });
+
+    std::vector<std::pair<ObjectType,std::string>> keep;
+    for(auto &id : commits){
+        keep.push_back({ObjectType::Commit,id});
+    }
+    for(auto &id : trees){
+        keep.push_back({ObjectType::Tree,id});
+    }
+    std::set<std::string> seen_chunks;
+    std::vector<std::string> chunks;
+    for(auto &b : blobs){
+        if(object_exist(ObjectType::Blob,b.second) || !object_exist(ObjectType::Manifest,b.second)){
+            keep.push_back({ObjectType::Blob,b.second});
+            continue;
+        }
+        keep.push_back({ObjectType::Manifest,b.second});
+        for(auto &chunk_id : load_manifest(b.second)){
+            if(seen_chunks.insert(chunk_id).second){
+                chunks.push_back(chunk_id);
+            }
+        }
+    }
+    for(auto &id : chunks){
+        keep.push_back({ObjectType::Chunk,id});
+    }
+    objects.repack(keep);
+    commitIndex.rebuild(commits);
+    rebuild_graph();
+}
 
+/** Returns enough of the stored object of blob BLOB_ID to tell its format
+ *  (see Blob::is_legacy): the start of a whole blob, or all of a manifest. */
+std::string Repository::blob_head(const std::string& blob_id) const {
+    std::string head;
+    std::unique_ptr<ObjectDecoder> in = objects.open(ObjectType::Blob,blob_id);
+    if(!in){
+        return load_object(ObjectType::Manifest,blob_id);
+    }
+    char buffer[64];
+    size_t n;
+    while(head.size() <= blob_id.size() && (n = in->read(buffer,sizeof(buffer))) > 0){
+        head.append(buffer,n);
+    }
+    return head;
+}
 
+/** True if working file FILE_NAME holds the content of BLOB_ID, an
+ *  old-format blob whose id also hashed the file name.  Until a repository
+ *  is migrated this keeps unchanged files equal to the commits naming
+ *  them; it only runs when the content-only ids already differ. */
+bool Repository::legacy_match(const std::string& file_name, const std::string& blob_id) const {
+    if(!Utils::isFile(file_name) || !Blob::is_legacy(blob_id,blob_head(blob_id))){
+        return false;
+    }
+    SHA1::SHA key;
+    key.update(file_name);
+    Utils::readChunks(file_name,[&](const char* data, size_t len){
+        key.update(data,len);
+    });
+    return key.final() == blob_id;
+}
 
+/** Returns the content-only id of blob BLOB_ID, storing the blob under it
+ *  first if BLOB_ID is in the old name-and-content format. */
+std::string Repository::migrate_blob(const std::string& blob_id) const {
+    bool manifest = !object_exist(ObjectType::Blob,blob_id);
+    std::string head = blob_head(blob_id);
+    if(!Blob::is_legacy(blob_id,head)){
+        return blob_id;
+    }
+    SHA1::SHA key = Blob::hasher();
+    stream_blob(blob_id,[&](const char* data, size_t len){
+        key.update(data,len);
+    });
+    std::string id = key.final();
+    if(blob_exist(id)){
+        return id;
+    }
+    if(manifest){
+        size_t name_end = head.find('\n',blob_id.size() + 1);
+        save_object(ObjectType::Manifest,id,head.substr(name_end + 1));
+    } else {
+        objects.save_stream(ObjectType::Blob,id,[&](ObjectEncoder& out){
+            stream_blob(blob_id,[&](const char* data, size_t len){
+                out.write(data,len);
+            });
+            return true;
+        });
+    }
+    return id;
+}
 
+/** Rewrites a repository whose blobs were keyed by file name and content
+ *  to content-only blob ids.  Commit ids hash their blob ids, so every
+ *  commit naming an old blob is rewritten too, parents first; branches and
+ *  the staging area move to the new ids and the old objects are pruned. */
+void Repository::migrate(){
+    ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
+    std::vector<std::pair<uint32_t,std::string>> order; // generation, commit id
+    {
+        CommitGraph::View g = commitGraph.view();
+        for(uint32_t pos = 0; pos < g.size(); pos++){
+            order.push_back({g.generation(pos),g.id(pos)});
+        }
+    }
+    std::sort(order.begin(),order.end());
+    std::map<std::string,std::string> blob_ids;   // old id -> new id
+    std::map<std::string,std::string> commit_ids; // old id -> new id
+    auto new_blob = [&](const std::string& id){
+        auto it = blob_ids.find(id);
+        if(it == blob_ids.end()){
+            it = blob_ids.emplace(id,migrate_blob(id)).first;
+        }
+        return it->second;
+    };
+    for(auto &o : order){
+        Commit c = load_commit(o.second);
+        std::map<std::string,std::string> old_files = c.get_files().files();
+        std::map<std::string,std::string> files;
+        for(auto &f : old_files){
+            files[f.first] = new_blob(f.second);
+        }
+        std::vector<std::string> formers;
+        for(auto &p : c.get_formers()){
+            formers.push_back(commit_ids.count(p) ? commit_ids[p] : p);
+        }
+        if(files == old_files && formers == c.get_formers()){
+            commit_ids[o.second] = o.second;
+            continue;
+        }
+        Commit migrated(c.get_message(),formers,save_tree(files.begin(),files.end(),0),c.get_timestamp());
+        save_commit(migrated);
+        commit_ids[o.second] = migrated.get_id();
+    }
+    for(auto &ref : ref_names()){
+        std::string id = read_ref(ref);
+        if(commit_ids.count(id) && commit_ids[id] != id){
+            write_ref(ref,commit_ids[id]);
+        }
+    }
+    Stage_Area s = read_stage();
+    Stage_Area migrated;
+    for(auto &f : s.files()){
+        migrated.add(f.first,new_blob(f.second));
+    }
+    for(auto &f : s.removedFiles()){
+        migrated.mark_remove(f);
+    }
+    write_stage(migrated);
+    std::vector<std::string> roots;
+    for(auto &c : commit_ids){
+        roots.push_back(c.second);
+    }
+    prune(roots);
+}
 
+/** Maps each file of TRACKED and of the stage that is present in the
+ *  working tree to the blob id of its working content. */
+std::map<std::string,std::string> Repository::working_files(const std::map<std::string,std::string>& tracked) const {
+    Stage_Area s = read_stage();
+    std::vector<std::string> names;
+    for(auto &f : tracked){
+        names.push_back(f.first);
+    }
+    for(auto &f : s.files()){
+        if(!tracked.count(f.first)){
+            names.push_back(f.first);
+        }
+    }
+    std::vector<std::string> blob_ids(names.size());
+    Utils::parallelFor(names.size(),[&](size_t i){
+        FileStat st;
+        if(Utils::isFile(names[i])){
+            blob_ids[i] = working_blob_id(names[i],s,st,false);
+        }
+    });
+    std::map<std::string,std::string> files;
+    for(size_t i = 0; i < names.size(); i++){
+        if(!blob_ids[i].empty()){
+            files[names[i]] = blob_ids[i];
+        }
+    }
+    return files;
+}
 
+/** Prints a unified diff of every file that differs between FROM and TO
+ *  (file name -> blob id).  Both maps are walked in order together and
+ *  files with equal blob ids are skipped without being read.  With
+ *  WORKTREE set, the files of TO are read from the working tree. */
+void Repository::print_diff(const std::map<std::string,std::string>& from,
+                            const std::map<std::string,std::string>& to, bool worktree) const {
+    auto a = from.begin();
+    auto b = to.begin();
+    while(a != from.end() || b != to.end()){
+        bool in_a = a != from.end() && (b == to.end() || a->first <= b->first);
+        bool in_b = b != to.end() && (a == from.end() || b->first <= a->first);
+        const std::string& f_name = in_a ? a->first : b->first;
+        bool same = in_a && in_b && a->second == b->second;
+        std::string old_c, new_c;
+        if(!same){
+            old_c = in_a ? load_blob(a->second).get_file_content() : "";
+            if(in_b){
+                new_c = worktree ? Utils::readContentsAsString(f_name) : load_blob(b->second).get_file_content();
+            }
+            // Blobs written before content-only ids differ in id alone.
+            same = in_a && in_b && old_c == new_c;
+        }
+        if(!same){
+            std::string old_name = in_a ? "a/"+f_name : "/dev/null";
+            std::string new_name = in_b ? "b/"+f_name : "/dev/null";
+            std::cout<<"diff --git a/"<<f_name<<" b/"<<f_name<<"\n";
+            if(Merge3::is_binary(old_c) || Merge3::is_binary(new_c)){
+                std::cout<<"Binary files "<<old_name<<" and "<<new_name<<" differ\n";
+            }
+            else {
+                std::cout<<"--- "<<old_name<<"\n";
+                std::cout<<"+++ "<<new_name<<"\n";
+                Diff::unified(old_c,new_c,std::cout);
+            }
+        }
+        if(in_a){
+            ++a;
+        }
+        if(in_b){
+            ++b;
+        }
+    }
+}
 
+/** Shows the changes in the working tree since the head commit. */
+void Repository::diff() const {
+    ensure();
+    std::string head_id = read_ref(branch_now());
+    if(head_id.empty()){
+        Utils::exitWithMessage("No commit with that id exists.");
+    }
+    const std::map<std::string,std::string> tracked = load_commit(head_id).get_files().files();
+    print_diff(tracked,working_files(tracked),true);
+}
 
+/** Shows the changes in the working tree since commit COMMIT_ID. */
+void Repository::diff(const std::string& commit_id) const {
+    ensure();
+    const std::map<std::string,std::string> tracked = load_commit_by_id(commit_id).get_files().files();
+    print_diff(tracked,working_files(tracked),true);
+}
 
+/** Shows the changes from commit FROM_ID to commit TO_ID. */
+void Repository::diff(const std::string& from_id, const std::string& to_id) const {
+    ensure();
+    Commit from = load_commit_by_id(from_id);
+    Commit to = load_commit_by_id(to_id);
+    print_diff(from.get_files().files(),to.get_files().files(),false);
+}
 
+/** Returns the .gitlite directory of remote NAME. */
+std::string Repository::remote_dir(const std::string& name) const {
+    std::string path = Utils::join(remotesDir,name);
+    if(!Utils::isFile(path)){
+        Utils::exitWithMessage("A remote with that name does not exist.");
+    }
+    std::string dir = Utils::readContentsAsString(path);
+    if(!Utils::isDirectory(dir)){
+        Utils::exitWithMessage("Remote directory not found.");
+    }
+    return dir;
+}
 
+/** Returns the commit that REV names: a branch, or a commit id. */
+std::string Repository::resolve_rev(const std::string& rev) const {
+    if(is_ref_name(rev) && Utils::isFile(Utils::join(refsDir,rev))){
+        return read_ref(rev);
+    }
+    std::string id;
+    int matches = commitIndex.resolve(rev,id);
+    if(matches == 0){
+        Utils::exitWithMessage("No commit with that id exists.");
+    }
+    if(matches > 1){
+        Utils::exitWithMessage("Ambiguous commit id.");
+    }
+    return id;
+}
 
+/** Returns, parents first, every commit reachable from HEADS that HAS
+ *  does not report, and adds to PREREQUISITES the commits HAS reports
+ *  that they have as parents.  The walk stops at those commits, whose
+ *  history and content the receiver then has as well, so the work grows
+ *  with the new history rather than with either repository. */
+std::vector<std::string> Repository::missing_commits(const std::vector<std::string>& heads, const Has& has,
+                                                     std::vector<std::string>& prerequisites) const {
+    std::vector<std::string> commits;
+    std::set<std::string> seen;
+    std::vector<std::pair<std::string,bool>> stack;
+    for(auto &h : heads){
+        stack.emplace_back(h,false);
+    }
+    while(!stack.empty()){
+        std::pair<std::string,bool> top = stack.back();
+        stack.pop_back();
+        if(top.second){
+            commits.push_back(top.first);
+            continue;
+        }
+        if(!seen.insert(top.first).second){
+            continue;
+        }
+        if(has(ObjectType::Commit,top.first)){
+            prerequisites.push_back(top.first);
+            continue;
+        }
+        CommitView c = load_commit_view(top.first);
+        stack.emplace_back(top.first,true);
+        for(auto &p : c.get_formers()){
+            stack.emplace_back(p,false);
+        }
+    }
+    return commits;
+}
 
+/** Adds to TREES, children first, tree TREE_ID and every subtree of it
+ *  that HAS does not report, and to BLOBS the blobs they name.  A tree
+ *  the receiver has is skipped with everything below it. */
+void Repository::missing_trees(const std::string& tree_id, const Has& has, std::set<std::string>& seen,
+                               std::vector<std::string>& trees, std::set<std::string>& blobs) const {
+    if(!seen.insert(tree_id).second || has(ObjectType::Tree,tree_id)){
+        return;
+    }
+    Tree t = Tree::deserialize(load_object(ObjectType::Tree,tree_id));
+    for(auto &b : t.get_blobs()){
+        blobs.insert(b.second);
+    }
+    for(auto &sub : t.get_subtrees()){
+        missing_trees(sub.second,has,seen,trees,blobs);
+    }
+    trees.push_back(tree_id);
+}
 
+/** Returns every object COMMITS need that HAS does not report: chunks
+ *  and whole blobs, then manifests, trees children first, and COMMITS.
+ *  Copied in this order, an interrupted transfer never leaves an object
+ *  whose parts are missing. */
+std::vector<std::pair<ObjectType,std::string>> Repository::missing_objects(
+        const std::vector<std::string>& commits, const Has& has) const {
+    std::vector<std::string> trees;
+    std::set<std::string> tree_seen, blobs;
+    for(auto &id : commits){
+        CommitView c = load_commit_view(id);
+        if(c.get_tree().empty()){
+            for(auto &f : c.get_blobs_commit()){
+                blobs.insert(f.second);
+            }
+        }
+        else {
+            missing_trees(c.get_tree(),has,tree_seen,trees,blobs);
+        }
+    }
+    std::vector<std::pair<ObjectType,std::string>> list, manifests;
+    std::set<std::string> chunk_seen;
+    for(auto &b : blobs){
+        if(has(ObjectType::Blob,b)){
+            continue;
+        }
+        if(object_exist(ObjectType::Blob,b)){
+            list.emplace_back(ObjectType::Blob,b);
+            continue;
+        }
+        for(auto &chunk : load_manifest(b)){
+            if(chunk_seen.insert(chunk).second && !has(ObjectType::Chunk,chunk)){
+                list.emplace_back(ObjectType::Chunk,chunk);
+            }
+        }
+        manifests.emplace_back(ObjectType::Manifest,b);
+    }
+    list.insert(list.end(),manifests.begin(),manifests.end());
+    for(auto &t : trees){
+        list.emplace_back(ObjectType::Tree,t);
+    }
+    for(auto &c : commits){
+        list.emplace_back(ObjectType::Commit,c);
+    }
+    return list;
+}
 
+/** Records COMMITS, whose objects are all stored, in the commit index
+ *  and the commit graph. */
+void Repository::add_commits(const std::vector<std::string>& commits) const {
+    commitIndex.add(commits);
+    if(!commitGraph.exists()){
+        return;
+    }
+    std::vector<CommitGraph::Node> nodes;
+    for(auto &id : commits){
+        CommitView c = load_commit_view(id);
+        nodes.push_back(CommitGraph::Node{id,c.get_formers(),c.get_timestamp()});
+    }
+    if(!commitGraph.add(nodes)){
+        rebuild_graph();
+    }
+}
 
+/** Checks PACK, brought by bundle B, before anything refers to it:
+ *  every object must hash to the id it is stored under, and every commit
+ *  in it must find its parents, its trees and their blobs in PACK or in
+ *  this repository, as must the refs of B.  The objects of this
+ *  repository are complete already, so each object in PACK only checks
+ *  the objects it names directly.  Throws std::runtime_error if not. */
+void Repository::check_pack(const Pack& pack, const Bundle& b) const {
+    auto has = [&](ObjectType type, const std::string& id){
+        if(type == ObjectType::Commit){
+            return pack.contains(type,id) || commitIndex.contains(id);
+        }
+        return pack.contains(type,id) || object_exist(type,id);
+    };
+    auto read = [&](ObjectType type, const std::string& id){
+        std::string data;
+        if(!pack.read(type,id,data)){
+            if(!object_exist(type,id)){
+                throw std::runtime_error("missing object " + id);
+            }
+            data = load_object(type,id);
+        }
+        return data;
+    };
+    auto expect = [](bool ok, const std::string& id){
+        if(!ok){
+            throw std::runtime_error("bad object " + id);
+        }
+    };
+    // A blob of the old format hashes its file name and content.
+    auto blob_name = [&](const std::string& id, const std::string& data){
+        size_t name_end = data.find('\n',id.size() + 1);
+        expect(name_end != std::string::npos,id);
+        return data.substr(id.size() + 1,name_end - id.size() - 1);
+    };
+    std::vector<std::string> ids;
+    pack.ids(ObjectType::Chunk,ids);
+    for(auto &id : ids){
+        expect(Utils::sha1(read(ObjectType::Chunk,id)) == id,id);
+    }
+    ids.clear();
+    pack.ids(ObjectType::Blob,ids);
+    for(auto &id : ids){
+        std::string data = read(ObjectType::Blob,id);
+        if(Blob::is_legacy(id,data)){
+            std::string name = blob_name(id,data);
+            expect(Utils::sha1(name,data.substr(id.size() + name.size() + 2)) == id,id);
+            continue;
+        }
+        SHA1::SHA key = Blob::hasher();
+        key.update(data);
+        expect(key.final() == id,id);
+    }
+    ids.clear();
+    pack.ids(ObjectType::Manifest,ids);
+    for(auto &id : ids){
+        std::string manifest = read(ObjectType::Manifest,id);
+        SHA1::SHA key = Blob::hasher();
+        if(Blob::is_legacy(id,manifest)){
+            key = SHA1::SHA();
+            key.update(blob_name(id,manifest));
+        }
+        for(auto &chunk : manifest_chunks(id,manifest)){
+            key.update(read(ObjectType::Chunk,chunk));
+        }
+        expect(key.final() == id,id);
+    }
+    auto has_blob = [&](const std::string& id){
+        return has(ObjectType::Blob,id) || has(ObjectType::Manifest,id);
+    };
+    ids.clear();
+    pack.ids(ObjectType::Tree,ids);
+    for(auto &id : ids){
+        std::string data = read(ObjectType::Tree,id);
+        expect(Utils::sha1("tree\n",data) == id,id);
+        Tree t = Tree::deserialize(data);
+        for(auto &blob : t.get_blobs()){
+            expect(has_blob(blob.second),id);
+        }
+        for(auto &sub : t.get_subtrees()){
+            expect(has(ObjectType::Tree,sub.second),id);
+        }
+    }
+    ids.clear();
+    pack.ids(ObjectType::Commit,ids);
+    for(auto &id : ids){
+        Commit c = Commit::deserialize(read(ObjectType::Commit,id));
+        expect(c.get_id() == id && c.compute_id() == id,id);
+        for(auto &former : c.get_formers()){
+            expect(has(ObjectType::Commit,former),id);
+        }
+        if(c.get_tree().empty()){
+            for(auto &f : c.get_files().files()){
+                expect(has_blob(f.second),id);
+            }
+        }
+        else {
+            expect(has(ObjectType::Tree,c.get_tree()),id);
+        }
+    }
+    for(auto &ref : b.refs){
+        expect(has(ObjectType::Commit,ref.commit_id),ref.commit_id);
+    }
+}
 
+/** Installs the objects of bundle B, whose prerequisites this repository
+ *  must have, and returns the commits it brought.  A bundle whose objects
+ *  do not check out is not installed. */
+std::vector<std::string> Repository::receive_bundle(const Bundle& b) const {
+    for(auto &id : b.prerequisites){
+        if(!commitIndex.contains(id)){
+            Utils::exitWithMessage("Repository lacks prerequisite commit " + id + ".");
+        }
+    }
+    std::vector<std::string> commits;
+    try{
+        commits = objects.import_pack(b.pack,b.pack_size,b.index,b.index_size,[&](const Pack& pack){
+            check_pack(pack,b);
+        });
+    }
+    catch(const std::runtime_error&){
+        Utils::exitWithMessage("Bad bundle file.");
+    }
+    add_commits(commits);
+    return commits;
+}
 
+/** Copies every commit reachable from HEAD_ID in FROM that this
+ *  repository lacks, with the objects they need.  Up to
+ *  Bundle::unpack_limit() objects are copied one by one as loose files,
+ *  linked where possible; anything larger is streamed into one pack from
+ *  the stored bytes of the objects, as a bundle would carry it, so the
+ *  cost per object is a memory copy rather than a file. */
+void Repository::copy_history(const Repository& from, const std::string& head_id) const {
+    bool shared = true;
+    Has has = [&](ObjectType type, const std::string& id){
+        if(type == ObjectType::Commit){
+            return commitIndex.contains(id);
+        }
+        if(!shared){
+            return false;
+        }
+        return type == ObjectType::Blob ? blob_exist(id) : object_exist(type,id);
+    };
+    std::vector<std::string> prerequisites;
+    std::vector<std::string> commits = from.missing_commits({head_id},has,prerequisites);
+    if(commits.empty()){
+        return;
+    }
+    // Sharing no history, this repository holds few if any of the
+    // objects, so they are all sent rather than looked up one by one;
+    // the few duplicates are harmless.
+    shared = !prerequisites.empty();
+    std::vector<std::pair<ObjectType,std::string>> list = from.missing_objects(commits,has);
+    if(list.size() >= Bundle::unpack_limit()){
+        objects.copy_pack(from.objects,list);
+        add_commits(commits);
+        return;
+    }
+    auto copy = [&](size_t i){
+        if(!objects.copy_from(from.objects,list[i].first,list[i].second)){
+            throw std::runtime_error("missing object " + list[i].second);
+        }
+    };
+    size_t parts = 0;
+    while(parts < list.size() && (list[parts].first == ObjectType::Chunk || list[parts].first == ObjectType::Blob)){
+        parts++;
+    }
+    size_t manifests = parts;
+    while(manifests < list.size() && list[manifests].first == ObjectType::Manifest){
+        manifests++;
+    }
+    Utils::parallelFor(parts,copy);
+    Utils::parallelFor(manifests - parts,[&](size_t k){ copy(parts + k); });
+    for(size_t i = manifests; i < list.size(); i++){
+        copy(i);
+    }
+    add_commits(commits);
+}
 
+void Repository::addRemote(const std::string& name, const std::string& dir){
+    ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
+    std::string path = Utils::join(remotesDir,name);
+    if(Utils::exists(path)){
+        Utils::exitWithMessage("A remote with that name already exists.");
+    }
+    Utils::writeAtomic(path,dir);
+}
 
+void Repository::rmRemote(const std::string& name){
+    ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
+    std::string path = Utils::join(remotesDir,name);
+    if(!Utils::exists(path)){
+        Utils::exitWithMessage("A remote with that name does not exist.");
+    }
+    std::remove(path.c_str());
+}
 
+/** Appends the commits of the current branch to BRANCH_NAME of the
+ *  remote, which must not have moved past the local history. */
+void Repository::push(const std::string& remote_name, const std::string& branch_name){
+    ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
+    Repository remote(remote_dir(remote_name));
+    remote.ensure();
+    std::unique_ptr<LockFile> remote_lock = remote.lock_repository();
+    std::string head_id = read_ref(branch_now());
+    std::string remote_head = remote.read_ref(branch_name);
+    if(!remote_head.empty() && !is_ancestor(remote_head,head_id)){
+        Utils::exitWithMessage("Please pull down remote changes before pushing.");
+    }
+    remote.copy_history(*this,head_id);
+    remote.write_ref(branch_name,head_id);
+}
 
+/** Copies branch BRANCH_NAME of the remote, with the history this
+ *  repository lacks, to the local branch REMOTE_NAME/BRANCH_NAME. */
+void Repository::fetch(const std::string& remote_name, const std::string& branch_name){
+    ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
+    Repository remote(remote_dir(remote_name));
+    std::string remote_head = remote.read_ref(branch_name);
+    if(remote_head.empty()){
+        Utils::exitWithMessage("That remote does not have that branch.");
+    }
+    copy_history(remote,remote_head);
+    write_ref(remote_name + "/" + branch_name,remote_head);
+}
 
+void Repository::pull(const std::string& remote_name, const std::string& branch_name){
+    fetch(remote_name,branch_name);
+    merge(remote_name + "/" + branch_name);
+}
 
+/** Writes to FILE a bundle of the branches or commits REVS, the current
+ *  branch if there are none, with every commit and object they need.  A
+ *  rev written ^REV is a basis: its history is left out, and the commits
+ *  where the bundle's history meets it become prerequisites that the
+ *  receiver must have.  Objects in the snapshots of the prerequisites
+ *  are left out as well. */
+void Repository::bundleCreate(const std::string& file, const std::vector<std::string>& revs) const {
+    ensure();
+    Bundle b;
+    std::vector<std::string> heads, basis;
+    for(auto &rev : revs){
+        if(!rev.empty() && rev[0] == '^'){
+            basis.push_back(resolve_rev(rev.substr(1)));
+            continue;
+        }
+        heads.push_back(resolve_rev(rev));
+        b.refs.push_back(Bundle::Ref{rev,heads.back()});
+    }
+    if(revs.empty()){
+        std::string branch = branch_now();
+        heads.push_back(read_ref(branch));
+        b.refs.push_back(Bundle::Ref{branch,heads.back()});
+    }
+    std::set<std::string> have_trees, have_blobs, have_chunks;
+    Has has = [&](ObjectType type, const std::string& id){
+        switch(type){
+        case ObjectType::Commit:
+            for(auto &base : basis){
+                if(is_ancestor(id,base)){
+                    return true;
+                }
+            }
+            return false;
+        case ObjectType::Tree:
+            return have_trees.count(id) > 0;
+        case ObjectType::Chunk:
+            return have_chunks.count(id) > 0;
+        default:
+            return have_blobs.count(id) > 0;
+        }
+    };
+    std::vector<std::string> commits = missing_commits(heads,has,b.prerequisites);
+    if(commits.empty()){
+        Utils::exitWithMessage("Refusing to create empty bundle.");
+    }
+    Has nothing = [](ObjectType, const std::string&){ return false; };
+    std::set<std::string> seen;
+    std::vector<std::string> trees;
+    for(auto &id : b.prerequisites){
+        CommitView c = load_commit_view(id);
+        if(c.get_tree().empty()){
+            for(auto &f : c.get_blobs_commit()){
+                have_blobs.insert(f.second);
+            }
+        }
+        else {
+            missing_trees(c.get_tree(),nothing,seen,trees,have_blobs);
+        }
+    }
+    have_trees.insert(trees.begin(),trees.end());
+    for(auto &blob : have_blobs){
+        if(!object_exist(ObjectType::Blob,blob)){
+            for(auto &chunk : load_manifest(blob)){
+                have_chunks.insert(chunk);
+            }
+        }
+    }
+    std::vector<std::pair<ObjectType,std::string>> list = missing_objects(commits,has);
+    b.write(file,[&](const Utils::ByteSink& sink, std::string& index){
+        objects.export_pack(list,sink,index);
+    });
+}
 
-
-
+/** Stores the history carried by bundle FILE and lists the refs in it.
+ *  Like git, no local ref is changed; they can be created from the
+ *  listed commits. */
+void Repository::bundleUnbundle(const std::string& file){
+    ensure();
+    std::unique_ptr<LockFile> lock = lock_repository();
+    Bundle b;
+    try{
+        b = Bundle::read(file);
+    }
+    catch(const std::runtime_error&){
+        Utils::exitWithMessage("Not a bundle file.");
+    }
+    receive_bundle(b);
+    for(auto &ref : b.refs){
+        std::cout << ref.commit_id << " " << ref.name << std::endl;
+    }
+}
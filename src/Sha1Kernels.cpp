@@ -0,0 +1,373 @@
+#include "../include/Sha1Kernels.h"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GITLITE_SHA1_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/** SHA-1 compression kernels.
+ *
+ *  reference  the textbook loop with per-round f/K selection, kept as the
+ *             oracle the others are tested against.
+ *  scalar     fully unrolled rounds over a 16-word rolling schedule.
+ *  sse4.1     message schedule (W[t] + K) computed four words at a time,
+ *             rounds in scalar code.
+ *  avx2       the same schedule for two blocks at once, one per 128-bit
+ *             lane.
+ *  sha-ni     the SHA1RNDS4/SHA1MSG* instructions.
+ */
+namespace SHA1 {
+    namespace {
+        const uint32_t K1 = 0x5a827999;
+        const uint32_t K2 = 0x6ed9eba1;
+        const uint32_t K3 = 0x8f1bbcdc;
+        const uint32_t K4 = 0xca62c1d6;
+
+        inline uint32_t rol(uint32_t x, int n) {
+            return (x << n) | (x >> (32 - n));
+        }
+
+        inline uint32_t load_be32(const uint8_t* p) {
+            return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+        }
+
+        /* ---- reference ---- */
+
+        uint32_t kt(int t) {
+            if (t < 20)
+                return K1;
+            else if (t < 40)
+                return K2;
+            else if (t < 60)
+                return K3;
+            else
+                return K4;
+        }
+
+        uint32_t ft(int t, uint32_t b, uint32_t c, uint32_t d) {
+            if (t < 20)
+                return (b & c) | ((~b) & d);
+            else if (t < 40)
+                return b ^ c ^ d;
+            else if (t < 60)
+                return (b & c) | (b & d) | (c & d);
+            else
+                return b ^ c ^ d;
+        }
+
+        void compress_reference(uint32_t state[5], const uint8_t* data, size_t blocks) {
+            for (; blocks > 0; blocks--, data += 64) {
+                uint32_t w[80];
+                for (int i = 0; i < 16; i++) {
+                    w[i] = load_be32(data + 4 * i);
+                }
+                for (int i = 16; i < 80; i++) {
+                    w[i] = rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+                }
+                uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+                for (int j = 0; j < 80; j++) {
+                    uint32_t temp = rol(a, 5) + ft(j, b, c, d) + e + kt(j) + w[j];
+                    e = d;
+                    d = c;
+                    c = rol(b, 30);
+                    b = a;
+                    a = temp;
+                }
+                state[0] += a;
+                state[1] += b;
+                state[2] += c;
+                state[3] += d;
+                state[4] += e;
+            }
+        }
+
+        /* ---- unrolled scalar ---- */
+
+#define SHA1_F1(b, c, d) (((b) & ((c) ^ (d))) ^ (d))
+#define SHA1_F2(b, c, d) ((b) ^ (c) ^ (d))
+#define SHA1_F3(b, c, d) (((b) & (c)) | (((b) | (c)) & (d)))
+
+/* One round with the variables renamed instead of shifted: afterwards the
+ * roles of (a, b, c, d, e) have moved one position to the right. */
+#define SHA1_ROUND(a, b, c, d, e, f, x) \
+        e += rol(a, 5) + f(b, c, d) + (x); \
+        b = rol(b, 30);
+
+#define SHA1_ROUNDS5(f, x0, x1, x2, x3, x4) \
+        SHA1_ROUND(a, b, c, d, e, f, x0) \
+        SHA1_ROUND(e, a, b, c, d, f, x1) \
+        SHA1_ROUND(d, e, a, b, c, f, x2) \
+        SHA1_ROUND(c, d, e, a, b, f, x3) \
+        SHA1_ROUND(b, c, d, e, a, f, x4)
+
+        /** W[t] for t >= 16 over a 16-entry ring; T is a constant after
+         *  unrolling, so the indices fold. */
+        inline uint32_t schedule(uint32_t w[16], int t) {
+            w[t & 15] = rol(w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15], 1);
+            return w[t & 15];
+        }
+
+        void compress_scalar(uint32_t state[5], const uint8_t* data, size_t blocks) {
+            for (; blocks > 0; blocks--, data += 64) {
+                uint32_t w[16];
+                for (int i = 0; i < 16; i++) {
+                    w[i] = load_be32(data + 4 * i);
+                }
+                uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+#define S(t) schedule(w, t)
+                SHA1_ROUNDS5(SHA1_F1, K1 + w[0], K1 + w[1], K1 + w[2], K1 + w[3], K1 + w[4])
+                SHA1_ROUNDS5(SHA1_F1, K1 + w[5], K1 + w[6], K1 + w[7], K1 + w[8], K1 + w[9])
+                SHA1_ROUNDS5(SHA1_F1, K1 + w[10], K1 + w[11], K1 + w[12], K1 + w[13], K1 + w[14])
+                SHA1_ROUNDS5(SHA1_F1, K1 + w[15], K1 + S(16), K1 + S(17), K1 + S(18), K1 + S(19))
+                SHA1_ROUNDS5(SHA1_F2, K2 + S(20), K2 + S(21), K2 + S(22), K2 + S(23), K2 + S(24))
+                SHA1_ROUNDS5(SHA1_F2, K2 + S(25), K2 + S(26), K2 + S(27), K2 + S(28), K2 + S(29))
+                SHA1_ROUNDS5(SHA1_F2, K2 + S(30), K2 + S(31), K2 + S(32), K2 + S(33), K2 + S(34))
+                SHA1_ROUNDS5(SHA1_F2, K2 + S(35), K2 + S(36), K2 + S(37), K2 + S(38), K2 + S(39))
+                SHA1_ROUNDS5(SHA1_F3, K3 + S(40), K3 + S(41), K3 + S(42), K3 + S(43), K3 + S(44))
+                SHA1_ROUNDS5(SHA1_F3, K3 + S(45), K3 + S(46), K3 + S(47), K3 + S(48), K3 + S(49))
+                SHA1_ROUNDS5(SHA1_F3, K3 + S(50), K3 + S(51), K3 + S(52), K3 + S(53), K3 + S(54))
+                SHA1_ROUNDS5(SHA1_F3, K3 + S(55), K3 + S(56), K3 + S(57), K3 + S(58), K3 + S(59))
+                SHA1_ROUNDS5(SHA1_F2, K4 + S(60), K4 + S(61), K4 + S(62), K4 + S(63), K4 + S(64))
+                SHA1_ROUNDS5(SHA1_F2, K4 + S(65), K4 + S(66), K4 + S(67), K4 + S(68), K4 + S(69))
+                SHA1_ROUNDS5(SHA1_F2, K4 + S(70), K4 + S(71), K4 + S(72), K4 + S(73), K4 + S(74))
+                SHA1_ROUNDS5(SHA1_F2, K4 + S(75), K4 + S(76), K4 + S(77), K4 + S(78), K4 + S(79))
+#undef S
+                state[0] += a;
+                state[1] += b;
+                state[2] += c;
+                state[3] += d;
+                state[4] += e;
+            }
+        }
+
+        /** The 80 rounds given a precomputed WK[t] = W[t] + K(t). */
+        inline __attribute__((always_inline)) void rounds_wk(uint32_t state[5], const uint32_t wk[80]) {
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+            _Pragma("GCC unroll 4")
+            for (int t = 0; t < 20; t += 5) {
+                SHA1_ROUNDS5(SHA1_F1, wk[t], wk[t + 1], wk[t + 2], wk[t + 3], wk[t + 4])
+            }
+            _Pragma("GCC unroll 4")
+            for (int t = 20; t < 40; t += 5) {
+                SHA1_ROUNDS5(SHA1_F2, wk[t], wk[t + 1], wk[t + 2], wk[t + 3], wk[t + 4])
+            }
+            _Pragma("GCC unroll 4")
+            for (int t = 40; t < 60; t += 5) {
+                SHA1_ROUNDS5(SHA1_F3, wk[t], wk[t + 1], wk[t + 2], wk[t + 3], wk[t + 4])
+            }
+            _Pragma("GCC unroll 4")
+            for (int t = 60; t < 80; t += 5) {
+                SHA1_ROUNDS5(SHA1_F2, wk[t], wk[t + 1], wk[t + 2], wk[t + 3], wk[t + 4])
+            }
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+        }
+
+#ifdef GITLITE_SHA1_X86
+        /* ---- SSE4.1 message schedule ---- */
+
+        /* Vector V[i] holds W[4i .. 4i+3].  For 16 <= t < 32 the newest
+         * word depends on the oldest word of the same vector, which is
+         * patched in afterwards; from t = 32 on the equivalent recurrence
+         * W[t] = rol2(W[t-6] ^ W[t-16] ^ W[t-28] ^ W[t-32]) has no
+         * intra-vector dependency.  The same code serves the 256-bit
+         * variant because every operation used stays within a 128-bit
+         * lane. */
+#define SHA1_VEC_SCHEDULE(T, XOR, SRLI_BYTES, SLLI_BYTES, ALIGNR, SLLI32, SRLI32, V) \
+        _Pragma("GCC unroll 4") \
+        for (int i = 4; i < 8; i++) { \
+            T x = XOR(XOR(SRLI_BYTES(V[i - 1], 4), V[i - 2]), \
+                      XOR(ALIGNR(V[i - 3], V[i - 4], 8), V[i - 4])); \
+            x = XOR(SLLI32(x, 1), SRLI32(x, 31)); \
+            T fix = SLLI_BYTES(x, 12); \
+            V[i] = XOR(x, XOR(SLLI32(fix, 1), SRLI32(fix, 31))); \
+        } \
+        _Pragma("GCC unroll 12") \
+        for (int i = 8; i < 20; i++) { \
+            T x = XOR(XOR(ALIGNR(V[i - 1], V[i - 2], 8), V[i - 4]), \
+                      XOR(V[i - 7], V[i - 8])); \
+            V[i] = XOR(SLLI32(x, 2), SRLI32(x, 30)); \
+        }
+
+        __attribute__((target("sse4.1")))
+        void compress_sse41(uint32_t state[5], const uint8_t* data, size_t blocks) {
+            const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+            const __m128i k[4] = {_mm_set1_epi32(K1), _mm_set1_epi32(K2),
+                                  _mm_set1_epi32(K3), _mm_set1_epi32(K4)};
+            alignas(16) uint32_t wk[80];
+            for (; blocks > 0; blocks--, data += 64) {
+                __m128i v[20];
+                for (int i = 0; i < 4; i++) {
+                    v[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i)), bswap);
+                }
+                SHA1_VEC_SCHEDULE(__m128i, _mm_xor_si128, _mm_srli_si128, _mm_slli_si128,
+                                  _mm_alignr_epi8, _mm_slli_epi32, _mm_srli_epi32, v)
+                for (int i = 0; i < 20; i++) {
+                    _mm_store_si128(reinterpret_cast<__m128i*>(wk + 4 * i), _mm_add_epi32(v[i], k[i / 5]));
+                }
+                rounds_wk(state, wk);
+            }
+        }
+
+        /* ---- AVX2: two schedules per pass ---- */
+
+        __attribute__((target("avx2")))
+        void compress_avx2(uint32_t state[5], const uint8_t* data, size_t blocks) {
+            const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                                  12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+            const __m256i k[4] = {_mm256_set1_epi32(K1), _mm256_set1_epi32(K2),
+                                  _mm256_set1_epi32(K3), _mm256_set1_epi32(K4)};
+            alignas(32) uint32_t wk[2][80];
+            for (; blocks >= 2; blocks -= 2, data += 128) {
+                __m256i v[20];
+                for (int i = 0; i < 4; i++) {
+                    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i));
+                    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 64 + 16 * i));
+                    v[i] = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), bswap);
+                }
+                SHA1_VEC_SCHEDULE(__m256i, _mm256_xor_si256, _mm256_srli_si256, _mm256_slli_si256,
+                                  _mm256_alignr_epi8, _mm256_slli_epi32, _mm256_srli_epi32, v)
+                for (int i = 0; i < 20; i++) {
+                    __m256i sum = _mm256_add_epi32(v[i], k[i / 5]);
+                    _mm_store_si128(reinterpret_cast<__m128i*>(wk[0] + 4 * i), _mm256_castsi256_si128(sum));
+                    _mm_store_si128(reinterpret_cast<__m128i*>(wk[1] + 4 * i), _mm256_extracti128_si256(sum, 1));
+                }
+                rounds_wk(state, wk[0]);
+                rounds_wk(state, wk[1]);
+            }
+            if (blocks > 0) {
+                compress_sse41(state, data, blocks);
+            }
+        }
+
+        /* ---- SHA-NI ---- */
+
+/* Four rounds.  E_CUR carries e for this group (already holding e + W for
+ * the first group); E_NEXT receives the current abcd for the next one. */
+#define SHANI_ROUNDS4(E_CUR, E_NEXT, MSG, F) \
+        E_CUR = _mm_sha1nexte_epu32(E_CUR, MSG); \
+        E_NEXT = abcd; \
+        abcd = _mm_sha1rnds4_epu32(abcd, E_CUR, F);
+
+        __attribute__((target("sha,sse4.1")))
+        void compress_shani(uint32_t state[5], const uint8_t* data, size_t blocks) {
+            const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+            __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1b);
+            __m128i e0 = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+            __m128i e1, m0, m1, m2, m3;
+            for (; blocks > 0; blocks--, data += 64) {
+                __m128i abcd_save = abcd;
+                __m128i e0_save = e0;
+                m0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), mask);
+                m1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16)), mask);
+                m2 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32)), mask);
+                m3 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48)), mask);
+
+                e0 = _mm_add_epi32(e0, m0);
+                e1 = abcd;
+                abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+                SHANI_ROUNDS4(e1, e0, m1, 0) m0 = _mm_sha1msg1_epu32(m0, m1);
+                SHANI_ROUNDS4(e0, e1, m2, 0) m1 = _mm_sha1msg1_epu32(m1, m2); m0 = _mm_xor_si128(m0, m2);
+                SHANI_ROUNDS4(e1, e0, m3, 0) m0 = _mm_sha1msg2_epu32(m0, m3); m2 = _mm_sha1msg1_epu32(m2, m3); m1 = _mm_xor_si128(m1, m3);
+                SHANI_ROUNDS4(e0, e1, m0, 0) m1 = _mm_sha1msg2_epu32(m1, m0); m3 = _mm_sha1msg1_epu32(m3, m0); m2 = _mm_xor_si128(m2, m0);
+                SHANI_ROUNDS4(e1, e0, m1, 1) m2 = _mm_sha1msg2_epu32(m2, m1); m0 = _mm_sha1msg1_epu32(m0, m1); m3 = _mm_xor_si128(m3, m1);
+                SHANI_ROUNDS4(e0, e1, m2, 1) m3 = _mm_sha1msg2_epu32(m3, m2); m1 = _mm_sha1msg1_epu32(m1, m2); m0 = _mm_xor_si128(m0, m2);
+                SHANI_ROUNDS4(e1, e0, m3, 1) m0 = _mm_sha1msg2_epu32(m0, m3); m2 = _mm_sha1msg1_epu32(m2, m3); m1 = _mm_xor_si128(m1, m3);
+                SHANI_ROUNDS4(e0, e1, m0, 1) m1 = _mm_sha1msg2_epu32(m1, m0); m3 = _mm_sha1msg1_epu32(m3, m0); m2 = _mm_xor_si128(m2, m0);
+                SHANI_ROUNDS4(e1, e0, m1, 1) m2 = _mm_sha1msg2_epu32(m2, m1); m0 = _mm_sha1msg1_epu32(m0, m1); m3 = _mm_xor_si128(m3, m1);
+                SHANI_ROUNDS4(e0, e1, m2, 2) m3 = _mm_sha1msg2_epu32(m3, m2); m1 = _mm_sha1msg1_epu32(m1, m2); m0 = _mm_xor_si128(m0, m2);
+                SHANI_ROUNDS4(e1, e0, m3, 2) m0 = _mm_sha1msg2_epu32(m0, m3); m2 = _mm_sha1msg1_epu32(m2, m3); m1 = _mm_xor_si128(m1, m3);
+                SHANI_ROUNDS4(e0, e1, m0, 2) m1 = _mm_sha1msg2_epu32(m1, m0); m3 = _mm_sha1msg1_epu32(m3, m0); m2 = _mm_xor_si128(m2, m0);
+                SHANI_ROUNDS4(e1, e0, m1, 2) m2 = _mm_sha1msg2_epu32(m2, m1); m0 = _mm_sha1msg1_epu32(m0, m1); m3 = _mm_xor_si128(m3, m1);
+                SHANI_ROUNDS4(e0, e1, m2, 2) m3 = _mm_sha1msg2_epu32(m3, m2); m1 = _mm_sha1msg1_epu32(m1, m2); m0 = _mm_xor_si128(m0, m2);
+                SHANI_ROUNDS4(e1, e0, m3, 3) m0 = _mm_sha1msg2_epu32(m0, m3); m2 = _mm_sha1msg1_epu32(m2, m3); m1 = _mm_xor_si128(m1, m3);
+                SHANI_ROUNDS4(e0, e1, m0, 3) m1 = _mm_sha1msg2_epu32(m1, m0); m3 = _mm_sha1msg1_epu32(m3, m0); m2 = _mm_xor_si128(m2, m0);
+                SHANI_ROUNDS4(e1, e0, m1, 3) m2 = _mm_sha1msg2_epu32(m2, m1); m3 = _mm_xor_si128(m3, m1);
+                SHANI_ROUNDS4(e0, e1, m2, 3) m3 = _mm_sha1msg2_epu32(m3, m2);
+                SHANI_ROUNDS4(e1, e0, m3, 3)
+
+                e0 = _mm_sha1nexte_epu32(e0, e0_save);
+                abcd = _mm_add_epi32(abcd, abcd_save);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_shuffle_epi32(abcd, 0x1b));
+            state[4] = static_cast<uint32_t>(_mm_extract_epi32(e0, 3));
+        }
+
+#undef SHANI_ROUNDS4
+#undef SHA1_VEC_SCHEDULE
+
+        struct CpuFeatures {
+            bool sse41 = false;
+            bool avx2 = false;
+            bool sha = false;
+        };
+
+        CpuFeatures detect_features() {
+            CpuFeatures f;
+            unsigned eax, ebx, ecx, edx;
+            if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+                return f;
+            }
+            bool ssse3 = (ecx & bit_SSSE3) != 0;
+            f.sse41 = ssse3 && (ecx & bit_SSE4_1) != 0;
+            bool os_ymm = false;
+            if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+                unsigned lo, hi;
+                __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+                os_ymm = (lo & 0x6) == 0x6;
+            }
+            if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+                f.avx2 = f.sse41 && os_ymm && (ebx & bit_AVX2) != 0;
+                f.sha = f.sse41 && (ebx & bit_SHA) != 0;
+            }
+            return f;
+        }
+#endif // GITLITE_SHA1_X86
+
+#undef SHA1_ROUNDS5
+#undef SHA1_ROUND
+#undef SHA1_F1
+#undef SHA1_F2
+#undef SHA1_F3
+    }
+
+    std::vector<Kernel> availableKernels() {
+        std::vector<Kernel> kernels = {{"reference", compress_reference}, {"scalar", compress_scalar}};
+#ifdef GITLITE_SHA1_X86
+        CpuFeatures f = detect_features();
+        if (f.sse41) {
+            kernels.push_back({"sse4.1", compress_sse41});
+        }
+        if (f.avx2) {
+            kernels.push_back({"avx2", compress_avx2});
+        }
+        if (f.sha) {
+            kernels.push_back({"sha-ni", compress_shani});
+        }
+#endif
+        return kernels;
+    }
+
+    Compress selectedCompress() {
+        static const Compress selected = [] {
+            std::vector<Kernel> kernels = availableKernels();
+            const char* wanted = std::getenv("GITLITE_SHA1_KERNEL");
+            if (wanted != nullptr) {
+                for (auto &k : kernels) {
+                    if (std::strcmp(k.name, wanted) == 0) {
+                        return k.compress;
+                    }
+                }
+            }
+            return kernels.back().compress;
+        }();
+        return selected;
+    }
+}
@@ -1,8 +1,21 @@
 #include "../include/Utils.h"
+#include "../include/Sha1Kernels.h"
+#include "../include/GitliteException.h"
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
 #include <cstring>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
 
 /** Assorted utilities.
  *
@@ -12,117 +25,96 @@
 
 // SHA1 implementation
 namespace SHA1 {
-    void SHA::reset() {
-        A = 0x67452301;
-        B = 0xEFCDAB89;
-        C = 0x98BADCFE;
-        D = 0x10325476;
-        E = 0xC3D2E1F0;
+    void SHA::init() {
+        state[0] = 0x67452301;
+        state[1] = 0xEFCDAB89;
+        state[2] = 0x98BADCFE;
+        state[3] = 0x10325476;
+        state[4] = 0xC3D2E1F0;
+        blockLength = 0;
+        messageLength = 0;
     }
     
-    std::string SHA::padding(std::string message) {
-        int originalLength = message.length();
-        int newLength = ((originalLength + 8) + 63) / 64 * 64;
-        std::string newMessage = message;
-        newMessage.resize(newLength, 0);
-        newMessage[originalLength] = static_cast<char>(0x80);
-        int bitLength = originalLength * 8;
-        for(int i = newLength - 1; i >= newLength - 8; i--) {
-            newMessage[i] = bitLength % 256;
-            bitLength /= 256;
-        }
-        return newMessage;
-    }
-    
-    SHA::WORD SHA::charToWord(char ch) {
-        return (BYTE)ch;
+    SHA::SHA() {
+        init();
     }
     
-    SHA::WORD SHA::shiftLeft(WORD x, int n) {
-        return (x >> (32 - n)) | (x << n);
-    }
-    
-    void SHA::getWord(std::string& message, int index) {
-        for(int i = 0; i < 16; i++) {
-            Word[i] = (charToWord(message[index + 4*i]) << 24) + 
-                     (charToWord(message[index + 4*i + 1]) << 16) + 
-                     (charToWord(message[index + 4*i + 2]) << 8) + 
-                     charToWord(message[index + 4*i + 3]);
+    void SHA::update(const void* data, size_t len) {
+        const BYTE* p = static_cast<const BYTE*>(data);
+        messageLength += len;
+        if (blockLength > 0) {
+            size_t take = std::min(len, sizeof(block) - blockLength);
+            std::memcpy(block + blockLength, p, take);
+            blockLength += take;
+            p += take;
+            len -= take;
+            if (blockLength < sizeof(block)) {
+                return;
+            }
+            selectedCompress()(state, block, 1);
+            blockLength = 0;
         }
-        for(int i = 16; i < 80; i++) {
-            Word[i] = shiftLeft(Word[i-3] ^ Word[i-8] ^ Word[i-14] ^ Word[i-16], 1);
+        size_t blocks = len / sizeof(block);
+        if (blocks > 0) {
+            selectedCompress()(state, p, blocks);
+            p += blocks * sizeof(block);
+            len -= blocks * sizeof(block);
         }
+        std::memcpy(block, p, len);
+        blockLength = len;
     }
     
-    SHA::SHA() : Word(80) {
-        reset();
+    void SHA::update(const std::string& message) {
+        update(message.data(), message.size());
     }
     
-    SHA::WORD SHA::kt(int t) {
-        if (t < 20)
-            return 0x5a827999;
-        else if (t < 40)
-            return 0x6ed9eba1;
-        else if (t < 60)
-            return 0x8f1bbcdc;
-        else
-            return 0xca62c1d6;
-    }
-    
-    SHA::WORD SHA::ft(int t, WORD B, WORD C, WORD D) {
-        if (t < 20)
-            return (B & C) | ((~B) & D);
-        else if (t < 40)
-            return B ^ C ^ D;
-        else if (t < 60)
-            return (B & C) | (B & D) | (C & D);
-        else
-            return B ^ C ^ D;
-    }
-    
-    std::string SHA::sha(std::string message) {
-        reset();
-        message = padding(message);
-        int byteLength = message.length();
-        for(int i = 0; i < byteLength; i += 64) {
-            getWord(message, i);
-            WORD a = A, b = B, c = C, d = D, e = E;
-            for(int j = 0; j < 80; j++) {
-                WORD temp = shiftLeft(a, 5) + ft(j, b, c, d) + e + kt(j) + Word[j];
-                e = d;
-                d = c;
-                c = shiftLeft(b, 30);
-                b = a;
-                a = temp;
-            }
-            A += a;
-            B += b;
-            C += c;
-            D += d;
-            E += e;
+    /** Pads the message, appends its 64-bit bit length and returns the
+     *  digest as 40 lowercase hex digits.  The hasher must be init()ed
+     *  again before reuse. */
+    std::string SHA::final() {
+        uint64_t bitLength = messageLength * 8;
+        BYTE pad[72] = {0x80};
+        size_t padLength = (blockLength < 56 ? 56 : 120) - blockLength;
+        for (int i = 0; i < 8; i++) {
+            pad[padLength + i] = static_cast<BYTE>(bitLength >> (56 - 8 * i));
+        }
+        update(pad, padLength + 8);
+        BYTE digest[20];
+        for (int i = 0; i < 5; i++) {
+            digest[4*i] = static_cast<BYTE>(state[i] >> 24);
+            digest[4*i + 1] = static_cast<BYTE>(state[i] >> 16);
+            digest[4*i + 2] = static_cast<BYTE>(state[i] >> 8);
+            digest[4*i + 3] = static_cast<BYTE>(state[i]);
         }
-        std::stringstream ss;
-        ss << std::hex;
-        ss << std::setw(8) << std::setfill('0') << A;
-        ss << std::setw(8) << std::setfill('0') << B;
-        ss << std::setw(8) << std::setfill('0') << C;
-        ss << std::setw(8) << std::setfill('0') << D;
-        ss << std::setw(8) << std::setfill('0') << E;
-        return ss.str();
+        return Utils::toHex(digest, sizeof(digest));
     }
     
-    SHA sha;
+    std::string SHA::sha(const std::string& message) {
+        init();
+        update(message);
+        return final();
+    }
     
-    std::string sha1(std::string message) {
+    std::string sha1(const std::string& message) {
+        SHA sha;
         return sha.sha(message);
     }
     
-    std::string sha1(std::string s1, std::string s2) {
-        return sha1(s1 + s2);
+    std::string sha1(const std::string& s1, const std::string& s2) {
+        SHA sha;
+        sha.update(s1);
+        sha.update(s2);
+        return sha.final();
     }
     
-    std::string sha1(std::string s1, std::string s2, std::string s3, std::string s4) {
-        return sha1(s1 + s2 + s3 + s4);
+    std::string sha1(const std::string& s1, const std::string& s2,
+                     const std::string& s3, const std::string& s4) {
+        SHA sha;
+        sha.update(s1);
+        sha.update(s2);
+        sha.update(s3);
+        sha.update(s4);
+        return sha.final();
     }
 }
 
@@ -142,25 +134,154 @@ std::string Utils::sha1(const std::string& s1, const std::string& s2,
     return SHA1::sha1(s1, s2, s3, s4);
 }
 
-/** Returns the SHA-1 hash of the concatenation of the strings in VALS. */
+/** Returns the SHA-1 hash of the bytes in DATA. */
 std::string Utils::sha1(const std::vector<unsigned char>& data) {
-    std::string str(data.begin(), data.end());
-    return SHA1::sha1(str);
+    SHA1::SHA sha;
+    sha.update(data.data(), data.size());
+    return sha.final();
+}
+
+/** Returns the lowercase hex encoding of the LEN bytes at DATA. */
+std::string Utils::toHex(const unsigned char* data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(len * 2, '0');
+    for (size_t i = 0; i < len; i++) {
+        hex[2 * i] = digits[data[i] >> 4];
+        hex[2 * i + 1] = digits[data[i] & 0xf];
+    }
+    return hex;
+}
+
+/** Decodes the even-length hex string HEX into RAW.  Returns false if HEX
+ *  contains anything other than hex digits. */
+bool Utils::fromHex(const std::string& hex, std::string& raw) {
+    if (hex.size() % 2 != 0) {
+        return false;
+    }
+    raw.assign(hex.size() / 2, '\0');
+    for (size_t i = 0; i < hex.size(); i++) {
+        char ch = hex[i];
+        int v;
+        if (ch >= '0' && ch <= '9') v = ch - '0';
+        else if (ch >= 'a' && ch <= 'f') v = ch - 'a' + 10;
+        else if (ch >= 'A' && ch <= 'F') v = ch - 'A' + 10;
+        else return false;
+        raw[i / 2] = static_cast<char>(i % 2 == 0 ? v << 4 : (raw[i / 2] | v));
+    }
+    return true;
+}
+
+/* BINARY ENCODING */
+
+void Utils::putU32(std::string& out, uint32_t v) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back(static_cast<char>(v >> shift));
+    }
+}
+
+void Utils::putU64(std::string& out, uint64_t v) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        out.push_back(static_cast<char>(v >> shift));
+    }
+}
+
+/** Appends S prefixed by its 32-bit length. */
+void Utils::putString(std::string& out, const std::string& s) {
+    putU32(out, static_cast<uint32_t>(s.size()));
+    out += s;
+}
+
+uint32_t Utils::getU32(const unsigned char* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+uint64_t Utils::getU64(const unsigned char* p) {
+    return (uint64_t(getU32(p)) << 32) | getU32(p + 4);
+}
+
+ByteReader::ByteReader(const unsigned char* data, size_t len) : pos(data), end(data + len) {}
+
+ByteReader::ByteReader(const std::string& data)
+    : ByteReader(reinterpret_cast<const unsigned char*>(data.data()), data.size()) {}
+
+const unsigned char* ByteReader::take(size_t n) {
+    if (static_cast<size_t>(end - pos) < n) {
+        throw std::runtime_error("truncated data");
+    }
+    const unsigned char* p = pos;
+    pos += n;
+    return p;
+}
+
+uint8_t ByteReader::u8() {
+    return *take(1);
+}
+
+uint32_t ByteReader::u32() {
+    return Utils::getU32(take(4));
+}
+
+uint64_t ByteReader::u64() {
+    return Utils::getU64(take(8));
+}
+
+std::string ByteReader::bytes(size_t n) {
+    return std::string(reinterpret_cast<const char*>(take(n)), n);
+}
+
+std::string ByteReader::str() {
+    return bytes(u32());
+}
+
+size_t ByteReader::remaining() const {
+    return static_cast<size_t>(end - pos);
+}
+
+MappedFile::MappedFile(const std::string& path) : addr(MAP_FAILED), length(0) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        length = static_cast<size_t>(st.st_size);
+        addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (addr == MAP_FAILED) {
+        length = 0;
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (addr != MAP_FAILED) {
+        munmap(addr, length);
+    }
+}
+
+const unsigned char* MappedFile::data() const {
+    return addr == MAP_FAILED ? nullptr : static_cast<const unsigned char*>(addr);
+}
+
+size_t MappedFile::size() const {
+    return length;
 }
 
 /* FILE DELETION */
 /** Deletes FILE if it exists and is not a directory.  Returns true
 *  if FILE was deleted, and false otherwise.  Refuses to delete FILE
 *  and throws IllegalArgumentException unless the directory designated by
-*  FILE also contains a directory named .gitlite. */
+*  FILE, or one of its parents, also contains a directory named .gitlite. */
 bool Utils::restrictedDelete(const std::string& filepath) {
-    // Extract parent directory
+    // Walk up from the parent directory to the working tree root
     size_t pos = filepath.find_last_of("/\\");
     std::string parentDir = (pos == std::string::npos) ? "." : filepath.substr(0, pos);
-    std::string gitliteDir = parentDir + "/.gitlite";
-
-    if (!isDirectory(gitliteDir)) {
-        throw std::invalid_argument("not .gitlite working directory");
+    while (!isDirectory(parentDir + "/.gitlite")) {
+        pos = parentDir.find_last_of("/\\");
+        if (parentDir == "." || parentDir.empty()) {
+            throw std::invalid_argument("not .gitlite working directory");
+        }
+        parentDir = (pos == std::string::npos) ? "." : parentDir.substr(0, pos);
     }
     
     if (isFile(filepath)) {
@@ -260,6 +381,99 @@ std::vector<std::string> Utils::plainFilenamesIn(const std::string& dirPath) {
     return files;
 }
 
+/** Returns a list of the names of all subdirectories of DIR other than
+ *  "." and "..", in order.  Returns an empty list if DIR does not denote
+ *  a directory. */
+std::vector<std::string> Utils::subdirectoriesIn(const std::string& dirPath) {
+    std::vector<std::string> dirs;
+
+    DIR* dir = opendir(dirPath.c_str());
+    if (dir == nullptr) {
+        return dirs;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0
+                && strcmp(entry->d_name, "..") != 0) {
+            dirs.push_back(std::string(entry->d_name));
+        }
+    }
+
+    closedir(dir);
+    std::sort(dirs.begin(), dirs.end());
+    return dirs;
+}
+
+/** Returns the paths, relative to DIR, of all regular files below DIR in
+ *  sorted order.  The .gitlite directory and any nested directory that
+ *  holds its own .gitlite repository are skipped.  The tree is walked one
+ *  level at a time, listing the directories of a level in parallel. */
+std::vector<std::string> Utils::filesUnder(const std::string& dirPath) {
+    std::vector<std::string> files;
+    std::vector<std::string> level = {""};
+    while (!level.empty()) {
+        std::vector<std::vector<std::string>> levelFiles(level.size());
+        std::vector<std::vector<std::string>> levelDirs(level.size());
+        parallelFor(level.size(), [&](size_t i) {
+            const std::string& rel = level[i];
+            std::string abs = rel.empty() ? dirPath : join(dirPath, rel);
+            if (!rel.empty() && isDirectory(join(abs, ".gitlite"))) {
+                return;
+            }
+            DIR* dir = opendir(abs.c_str());
+            if (dir == nullptr) {
+                return;
+            }
+            struct dirent* entry;
+            while ((entry = readdir(dir)) != nullptr) {
+                std::string name = entry->d_name;
+                if (name == "." || name == ".." || name == ".gitlite") {
+                    continue;
+                }
+                std::string child = rel.empty() ? name : join(rel, name);
+                unsigned char type = entry->d_type;
+                if (type == DT_UNKNOWN) {
+                    std::string path = join(abs, name);
+                    type = isDirectory(path) ? DT_DIR : (isFile(path) ? DT_REG : DT_UNKNOWN);
+                }
+                if (type == DT_DIR) {
+                    levelDirs[i].push_back(child);
+                } else if (type == DT_REG) {
+                    levelFiles[i].push_back(child);
+                }
+            }
+            closedir(dir);
+        });
+        level.clear();
+        for (size_t i = 0; i < levelDirs.size(); i++) {
+            files.insert(files.end(), levelFiles[i].begin(), levelFiles[i].end());
+            level.insert(level.end(), levelDirs[i].begin(), levelDirs[i].end());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+/** Returns PATH without leading "./" components, repeated or trailing
+ *  slashes, so that the same file is always tracked under one name. */
+std::string Utils::normalizePath(const std::string& path) {
+    std::string result;
+    size_t i = 0;
+    while (i < path.size()) {
+        size_t next = path.find('/', i);
+        if (next == std::string::npos) {
+            next = path.size();
+        }
+        std::string part = path.substr(i, next - i);
+        if (!part.empty() && part != ".") {
+            result = result.empty() ? part : result + "/" + part;
+        }
+        i = next + 1;
+    }
+    return result.empty() ? "." : result;
+}
+
 /* OTHER FILE UTILITIES */
 
 /** Return the concatenation of FIRST and SECOND into a File path,
@@ -289,9 +503,11 @@ void Utils::message(const std::string& msg) {
     std::cout << msg << std::endl;
 }
 
+/** Ends the current command with the message MSG.  It is thrown as a
+ *  GitliteException and printed by main, so that held locks are released
+ *  on the way out and a batch session can go on with its next command. */
 void Utils::exitWithMessage(const std::string& msg) {
-    message(msg);
-    std::exit(0);
+    throw GitliteException(msg);
 }
 
 /** Returns true if PATH exists as a file or directory. */
@@ -318,6 +534,329 @@ bool Utils::isDirectory(const std::string& path) {
     return S_ISDIR(buffer.st_mode);
 }
 
+/** Fills ST with the stat fields of PATH.  Returns false if PATH does not
+ *  exist or is not a regular file. */
+static void toFileStat(const struct stat& buffer, FileStat& st) {
+    st.mtimeNs = int64_t(buffer.st_mtim.tv_sec) * 1000000000 + buffer.st_mtim.tv_nsec;
+    st.ctimeNs = int64_t(buffer.st_ctim.tv_sec) * 1000000000 + buffer.st_ctim.tv_nsec;
+    st.size = static_cast<uint64_t>(buffer.st_size);
+    st.inode = static_cast<uint64_t>(buffer.st_ino);
+}
+
+bool Utils::statFile(const std::string& path, FileStat& st) {
+    struct stat buffer;
+    if (stat(path.c_str(), &buffer) != 0 || !S_ISREG(buffer.st_mode)) {
+        return false;
+    }
+    toFileStat(buffer, st);
+    return true;
+}
+
+/** Writes CONTENT to FILEPATH, whose directory must already exist, and
+ *  stores the stat data of the written file in ST.  Unlike writeContents
+ *  this does not look at parent directories, which matters when many
+ *  files are written at once. */
+void Utils::writeFile(const std::string& filepath, const std::string& content, FileStat& st) {
+    writeFile(filepath, [&](const ByteSink& sink) {
+        sink(content.data(), content.size());
+    }, st);
+}
+
+/** Like writeFile above, but the content is whatever PRODUCE passes to
+ *  the sink it is given, so it never has to be in memory at once. */
+void Utils::writeFile(const std::string& filepath,
+                      const std::function<void(const ByteSink&)>& produce, FileStat& st) {
+    int fd = open(filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::invalid_argument("cannot create file");
+    }
+    try {
+        produce([&](const char* p, size_t left) {
+            while (left > 0) {
+                ssize_t n = write(fd, p, left);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error("cannot write " + filepath);
+                }
+                p += n;
+                left -= static_cast<size_t>(n);
+            }
+        });
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    struct stat buffer;
+    if (fstat(fd, &buffer) == 0) {
+        toFileStat(buffer, st);
+    }
+    close(fd);
+}
+
+/* CRASH-SAFE WRITES */
+
+namespace {
+    std::mutex deferredLock;
+    std::set<std::string> deferredDirs; // directories with unsynced writes
+
+    void syncDirectoryOf(const std::string& path) {
+        size_t slash = path.find_last_of('/');
+        std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+        int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+
+    bool writeAll(int fd, const char* p, size_t left) {
+        while (left > 0) {
+            ssize_t n = write(fd, p, left);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            p += n;
+            left -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    /** Leaves the sync of the new directory entry PATH to syncDeferred(). */
+    void deferSyncOf(const std::string& path) {
+        std::lock_guard<std::mutex> guard(deferredLock);
+        size_t slash = path.find_last_of('/');
+        deferredDirs.insert(slash == std::string::npos ? "." : path.substr(0, slash));
+    }
+}
+
+Durability Utils::durability() {
+    static const Durability level = [] {
+        const char* env = std::getenv("GITLITE_FSYNC");
+        if (env != nullptr && std::strcmp(env, "none") == 0) {
+            return Durability::None;
+        }
+        if (env != nullptr && std::strcmp(env, "full") == 0) {
+            return Durability::Full;
+        }
+        return Durability::Batch;
+    }();
+    return level;
+}
+
+/** Closes FD, the complete temporary file TMP, and renames it over TARGET,
+ *  syncing it first as durability() asks.  With DEFERSYNC the sync may be
+ *  left to syncDeferred(); otherwise deferred writes are synced before
+ *  TARGET is replaced, so nothing it refers to can be lost in a crash. */
+void Utils::installFile(int fd, const std::string& tmp, const std::string& target,
+                        bool deferSync) {
+    Durability level = durability();
+    bool sync = level == Durability::Full || (level == Durability::Batch && !deferSync);
+    if (level == Durability::Batch && !deferSync) {
+        syncDeferred();
+    }
+    if (sync && fsync(fd) != 0) {
+        close(fd);
+        std::remove(tmp.c_str());
+        throw std::runtime_error("cannot sync " + target);
+    }
+    close(fd);
+    if (std::rename(tmp.c_str(), target.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("cannot write " + target);
+    }
+    if (sync) {
+        syncDirectoryOf(target);
+    } else if (level == Durability::Batch) {
+        deferSyncOf(target);
+    }
+}
+
+/** Flushes every write whose sync installFile deferred: one syncfs per
+ *  file system holding such writes instead of one fsync per file, then
+ *  an fsync of each directory that gained entries. */
+void Utils::syncDeferred() {
+    std::lock_guard<std::mutex> guard(deferredLock);
+    std::set<dev_t> synced;
+    for (auto &dir : deferredDirs) {
+        int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            continue; // removed since; nothing left in it to sync
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || synced.insert(st.st_dev).second) {
+#ifdef __linux__
+            if (syncfs(fd) != 0) {
+                sync();
+            }
+#else
+            sync();
+#endif
+        }
+        fsync(fd);
+        close(fd);
+    }
+    deferredDirs.clear();
+}
+
+/** Appends CONTENT to FILEPATH, creating it if needed, with one write
+ *  synced as durability() asks; like a ref update, deferred writes are
+ *  synced first.  A crash can still leave part of CONTENT behind, so
+ *  readers of appended files must ignore a torn last record. */
+void Utils::appendFile(const std::string& filepath, const std::string& content) {
+    int fd = open(filepath.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("cannot write " + filepath);
+    }
+    Durability level = durability();
+    if (level == Durability::Batch) {
+        syncDeferred();
+    }
+    if (!writeAll(fd, content.data(), content.size())
+        || (level != Durability::None && fsync(fd) != 0)) {
+        close(fd);
+        throw std::runtime_error("cannot write " + filepath);
+    }
+    close(fd);
+}
+
+/** Replaces FILEPATH with CONTENT so that a crash leaves either the old or
+ *  the new file, never a torn one: the content goes to a temporary file
+ *  in the same directory, which is synced and renamed into place. */
+void Utils::writeAtomic(const std::string& filepath, const std::string& content,
+                        bool deferSync) {
+    size_t slash = filepath.find_last_of('/');
+    if (slash != std::string::npos) {
+        createDirectories(filepath.substr(0, slash));
+    }
+    std::string tmp = filepath + ".tmp-XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) {
+        throw std::runtime_error("cannot write " + filepath);
+    }
+    if (!writeAll(fd, content.data(), content.size())) {
+        close(fd);
+        std::remove(tmp.c_str());
+        throw std::runtime_error("cannot write " + filepath);
+    }
+    fchmod(fd, 0644);
+    installFile(fd, tmp, filepath, deferSync);
+}
+
+/** Gives TO the content of FROM, a file that is never modified in place.
+ *  A hard link is made when both are on one file system; otherwise the
+ *  bytes go through copy_file_range, which reflinks where the file system
+ *  can, into a temporary file installed as by writeAtomic.  An existing
+ *  TO is kept.  Returns false if FROM cannot be opened. */
+bool Utils::copyFile(const std::string& from, const std::string& to, bool deferSync) {
+    size_t slash = to.find_last_of('/');
+    if (slash != std::string::npos) {
+        createDirectories(to.substr(0, slash));
+    }
+    if (link(from.c_str(), to.c_str()) == 0) {
+        Durability level = durability();
+        if (level == Durability::Full || (level == Durability::Batch && !deferSync)) {
+            syncDirectoryOf(to);
+        } else if (level == Durability::Batch) {
+            deferSyncOf(to);
+        }
+        return true;
+    }
+    if (errno == EEXIST) {
+        return true;
+    }
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+    std::string tmp = to + ".tmp-XXXXXX";
+    int out = mkstemp(&tmp[0]);
+    if (out < 0) {
+        close(in);
+        throw std::runtime_error("cannot write " + to);
+    }
+    bool copied = false;
+#ifdef __linux__
+    for (;;) {
+        ssize_t n = copy_file_range(in, nullptr, out, nullptr, CHUNK_SIZE * 16, 0);
+        if (n > 0 || (n < 0 && errno == EINTR)) {
+            continue;
+        }
+        copied = n == 0;
+        break;
+    }
+    if (!copied && (lseek(in, 0, SEEK_SET) != 0 || lseek(out, 0, SEEK_SET) != 0 || ftruncate(out, 0) != 0)) {
+        close(in);
+        close(out);
+        std::remove(tmp.c_str());
+        throw std::runtime_error("cannot copy " + from);
+    }
+#endif
+    if (!copied) {
+        // copy_file_range is unsupported here: plain reads and writes
+        std::vector<char> buffer(CHUNK_SIZE);
+        for (;;) {
+            ssize_t n = read(in, buffer.data(), buffer.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                copied = n == 0;
+                break;
+            }
+            if (!writeAll(out, buffer.data(), static_cast<size_t>(n))) {
+                break;
+            }
+        }
+    }
+    close(in);
+    if (!copied) {
+        close(out);
+        std::remove(tmp.c_str());
+        throw std::runtime_error("cannot copy " + from);
+    }
+    fchmod(out, 0644);
+    installFile(out, tmp, to, deferSync);
+    return true;
+}
+
+/** Passes the content of FILEPATH to SINK in chunks of CHUNK_SIZE. */
+void Utils::readChunks(const std::string& filepath, const ByteSink& sink) {
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::invalid_argument("must be a normal file");
+    }
+    std::vector<char> buffer(CHUNK_SIZE);
+    try {
+        for (;;) {
+            ssize_t n = read(fd, buffer.data(), buffer.size());
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("cannot read " + filepath);
+            }
+            if (n == 0) {
+                break;
+            }
+            sink(buffer.data(), static_cast<size_t>(n));
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+bool FileStat::operator==(const FileStat& other) const {
+    return mtimeNs == other.mtimeNs && ctimeNs == other.ctimeNs
+        && size == other.size && inode == other.inode;
+}
+
 /** Recursively creates all directories in PATH if they don't exist.
  *  Returns true if all directories were created or already exist,
  *  false otherwise. */
@@ -334,4 +873,57 @@ bool Utils::createDirectories(const std::string& path) {
     }
     
     return mkdir(path.c_str(), 0755) == 0 || isDirectory(path);
-}
\ No newline at end of file
+}
+
+/* PARALLEL EXECUTION */
+
+/** Number of worker threads to use: GITLITE_THREADS if set, otherwise
+ *  the number of hardware threads. */
+size_t Utils::workerCount() {
+    const char* env = std::getenv("GITLITE_THREADS");
+    if (env != nullptr && std::atoi(env) > 0) {
+        return static_cast<size_t>(std::atoi(env));
+    }
+    unsigned hw = std::thread::hardware_concurrency();
+    return hw == 0 ? 1 : hw;
+}
+
+/** Calls BODY(i) for every i in [0, N) on a pool of up to workerCount()
+ *  threads that pull indices from a shared counter.  Returns once all
+ *  calls finished; the first exception thrown by BODY is rethrown. */
+void Utils::parallelFor(size_t n, const std::function<void(size_t)>& body) {
+    size_t threads = std::min(workerCount(), n);
+    if (threads <= 1) {
+        for (size_t i = 0; i < n; i++) {
+            body(i);
+        }
+        return;
+    }
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex errorLock;
+    auto worker = [&]() {
+        for (size_t i = next++; i < n; i = next++) {
+            try {
+                body(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(errorLock);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                next = n;
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &th : pool) {
+        th.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,489 @@
+import sys, os, random, time
+from getopt import getopt, GetoptError
+from os.path import abspath, dirname, join
+from shutil import rmtree
+from subprocess import run, DEVNULL, PIPE
+from tempfile import mkdtemp
+
+USAGE = """\
+Usage: python3 bench.py [--progdir=DIR] [--files=N] [--kb=K] [--codecs=LIST] BENCHMARK ...
+
+   Runs the named benchmarks against DIR/gitlite (default ../build) in a
+   scratch directory and prints one line per measurement.
+
+   OPTIONS may include
+       --progdir=DIR  Directory containing the gitlite executable.
+       --files=N      Number of files in the synthetic working tree
+                      (default 2000; 100000 for materialize; 4 for dedup;
+                      200 for durability and batch; 20 for merge3;
+                      10000 per branch for merge; 10000 for remote;
+                      20000 for bundle).
+       --kb=K         Approximate size of each file in KiB (default 16;
+                      16384 for dedup; 1024 for merge3).
+       --codecs=LIST  Comma-separated codecs for the compression benchmark
+                      (default none,zlib; add zstd when built with it).
+
+   BENCHMARKS:
+       compression    Repository size and add/checkout time with object
+                      compression off (GITLITE_COMPRESSION=none) and on.
+       materialize    Files per second written by a full checkout of a
+                      synthetic commit, for 1, 2, 4 and 8 threads
+                      (GITLITE_THREADS).
+       dedup          Logical bytes committed over bytes stored for a
+                      history of binary assets edited in place, with
+                      chunking off (GITLITE_CHUNK_THRESHOLD=0) and on,
+                      plus the write I/O of each commit.
+       durability     Latency of add and commit of a few changed files
+                      with GITLITE_FSYNC=none, batch and full.
+       batch          Per-command latency of status, log and branch
+                      lookups run as separate processes and as one
+                      `gitlite batch` session.
+       merge3         Time to merge two branches that edit different
+                      lines of the same large source files, and how many
+                      of those files are left with conflicts.
+       merge          Files per second merged when two branches each
+                      change N files of a tree of 1.5 N, half of them
+                      on both sides at different lines.
+       remote         Time to fetch a repository of N files into an empty
+                      one, then to fetch and push one new commit, with
+                      the source loose and packed.
+       diff           Time to diff two commits and a commit against the
+                      working tree when a few files of many changed.
+       bundle         Objects per second of a fetch into an empty
+                      repository of a history of N files rewritten in
+                      five commits (about 5 N objects), copied as loose
+                      objects (GITLITE_UNPACK_LIMIT set past the object
+                      count) and as a pack, plus the time and size of
+                      `bundle create` and `bundle unbundle` of it; all
+                      with the source loose and packed.
+"""
+
+DEFAULT_SIZE = 16 * 1024
+
+WORDS = ("gitlite blob commit tree branch merge index object stage head "
+         "remote status checkout reset log find rm add init").split()
+
+def gitlite(*args, env=None):
+    run([GITLITE] + list(args), stdout=DEVNULL, check=True, env=env)
+
+def timed(*args, env=None):
+    start = time.perf_counter()
+    gitlite(*args, env=env)
+    return time.perf_counter() - start
+
+def text(rng, size):
+    """Source-like text of about SIZE bytes."""
+    lines = []
+    total = 0
+    while total < size:
+        line = " ".join(rng.choice(WORDS) for _ in range(rng.randint(3, 12)))
+        lines.append(line)
+        total += len(line) + 1
+    return "\n".join(lines) + "\n"
+
+def make_tree(rng, files, size, prefix=""):
+    for i in range(files):
+        d = "d%02d" % (i % 32)
+        os.makedirs(d, exist_ok=True)
+        with open(join(d, "f%05d.txt" % i), "w") as f:
+            f.write(prefix + text(rng, size))
+
+def du(path):
+    total = 0
+    for root, _, names in os.walk(path):
+        for name in names:
+            total += os.lstat(join(root, name)).st_size
+    return total
+
+def report(name, value, unit):
+    print("%-40s %12.3f %s" % (name, value, unit))
+
+def make_small_tree(files):
+    for i in range(files):
+        d = join("d%03d" % (i % 1000 // 100), "e%03d" % (i % 100))
+        os.makedirs(d, exist_ok=True)
+        with open(join(d, "f%06d.txt" % i), "w") as f:
+            f.write("file %d\n" % i)
+
+def bench_materialize(files, size):
+    files = files or 100000
+    scratch = mkdtemp(prefix="gitlite-bench-")
+    try:
+        os.chdir(scratch)
+        gitlite("init")
+        gitlite("branch", "empty")
+        make_small_tree(files)
+        gitlite("add", ".")
+        gitlite("commit", "files")
+        for threads in (1, 2, 4, 8):
+            env = dict(os.environ, GITLITE_THREADS=str(threads))
+            gitlite("checkout", "empty", env=env)
+            t = timed("checkout", "master", env=env)
+            report("materialize threads=%d" % threads, files / t, "files/s")
+    finally:
+        os.chdir(START)
+        rmtree(scratch)
+
+def bench_compression(files, size):
+    files = files or 2000
+    for codec in CODECS:
+        env = dict(os.environ, GITLITE_COMPRESSION=codec)
+        scratch = mkdtemp(prefix="gitlite-bench-")
+        try:
+            os.chdir(scratch)
+            rng = random.Random(1)
+            gitlite("init", env=env)
+            make_tree(rng, files, size)
+            work = du(".") - du(".gitlite")
+            t_add = timed("add", ".", env=env)
+            gitlite("commit", "first", env=env)
+            store = du(join(".gitlite", "objects"))
+            gitlite("branch", "other", env=env)
+            make_tree(rng, files, size, prefix="v2\n")
+            gitlite("add", ".", env=env)
+            gitlite("commit", "second", env=env)
+            t_checkout = timed("checkout", "other", env=env)
+            report("compression=%s add" % codec, work / 2**20 / t_add, "MiB/s")
+            report("compression=%s checkout" % codec,
+                   work / 2**20 / t_checkout, "MiB/s")
+            report("compression=%s objects/worktree" % codec, store / work, "x")
+        finally:
+            os.chdir(START)
+            rmtree(scratch)
+
+def edit_asset(rng, data):
+    """Applies a few small overwrites, insertions and deletions."""
+    for _ in range(rng.randint(1, 4)):
+        at = rng.randrange(len(data))
+        kind = rng.choice(("overwrite", "insert", "delete"))
+        patch = rng.randbytes(rng.randint(1, 4096))
+        if kind == "overwrite":
+            data[at:at + len(patch)] = patch
+        elif kind == "insert":
+            data[at:at] = patch
+        else:
+            del data[at:at + len(patch)]
+
+def bench_dedup(files, size):
+    files = files or 4
+    size = size if size != DEFAULT_SIZE else 16 * 2**20
+    versions = 8
+    for threshold in ("0", str(4 * 2**20)):
+        env = dict(os.environ, GITLITE_CHUNK_THRESHOLD=threshold)
+        label = "chunking=%s" % ("off" if threshold == "0" else "on")
+        scratch = mkdtemp(prefix="gitlite-bench-")
+        try:
+            os.chdir(scratch)
+            rng = random.Random(1)
+            gitlite("init", env=env)
+            assets = [bytearray(rng.randbytes(size)) for _ in range(files)]
+            logical = 0
+            written = 0
+            for v in range(versions):
+                for i, data in enumerate(assets):
+                    if v > 0:
+                        edit_asset(rng, data)
+                    # the same asset is also kept under a second name
+                    for name in ("asset%02d.bin" % i, "copy%02d.bin" % i):
+                        with open(name, "wb") as f:
+                            f.write(data)
+                        logical += len(data)
+                before = du(join(".gitlite", "objects"))
+                gitlite("add", ".", env=env)
+                gitlite("commit", "version %d" % v, env=env)
+                written += du(join(".gitlite", "objects")) - before
+            store = du(join(".gitlite", "objects"))
+            report("%s dedup ratio" % label, logical / store, "x")
+            report("%s written per version" % label,
+                   written / versions / 2**20, "MiB")
+        finally:
+            os.chdir(START)
+            rmtree(scratch)
+
+def bench_durability(files, size):
+    files = files or 200
+    size = size if size != DEFAULT_SIZE else 4 * 1024
+    commits = 20
+    for level in ("none", "batch", "full"):
+        env = dict(os.environ, GITLITE_FSYNC=level)
+        scratch = mkdtemp(prefix="gitlite-bench-")
+        try:
+            os.chdir(scratch)
+            rng = random.Random(1)
+            gitlite("init", env=env)
+            make_tree(rng, files, size)
+            gitlite("add", ".", env=env)
+            gitlite("commit", "first", env=env)
+            t_add = t_commit = 0
+            for n in range(commits):
+                for i in rng.sample(range(files), 5):
+                    with open(join("d%02d" % (i % 32), "f%05d.txt" % i), "a") as f:
+                        f.write("edit %d\n" % n)
+                t_add += timed("add", ".", env=env)
+                t_commit += timed("commit", "edit %d" % n, env=env)
+            report("fsync=%s add" % level, t_add / commits * 1000, "ms")
+            report("fsync=%s commit" % level, t_commit / commits * 1000, "ms")
+        finally:
+            os.chdir(START)
+            rmtree(scratch)
+
+def bench_batch(files, size):
+    files = files or 200
+    rounds = 200
+    scratch = mkdtemp(prefix="gitlite-bench-")
+    try:
+        os.chdir(scratch)
+        rng = random.Random(1)
+        gitlite("init")
+        make_tree(rng, files, 1024)
+        gitlite("add", ".")
+        gitlite("commit", "first")
+        commands = [["status"], ["log"], ["find", "first"]]
+        for command in commands:
+            start = time.perf_counter()
+            for _ in range(rounds):
+                gitlite(*command)
+            report("process %s" % command[0],
+                   (time.perf_counter() - start) / rounds * 1e6, "us")
+        for command in commands:
+            script = (" ".join(command) + "\n") * rounds
+            start = time.perf_counter()
+            run([GITLITE, "batch"], input=script.encode(), stdout=PIPE, check=True)
+            report("batch %s" % command[0],
+                   (time.perf_counter() - start) / rounds * 1e6, "us")
+    finally:
+        os.chdir(START)
+        rmtree(scratch)
+
+def edit_lines(rng, path, lo, hi, tag):
+    """Rewrites a few lines between fractions LO and HI of the file."""
+    with open(path) as f:
+        lines = f.read().split("\n")
+    for _ in range(8):
+        at = rng.randrange(int(len(lines) * lo), int(len(lines) * hi))
+        lines[at] = "%s %d %s" % (tag, at, lines[at])
+    with open(path, "w") as f:
+        f.write("\n".join(lines))
+
+def bench_merge3(files, size):
+    files = files or 20
+    size = size if size != DEFAULT_SIZE else 1024 * 1024
+    scratch = mkdtemp(prefix="gitlite-bench-")
+    try:
+        os.chdir(scratch)
+        rng = random.Random(1)
+        gitlite("init")
+        make_tree(rng, files, size)
+        gitlite("add", ".")
+        gitlite("commit", "base")
+        gitlite("branch", "other")
+        paths = [join("d%02d" % (i % 32), "f%05d.txt" % i) for i in range(files)]
+        for path in paths:
+            edit_lines(rng, path, 0, 0.45, "ours")
+        gitlite("add", ".")
+        gitlite("commit", "ours")
+        gitlite("checkout", "other")
+        for path in paths:
+            edit_lines(rng, path, 0.55, 1, "theirs")
+        gitlite("add", ".")
+        gitlite("commit", "theirs")
+        gitlite("checkout", "master")
+        t = timed("merge", "other")
+        conflicted = 0
+        for path in paths:
+            with open(path) as f:
+                conflicted += "<<<<<<< HEAD\n" in f.read()
+        report("merge3 merge", files * size / 2**20 / t, "MiB/s")
+        report("merge3 conflicted files", conflicted, "files")
+    finally:
+        os.chdir(START)
+        rmtree(scratch)
+
+def bench_merge(files, size):
+    files = files or 10000
+    total = files * 3 // 2
+    scratch = mkdtemp(prefix="gitlite-bench-")
+    try:
+        os.chdir(scratch)
+        gitlite("init")
+        make_small_tree(total)
+        gitlite("add", ".")
+        gitlite("commit", "base")
+        gitlite("branch", "other")
+        paths = []
+        for root, _, names in os.walk("."):
+            if ".gitlite" not in root:
+                paths.extend(join(root, name) for name in names)
+        paths.sort()
+        for branch, touched, edit in (("master", paths[:files], "ours\n%s"),
+                                      ("other", paths[-files:], "%stheirs\n")):
+            gitlite("checkout", branch)
+            for path in touched:
+                with open(path) as f:
+                    content = f.read()
+                with open(path, "w") as f:
+                    f.write(edit % content)
+            gitlite("add", ".")
+            gitlite("commit", "edit " + branch)
+        gitlite("checkout", "master")
+        t = timed("merge", "other")
+        report("merge %d+%d files" % (files, files), 2 * files / t, "files/s")
+    finally:
+        os.chdir(START)
+        rmtree(scratch)
+
+def bench_remote(files, size):
+    files = files or 10000
+    for packed in (False, True):
+        label = "packed" if packed else "loose"
+        scratch = mkdtemp(prefix="gitlite-bench-")
+        try:
+            os.chdir(scratch)
+            os.mkdir("a")
+            os.mkdir("b")
+            os.chdir("a")
+            gitlite("init")
+            make_small_tree(files)
+            gitlite("add", ".")
+            gitlite("commit", "files")
+            if packed:
+                gitlite("gc")
+            os.chdir(join(scratch, "b"))
+            gitlite("init")
+            gitlite("add-remote", "origin", join(scratch, "a", ".gitlite"))
+            t_clone = timed("fetch", "origin", "master")
+            os.chdir(join(scratch, "a"))
+            with open("new.txt", "w") as f:
+                f.write("new\n")
+            gitlite("add", "new.txt")
+            gitlite("commit", "one more")
+            os.chdir(join(scratch, "b"))
+            t_fetch = timed("fetch", "origin", "master")
+            gitlite("checkout", "origin/master")
+            gitlite("branch", "work")
+            gitlite("checkout", "work")
+            with open("mine.txt", "w") as f:
+                f.write("mine\n")
+            gitlite("add", "mine.txt")
+            gitlite("commit", "mine")
+            t_push = timed("push", "origin", "master")
+            report("remote %s initial fetch" % label, files / t_clone, "files/s")
+            report("remote %s fetch one commit" % label, t_fetch * 1000, "ms")
+            report("remote %s push one commit" % label, t_push * 1000, "ms")
+        finally:
+            os.chdir(START)
+            rmtree(scratch)
+
+def bench_diff(files, size):
+    files = files or 2000
+    scratch = mkdtemp(prefix="gitlite-bench-")
+    try:
+        os.chdir(scratch)
+        rng = random.Random(1)
+        gitlite("init")
+        make_tree(rng, files, size)
+        gitlite("add", ".")
+        gitlite("commit", "first")
+        paths = [join("d%02d" % (i % 32), "f%05d.txt" % i) for i in range(files)]
+        for path in rng.sample(paths, 20):
+            edit_lines(rng, path, 0, 1, "edit")
+        t_worktree = timed("diff")
+        gitlite("add", ".")
+        gitlite("commit", "second")
+        log = run([GITLITE, "log"], stdout=PIPE, check=True).stdout.decode()
+        ids = [line.split()[1] for line in log.splitlines() if line.startswith("commit ")]
+        t_commits = timed("diff", ids[1], ids[0])
+        report("diff worktree", t_worktree * 1000, "ms")
+        report("diff commits", t_commits * 1000, "ms")
+    finally:
+        os.chdir(START)
+        rmtree(scratch)
+
+def bench_bundle(files, size):
+    files = files or 20000
+    scratch = mkdtemp(prefix="gitlite-bench-")
+    try:
+        os.chdir(scratch)
+        os.mkdir("a")
+        os.chdir("a")
+        gitlite("init")
+        for rev in range(5):
+            make_small_tree(files)
+            if rev > 0:
+                for root, _, names in os.walk("."):
+                    if not root.startswith("./.gitlite"):
+                        for name in names:
+                            with open(join(root, name), "a") as f:
+                                f.write("rev %d\n" % rev)
+            gitlite("add", ".")
+            gitlite("commit", "rev %d" % rev)
+        objects = sum(len(names) for _, _, names in os.walk(".gitlite/objects"))
+        remote = join(scratch, "a", ".gitlite")
+        for source in ("loose", "packed"):
+            if source == "packed":
+                os.chdir(join(scratch, "a"))
+                gitlite("gc")
+            for transfer, limit in (("loose", str(objects + 1)), ("packed", None)):
+                target = join(scratch, "%s-%s" % (source, transfer))
+                os.mkdir(target)
+                os.chdir(target)
+                gitlite("init")
+                gitlite("add-remote", "origin", remote)
+                env = dict(os.environ)
+                if limit is not None:
+                    env["GITLITE_UNPACK_LIMIT"] = limit
+                t = timed("fetch", "origin", "master", env=env)
+                report("bundle %s source, fetch %s" % (source, transfer), objects / t, "objects/s")
+            os.chdir(join(scratch, "a"))
+            bundle = join(scratch, "%s.bundle" % source)
+            t_create = timed("bundle", "create", bundle)
+            target = join(scratch, "%s-unbundled" % source)
+            os.mkdir(target)
+            os.chdir(target)
+            gitlite("init")
+            t_unbundle = timed("bundle", "unbundle", bundle)
+            report("bundle %s source, create" % source, t_create * 1000, "ms")
+            report("bundle %s source, unbundle" % source, t_unbundle * 1000, "ms")
+            report("bundle %s source, size" % source, os.path.getsize(bundle) / 1024.0, "KiB")
+    finally:
+        os.chdir(START)
+        rmtree(scratch)
+
+BENCHMARKS = {
+    "compression": bench_compression,
+    "materialize": bench_materialize,
+    "dedup": bench_dedup,
+    "durability": bench_durability,
+    "batch": bench_batch,
+    "merge3": bench_merge3,
+    "merge": bench_merge,
+    "remote": bench_remote,
+    "diff": bench_diff,
+    "bundle": bench_bundle,
+}
+
+if __name__ == "__main__":
+    try:
+        opts, args = getopt(sys.argv[1:], "", ["progdir=", "files=", "kb=", "codecs="])
+    except GetoptError:
+        print(USAGE, file=sys.stderr)
+        sys.exit(1)
+    progdir = join(dirname(abspath(sys.argv[0])), "..", "build")
+    files, size = None, DEFAULT_SIZE
+    CODECS = ["none", "zlib"]
+    for opt, val in opts:
+        if opt == "--progdir":
+            progdir = val
+        elif opt == "--files":
+            files = int(val)
+        elif opt == "--kb":
+            size = int(val) * 1024
+        elif opt == "--codecs":
+            CODECS = val.split(",")
+    if not args or any(name not in BENCHMARKS for name in args):
+        print(USAGE, file=sys.stderr)
+        sys.exit(1)
+    GITLITE = join(abspath(progdir), "gitlite")
+    START = os.getcwd()
+    for name in args:
+        BENCHMARKS[name](files, size)
@@ -0,0 +1,152 @@
+// Drives `gitlite batch` through a pipe: every command's output ends in
+// a NUL line, failing commands -- user errors and internal ones -- do not
+// end the session, and changes made by other processes between commands
+// are seen despite the cached repository state.
+
+#include "Utils.h"
+#include "cli.h"
+#include <csignal>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+/** A `gitlite batch` process with its standard input and output (and
+ *  standard error) connected to pipes. */
+class Session {
+private:
+    pid_t pid;
+    int in;
+    int out;
+    std::string pending;
+
+public:
+    explicit Session(const std::string& dir) {
+        int to[2], from[2];
+        if (pipe(to) != 0 || pipe(from) != 0) {
+            throw std::runtime_error("pipe");
+        }
+        pid = fork();
+        if (pid == 0) {
+            dup2(to[0], 0);
+            dup2(from[1], 1);
+            dup2(from[1], 2);
+            close(to[0]);
+            close(to[1]);
+            close(from[0]);
+            close(from[1]);
+            if (chdir(dir.c_str()) != 0) {
+                std::_Exit(127);
+            }
+            execl(cli::binary().c_str(), cli::binary().c_str(), "batch", static_cast<char*>(nullptr));
+            std::_Exit(127);
+        }
+        close(to[0]);
+        close(from[1]);
+        in = to[1];
+        out = from[0];
+    }
+
+    /** Sends LINE and returns the output up to the NUL line that ends it,
+     *  or everything until end of file if none comes. */
+    std::string command(const std::string& line) {
+        std::string text = line + "\n";
+        if (write(in, text.data(), text.size()) != static_cast<ssize_t>(text.size())) {
+            return "<write failed>";
+        }
+        std::string terminator("\0\n", 2);
+        size_t end;
+        while ((end = pending.find(terminator)) == std::string::npos) {
+            char buffer[4096];
+            ssize_t n = read(out, buffer, sizeof(buffer));
+            if (n <= 0) {
+                return pending + "<no terminator>";
+            }
+            pending.append(buffer, static_cast<size_t>(n));
+        }
+        std::string reply = pending.substr(0, end);
+        pending.erase(0, end + terminator.size());
+        return reply;
+    }
+
+    /** Closes standard input and returns the exit status, after checking
+     *  that nothing follows the last reply. */
+    int finish() {
+        close(in);
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(out, buffer, sizeof(buffer))) > 0) {
+            pending.append(buffer, static_cast<size_t>(n));
+        }
+        close(out);
+        int status = 0;
+        waitpid(pid, &status, 0);
+        check(pending.empty(), "no output after the last reply");
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: batch_test GITLITE" << std::endl;
+        return 2;
+    }
+    cli::setBinary(argv[1]);
+    signal(SIGPIPE, SIG_IGN);
+    std::string dir = cli::scratchDir("gitlite-batch-test");
+    auto file = [&](const std::string& name, const std::string& content) {
+        Utils::writeContents(Utils::join(dir, name), content);
+    };
+
+    Session batch(dir);
+    check(batch.command("init").empty(), "init");
+    file("a.txt", "a\n");
+    check(batch.command("add a.txt").empty(), "add");
+    check(batch.command("commit \"first commit\"").empty(), "commit with a quoted message");
+    std::string log = batch.command("log");
+    check(log.compare(0, 4, "===\n") == 0 && log.find("first commit\n") != std::string::npos, "log");
+    check(batch.command("\nlog") == log, "blank lines are skipped");
+
+    check(batch.command("checkout nosuch") == "No such branch exists.\n", "a failing command reports");
+    check(batch.command("bogus") == "No command with that name exists.\n", "an unknown command reports");
+    check(batch.command("batch") == "Incorrect operands.\n", "batch does not nest");
+    check(batch.command("log") == log, "the session goes on after failures");
+
+    // Changes by other processes between commands.
+    file("b.txt", "b\n");
+    check(cli::run(dir, {"add", "b.txt"}).status == 0, "add from another process");
+    check(batch.command("status").find("=== Staged Files ===\nb.txt\n") != std::string::npos,
+          "the stage is reread after another process changed it");
+    check(cli::run(dir, {"commit", "outside"}).status == 0 && cli::run(dir, {"branch", "side"}).status == 0,
+          "commit and branch from another process");
+    check(batch.command("log").find("outside\n") != std::string::npos, "the ref is reread");
+    check(batch.command("status").find("*master\nside\n\n=== Staged Files ===\n\n") != std::string::npos,
+          "new branches and the cleared stage are seen");
+    check(batch.command("checkout side").empty() && batch.command("checkout master").empty(),
+          "checkouts after outside changes");
+
+    std::string head = Utils::readContentsAsString(Utils::join(dir, ".gitlite/refs/master"));
+    Utils::writeContents(Utils::join(dir, ".gitlite/refs/master"), std::string(40, '0'));
+    check(batch.command("log").find("error: ") == 0, "an internal error is reported");
+    Utils::writeContents(Utils::join(dir, ".gitlite/refs/master"), head);
+    check(batch.command("log").find("outside\n") != std::string::npos, "the session goes on after an internal error");
+    check(batch.finish() == 0, "the session ends at end of input");
+
+    cli::removeTree(dir);
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all batch checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Helpers for tests that drive the gitlite binary: scratch directories
+// and running one command with its output captured.  The binary's path
+// is the first argument of the test, as CMakeLists.txt passes it.
+
+#ifndef TESTING_CLI_H
+#define TESTING_CLI_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <ftw.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+namespace cli {
+
+/** Absolute path of the gitlite binary under test. */
+inline std::string& binary() {
+    static std::string path;
+    return path;
+}
+
+/** Sets the binary under test to PATH, which may be relative. */
+inline void setBinary(const char* path) {
+    char* resolved = realpath(path, nullptr);
+    binary() = resolved != nullptr ? resolved : path;
+    free(resolved);
+}
+
+struct Result {
+    int status;
+    std::string out; // standard output and standard error, interleaved
+};
+
+/** Runs gitlite with ARGS in directory DIR, with the NAME=VALUE pairs of
+ *  ENV added to its environment, and waits for it. */
+inline Result run(const std::string& dir, const std::vector<std::string>& args,
+                  const std::vector<std::string>& env = {}) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return Result{-1, ""};
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], 1);
+        dup2(fds[1], 2);
+        close(fds[1]);
+        if (chdir(dir.c_str()) != 0) {
+            std::_Exit(127);
+        }
+        for (auto &e : env) {
+            putenv(const_cast<char*>(e.c_str()));
+        }
+        std::vector<char*> argv;
+        argv.push_back(const_cast<char*>(binary().c_str()));
+        for (auto &a : args) {
+            argv.push_back(const_cast<char*>(a.c_str()));
+        }
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        std::_Exit(127);
+    }
+    close(fds[1]);
+    Result r{-1, ""};
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        r.out.append(buffer, static_cast<size_t>(n));
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    r.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return r;
+}
+
+/** Creates a fresh directory below /tmp whose name starts with NAME. */
+inline std::string scratchDir(const std::string& name) {
+    std::string tmpl = "/tmp/" + name + "-XXXXXX";
+    return mkdtemp(&tmpl[0]);
+}
+
+/** Removes PATH and everything below it. */
+inline void removeTree(const std::string& path) {
+    nftw(path.c_str(), [](const char* p, const struct stat*, int, struct FTW*) {
+        return remove(p);
+    }, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+}
+
+#endif // TESTING_CLI_H
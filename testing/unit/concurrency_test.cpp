@@ -0,0 +1,174 @@
+// Runs gitlite writers and readers against one repository at once:
+// processes staging and committing their own files while others run
+// status, log, global-log and find.  No staged file may be lost, no
+// command may fail, and no lock may be left behind.
+
+#include "Utils.h"
+#include "cli.h"
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+static const int WRITERS = 4;
+static const int FILES = 8;
+static const int READERS = 4;
+
+static std::string fileName(int writer, int k) {
+    return "w" + std::to_string(writer) + "_" + std::to_string(k) + ".txt";
+}
+
+/** Runs WRITER(w) in WRITERS processes and READER() in READERS processes
+ *  until the writers are done; returns true if every process succeeded. */
+template <typename W, typename R>
+static bool race(W writer, R reader) {
+    auto* done = static_cast<std::atomic<int>*>(mmap(nullptr, sizeof(std::atomic<int>), PROT_READ | PROT_WRITE,
+                                                     MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    new (done) std::atomic<int>(0);
+    std::vector<pid_t> writers, readers;
+    for (int w = 0; w < WRITERS; w++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            bool ok = writer(w);
+            done->fetch_add(1);
+            std::_Exit(ok ? 0 : 1);
+        }
+        writers.push_back(pid);
+    }
+    for (int r = 0; r < READERS; r++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            bool ok = true;
+            while (ok && done->load() < WRITERS) {
+                ok = reader();
+            }
+            std::_Exit(ok ? 0 : 1);
+        }
+        readers.push_back(pid);
+    }
+    bool ok = true;
+    for (auto &list : {writers, readers}) {
+        for (pid_t pid : list) {
+            int status = 0;
+            waitpid(pid, &status, 0);
+            ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+    }
+    munmap(done, sizeof(std::atomic<int>));
+    return ok;
+}
+
+/** Runs one read-only command and checks that it succeeded. */
+static bool readOnce(const std::string& dir, int round) {
+    static const std::vector<std::vector<std::string>> commands = {
+        {"status"}, {"log"}, {"global-log"}, {"find", "initial commit"},
+    };
+    const std::vector<std::string>& command = commands[round % commands.size()];
+    cli::Result r = cli::run(dir, command);
+    bool listing = command[0] != "find";
+    if (r.status != 0 || r.out.find("error") != std::string::npos || (listing && r.out.compare(0, 3, "===") != 0)) {
+        std::cerr << command[0] << " got: " << r.out << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/** The lines of section TITLE of status output STATUS. */
+static std::string section(const std::string& status, const std::string& title) {
+    size_t pos = status.find("=== " + title + " ===\n");
+    if (pos == std::string::npos) {
+        return "?";
+    }
+    pos = status.find('\n', pos) + 1;
+    size_t end = status.find("\n\n", pos - 1);
+    return end < pos ? "" : status.substr(pos, end + 1 - pos);
+}
+
+static bool noLocks(const std::string& dir) {
+    for (auto &name : Utils::filesUnder(Utils::join(dir, ".gitlite"))) {
+        if (name.size() > 5 && name.compare(name.size() - 5, 5, ".lock") == 0) {
+            std::cerr << "left behind: " << name << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: concurrency_test GITLITE" << std::endl;
+        return 2;
+    }
+    cli::setBinary(argv[1]);
+    std::string dir = cli::scratchDir("gitlite-concurrency-test");
+    check(cli::run(dir, {"init"}).status == 0, "init");
+
+    int round = 0;
+    auto reader = [&] { return readOnce(dir, round++); };
+    bool ok = race([&](int w) {
+        for (int k = 0; k < FILES; k++) {
+            Utils::writeContents(Utils::join(dir, fileName(w, k)), "staged " + fileName(w, k) + "\n");
+            if (cli::run(dir, {"add", fileName(w, k)}).status != 0) {
+                return false;
+            }
+        }
+        return true;
+    }, reader);
+    check(ok, "concurrent adds and reads succeed");
+    std::string expected;
+    std::vector<std::string> names;
+    for (int w = 0; w < WRITERS; w++) {
+        for (int k = 0; k < FILES; k++) {
+            names.push_back(fileName(w, k));
+        }
+    }
+    std::sort(names.begin(), names.end());
+    for (auto &name : names) {
+        expected += name + "\n";
+    }
+    check(section(cli::run(dir, {"status"}).out, "Staged Files") == expected, "no staged file is lost");
+    check(noLocks(dir), "no lock is left after adding");
+    check(cli::run(dir, {"commit", "Staged files"}).status == 0, "commit the staged files");
+
+    ok = race([&](int w) {
+        for (int k = 0; k < FILES; k++) {
+            Utils::writeContents(Utils::join(dir, fileName(w, k)), "committed " + fileName(w, k) + "\n");
+            if (cli::run(dir, {"add", fileName(w, k)}).status != 0) {
+                return false;
+            }
+            // Another writer's commit may already have taken the file.
+            cli::Result r = cli::run(dir, {"commit", fileName(w, k)});
+            if (r.status != 0 || (!r.out.empty() && r.out != "No changes added to the commit.\n")) {
+                std::cerr << "commit got: " << r.out << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }, reader);
+    check(ok, "concurrent commits and reads succeed");
+    std::string status = cli::run(dir, {"status"}).out;
+    check(section(status, "Staged Files").empty() && section(status, "Modifications Not Staged For Commit").empty()
+          && section(status, "Untracked Files").empty(), "every change is committed");
+    check(noLocks(dir), "no lock is left after committing");
+
+    cli::removeTree(dir);
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all concurrency checks passed" << std::endl;
+    return 0;
+}
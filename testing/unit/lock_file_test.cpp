@@ -0,0 +1,126 @@
+// Stress-tests LockFile across processes: forked workers increment a
+// shared counter under the lock, and stale, torn and live locks are
+// told apart.
+
+#include "LockFile.h"
+#include "Utils.h"
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utime.h>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+static std::string hostName() {
+    char name[256] = {0};
+    gethostname(name, sizeof(name) - 1);
+    return name;
+}
+
+/** Runs BODY in a child process and returns its exit status. */
+template <typename F>
+static int inChild(F body) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::_Exit(body());
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void checkMutualExclusion(const std::string& dir) {
+    const int workers = 8, rounds = 100;
+    std::string counter = Utils::join(dir, "counter");
+    std::string lockPath = Utils::join(dir, "counter.lock");
+    Utils::writeContents(counter, "0");
+    std::vector<pid_t> pids;
+    for (int w = 0; w < workers; w++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            for (int r = 0; r < rounds; r++) {
+                LockFile lock(lockPath);
+                if (!lock.acquire(30000)) {
+                    std::_Exit(2);
+                }
+                int n = std::atoi(Utils::readContentsAsString(counter).c_str());
+                Utils::writeContents(counter, std::to_string(n + 1));
+            }
+            std::_Exit(0);
+        }
+        pids.push_back(pid);
+    }
+    for (pid_t pid : pids) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "worker finished");
+    }
+    check(Utils::readContentsAsString(counter) == std::to_string(workers * rounds),
+          "no lost increments");
+    check(!Utils::exists(lockPath), "lock released");
+}
+
+static void checkStaleAndLive(const std::string& dir) {
+    std::string lockPath = Utils::join(dir, "stale.lock");
+
+    pid_t dead = fork();
+    if (dead == 0) {
+        std::_Exit(0);
+    }
+    waitpid(dead, nullptr, 0);
+    Utils::writeContents(lockPath, std::to_string(dead) + " " + hostName() + "\n");
+    LockFile stale(lockPath);
+    check(stale.try_acquire(), "lock of a dead process is broken");
+    stale.release();
+
+    Utils::writeContents(lockPath, "");
+    LockFile torn(lockPath);
+    check(!torn.try_acquire(), "fresh empty lock is respected");
+    struct utimbuf old = {time(nullptr) - 3600, time(nullptr) - 3600};
+    utime(lockPath.c_str(), &old);
+    check(torn.try_acquire(), "old empty lock is broken");
+    torn.release();
+
+    LockFile live(lockPath);
+    check(live.try_acquire(), "free lock is taken");
+    check(inChild([&] {
+        LockFile other(lockPath);
+        return !other.try_acquire() && !other.acquire(50) ? 0 : 1;
+    }) == 0, "live lock is not broken");
+    live.release();
+
+    check(inChild([&] {
+        LockFile held(lockPath);
+        held.acquire(1000);
+        std::exit(0);
+        return 0;
+    }) == 0 && !Utils::exists(lockPath), "exit releases held locks");
+}
+
+int main() {
+    char tmpl[] = "/tmp/gitlite-lock-test-XXXXXX";
+    std::string dir = mkdtemp(tmpl);
+    checkMutualExclusion(dir);
+    checkStaleAndLive(dir);
+    for (auto &name : Utils::plainFilenamesIn(dir)) {
+        unlink(Utils::join(dir, name).c_str());
+    }
+    rmdir(dir.c_str());
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all lock checks passed" << std::endl;
+    return 0;
+}
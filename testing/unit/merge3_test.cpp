@@ -0,0 +1,165 @@
+// Checks that line diffs are valid and minimal against a quadratic
+// reference, that unified output has the usual hunk headers, and that
+// three-way merges keep non-overlapping edits from both sides and reduce
+// overlapping ones to minimal conflict regions.
+
+#include "Diff.h"
+#include "Merge3.h"
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+/** Length of the shortest insert/delete script from A to B. */
+static size_t editDistance(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+    std::vector<std::vector<size_t>> d(a.size() + 1, std::vector<size_t>(b.size() + 1));
+    for (size_t i = 0; i <= a.size(); i++) {
+        for (size_t j = 0; j <= b.size(); j++) {
+            if (i == 0 || j == 0) {
+                d[i][j] = i + j;
+            } else if (a[i - 1] == b[j - 1]) {
+                d[i][j] = d[i - 1][j - 1];
+            } else {
+                d[i][j] = std::min(d[i - 1][j], d[i][j - 1]) + 1;
+            }
+        }
+    }
+    return d[a.size()][b.size()];
+}
+
+static void checkDiffIsMinimal() {
+    std::mt19937 rng(1958);
+    for (int round = 0; round < 3000; round++) {
+        std::vector<uint32_t> a(rng() % 40), b(rng() % 40);
+        uint32_t alphabet = 1 + rng() % 6;
+        for (auto &x : a) {
+            x = rng() % alphabet;
+        }
+        for (auto &x : b) {
+            x = rng() % alphabet;
+        }
+        std::vector<Diff::Hunk> hunks = Diff::compute(a, b);
+        std::vector<uint32_t> patched;
+        size_t pos = 0, cost = 0;
+        bool ordered = true;
+        for (auto &h : hunks) {
+            ordered = ordered && h.a_begin >= pos && h.a_begin <= h.a_end
+                && h.b_begin <= h.b_end && h.b_end <= b.size()
+                && (h.a_begin < h.a_end || h.b_begin < h.b_end);
+            if (!ordered) {
+                break;
+            }
+            patched.insert(patched.end(), a.begin() + pos, a.begin() + h.a_begin);
+            patched.insert(patched.end(), b.begin() + h.b_begin, b.begin() + h.b_end);
+            cost += (h.a_end - h.a_begin) + (h.b_end - h.b_begin);
+            pos = h.a_end;
+        }
+        check(ordered, "hunks ordered in round " + std::to_string(round));
+        if (!ordered) {
+            continue;
+        }
+        patched.insert(patched.end(), a.begin() + pos, a.end());
+        check(patched == b, "hunks turn a into b in round " + std::to_string(round));
+        check(cost == editDistance(a, b), "minimal script in round " + std::to_string(round));
+    }
+}
+
+static void checkMerge(const std::string& base, const std::string& ours, const std::string& theirs,
+                       const std::string& expected, size_t conflicts, const std::string& what) {
+    Merge3::Result result = Merge3::merge(base, ours, theirs);
+    check(result.text == expected, what + ": text");
+    check(result.conflicts == conflicts, what + ": conflict count");
+}
+
+static void checkMergeCases() {
+    checkMerge("a\nb\nc\n", "A\nb\nc\n", "a\nb\nC\n", "A\nb\nC\n", 0, "disjoint edits");
+    checkMerge("a\nb\nc\n", "a\nX\nc\n", "a\nX\nc\n", "a\nX\nc\n", 0, "identical edits");
+    checkMerge("a\nb\nc\n", "a\nb\nc\nd\n", "a\nc\n", "a\nc\nd\n", 0, "append and delete");
+    checkMerge("a\nb\nc\n", "a\nX\nc\n", "a\nY\nc\n",
+               "a\n<<<<<<< HEAD\nX\n=======\nY\n>>>>>>>\nc\n", 1, "same line");
+    checkMerge("a\nb\nc\n", "a\nX\nk\nc\n", "a\nY\nk\nc\n",
+               "a\n<<<<<<< HEAD\nX\n=======\nY\n>>>>>>>\nk\nc\n", 1, "common tail trimmed");
+    checkMerge("", "x\n", "y\n", "<<<<<<< HEAD\nx\n=======\ny\n>>>>>>>\n", 1, "both added");
+    checkMerge("a\n", "a\nb", "a\nc", "a\n<<<<<<< HEAD\nb\n=======\nc\n>>>>>>>\n", 1,
+               "no final newline");
+    checkMerge("1\n2\n3\n4\n5\n", "1\nX\n3\n4\n5\n", "1\n2\n3\nY\n5\n", "1\nX\n3\nY\n5\n", 0,
+               "edits one line apart");
+    check(Merge3::is_binary(std::string("ab\0c", 4)), "NUL is binary");
+    check(!Merge3::is_binary("plain\ntext\n"), "text is not binary");
+}
+
+static void checkRandomDisjointEdits() {
+    std::mt19937 rng(7);
+    for (int round = 0; round < 500; round++) {
+        size_t n = 20 + rng() % 200;
+        std::vector<std::string> base, ours, theirs;
+        for (size_t i = 0; i < n; i++) {
+            base.push_back("line " + std::to_string(i) + "\n");
+        }
+        ours = theirs = base;
+        size_t half = n / 2;
+        for (int k = 0; k < 4; k++) {
+            ours[rng() % (half - 1)] = "ours " + std::to_string(k) + "\n";
+            theirs[half + 1 + rng() % (n - half - 1)] = "theirs " + std::to_string(k) + "\n";
+        }
+        std::string b, o, t, expected;
+        for (size_t i = 0; i < n; i++) {
+            b += base[i];
+            o += ours[i];
+            t += theirs[i];
+            expected += i < half ? ours[i] : theirs[i];
+        }
+        checkMerge(b, o, t, expected, 0, "disjoint random edits " + std::to_string(round));
+        checkMerge(b, o, b, o, 0, "only ours changed " + std::to_string(round));
+        checkMerge(b, b, t, t, 0, "only theirs changed " + std::to_string(round));
+    }
+}
+
+static void checkUnified() {
+    std::ostringstream out;
+    Diff::unified("a\nb\nc\nd\ne\nf\ng\nh\ni\nj\n", "a\nB\nc\nd\ne\nf\ng\nh\ni\nj", out, 1);
+    check(out.str() == "@@ -1,3 +1,3 @@\n a\n-b\n+B\n c\n"
+                       "@@ -9,2 +9,2 @@\n i\n-j\n+j\n\\ No newline at end of file\n",
+          "unified hunks with one line of context");
+    std::ostringstream added;
+    Diff::unified("", "x\n", added);
+    check(added.str() == "@@ -0,0 +1 @@\n+x\n", "unified new file");
+    std::ostringstream same;
+    Diff::unified("a\nb\n", "a\nb\n", same);
+    check(same.str().empty(), "unified equal texts");
+    std::string text;
+    for (int i = 0; i < 1000; i++) {
+        text += "line " + std::to_string(i % 37) + (i % 5 == 0 ? " with a longer tail\n" : "\n");
+    }
+    LineInterner interner;
+    std::vector<std::string_view> lines;
+    std::vector<uint32_t> ids = interner.intern(text, &lines);
+    std::string joined;
+    for (auto &line : lines) {
+        joined.append(line.data(), line.size());
+    }
+    check(ids.size() == 1000 && joined == text, "interned lines cover the text");
+    check(interner.size() == 74, "equal lines share an id");
+}
+
+int main() {
+    checkDiffIsMinimal();
+    checkUnified();
+    checkMergeCases();
+    checkRandomDisjointEdits();
+    if (failures == 0) {
+        std::cout << "all merge checks passed" << std::endl;
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,181 @@
+// Writes a repository the way gitlite did before typed object subtrees
+// and content-only blob ids -- flat objects, blobs keyed by file name and
+// content -- and checks that commands read it as it is, keeping its
+// commit ids, and that `gitlite migrate` rewrites it without losing
+// history or changing what checkouts produce.
+
+#include "Utils.h"
+#include "cli.h"
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+static const char* CLEAN_STATUS =
+    "=== Branches ===\n*master\nother\n\n"
+    "=== Staged Files ===\n\n"
+    "=== Removed Files ===\n\n"
+    "=== Modifications Not Staged For Commit ===\n\n"
+    "=== Untracked Files ===\n\n";
+
+/** A repository in the old format below DIR/.gitlite. */
+class LegacyRepo {
+private:
+    std::string objects;
+    std::string refs;
+
+public:
+    std::string dir;
+
+    explicit LegacyRepo(const std::string& root)
+        : objects(Utils::join(root, ".gitlite", "objects")), refs(Utils::join(root, ".gitlite", "refs")), dir(root) {
+        Utils::createDirectories(objects);
+        Utils::createDirectories(refs);
+        Utils::writeContents(Utils::join(root, ".gitlite", "HEAD"), "master");
+    }
+
+    std::string blob(const std::string& name, const std::string& content) const {
+        std::string id = Utils::sha1(name, content);
+        Utils::writeContents(Utils::join(objects, id), id + "\n" + name + "\n" + content);
+        return id;
+    }
+
+    std::string initialCommit() const {
+        std::string id = Utils::sha1("initial commit|0");
+        Utils::writeContents(Utils::join(objects, id), id + "\ninitial commit\n0\n");
+        return id;
+    }
+
+    std::string commit(const std::string& message, long timestamp, const std::vector<std::string>& formers,
+                       const std::map<std::string, std::string>& files) const {
+        std::ostringstream key;
+        key << message << "|" << timestamp;
+        for (auto &f : formers) {
+            key << "|" << f;
+        }
+        for (auto &f : files) {
+            key << "|" << f.first << ":" << f.second;
+        }
+        std::string id = Utils::sha1(key.str());
+        std::ostringstream raw;
+        raw << id << "\n" << message << "\n" << timestamp << "\n";
+        for (auto &f : formers) {
+            raw << "F " << f << "\n";
+        }
+        for (auto &f : files) {
+            raw << "B " << f.first << "|" << f.second << "\n";
+        }
+        Utils::writeContents(Utils::join(objects, id), raw.str());
+        return id;
+    }
+
+    std::string ref(const std::string& branch) const {
+        return Utils::readContentsAsString(Utils::join(refs, branch));
+    }
+
+    void setRef(const std::string& branch, const std::string& id) const {
+        Utils::writeContents(Utils::join(refs, branch), id);
+    }
+
+    std::string file(const std::string& name) const {
+        return Utils::readContentsAsString(Utils::join(dir, name));
+    }
+
+    void setFile(const std::string& name, const std::string& content) const {
+        Utils::writeContents(Utils::join(dir, name), content);
+    }
+};
+
+/** The commit ids a log or global-log output lists, in order. */
+static std::vector<std::string> loggedIds(const std::string& out) {
+    std::vector<std::string> ids;
+    std::istringstream in(out);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.rfind("commit ", 0) == 0) {
+            ids.push_back(line.substr(7));
+        }
+    }
+    return ids;
+}
+
+/** Checks out branch other and back, and an old version of a.txt. */
+static void checkCheckouts(const LegacyRepo& repo, const std::string& first, const std::string& when) {
+    check(cli::run(repo.dir, {"checkout", "other"}).status == 0, "checkout other " + when);
+    check(repo.file("a.txt") == "apple\n" && repo.file("b.txt") == "blueberry\n"
+          && !Utils::exists(Utils::join(repo.dir, "c.txt")), "files of other " + when);
+    check(cli::run(repo.dir, {"checkout", "master"}).status == 0, "checkout master " + when);
+    check(repo.file("a.txt") == "apricot\n" && repo.file("b.txt") == "banana\n"
+          && repo.file("c.txt") == "banana\n", "files of master " + when);
+    cli::run(repo.dir, {"checkout", first, "--", "a.txt"});
+    check(repo.file("a.txt") == "apple\n", "checkout of a file in an old commit " + when);
+    cli::run(repo.dir, {"checkout", "--", "a.txt"});
+    check(cli::run(repo.dir, {"status"}).out == CLEAN_STATUS, "clean status " + when);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: migrate_test GITLITE" << std::endl;
+        return 2;
+    }
+    cli::setBinary(argv[1]);
+    std::string root = cli::scratchDir("gitlite-migrate-test");
+    LegacyRepo repo(root);
+
+    std::string initial = repo.initialCommit();
+    std::map<std::string, std::string> files = {
+        {"a.txt", repo.blob("a.txt", "apple\n")},
+        {"b.txt", repo.blob("b.txt", "banana\n")},
+    };
+    std::string first = repo.commit("Add a and b", 1700000000, {initial}, files);
+    std::map<std::string, std::string> other = files;
+    other["b.txt"] = repo.blob("b.txt", "blueberry\n");
+    std::string side = repo.commit("Other", 1700000050, {first}, other);
+    files["a.txt"] = repo.blob("a.txt", "apricot\n");
+    files["c.txt"] = repo.blob("c.txt", "banana\n");
+    std::string head = repo.commit("Change a", 1700000100, {first}, files);
+    repo.setRef("master", head);
+    repo.setRef("other", side);
+    repo.setFile("a.txt", "apricot\n");
+    repo.setFile("b.txt", "banana\n");
+    repo.setFile("c.txt", "banana\n");
+
+    cli::Result log = cli::run(root, {"log"});
+    check(log.status == 0, "log of a legacy repository");
+    check(loggedIds(log.out) == std::vector<std::string>{head, first, initial}, "legacy commit ids are kept");
+    check(Utils::plainFilenamesIn(Utils::join(root, ".gitlite", "objects")).empty(),
+          "no flat objects are left");
+    check(cli::run(root, {"status"}).out == CLEAN_STATUS, "legacy blobs match unchanged files");
+    checkCheckouts(repo, first, "before migrate");
+
+    check(cli::run(root, {"migrate"}).status == 0, "migrate");
+    log = cli::run(root, {"log"});
+    std::vector<std::string> ids = loggedIds(log.out);
+    check(ids.size() == 3 && ids[2] == initial, "history keeps its length and root");
+    check(log.out.find("Change a") < log.out.find("Add a and b")
+          && log.out.find("Add a and b") < log.out.find("initial commit"), "messages in order");
+    check(loggedIds(cli::run(root, {"global-log"}).out).size() == 4, "rewritten commits replace the old ones");
+    check(ids.size() == 3 && ids[0] != head, "commits naming old blobs are rewritten");
+    check(cli::run(root, {"find", "Other"}).out == repo.ref("other") + "\n", "branches move to the rewritten commits");
+    checkCheckouts(repo, ids.size() == 3 ? ids[1] : first, "after migrate");
+    check(cli::run(root, {"migrate"}).status == 0
+          && loggedIds(cli::run(root, {"log"}).out) == ids, "migrating again changes nothing");
+
+    cli::removeTree(root);
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all migrate checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Checks that deltas rebuild their targets, including inputs shorter
+// than a block and long runs copied from the base, and that packs read
+// back every object they were written with, through chains of deltas,
+// while rejecting entries that are not in ObjectCodec form.
+
+#include "Delta.h"
+#include "ObjectCodec.h"
+#include "Pack.h"
+#include "Utils.h"
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+static std::string randomBytes(std::mt19937& rng, size_t n) {
+    std::string s(n, '\0');
+    for (auto &c : s) {
+        c = static_cast<char>(rng() & 0xff);
+    }
+    return s;
+}
+
+static void checkRoundTrip(const std::string& base, const std::string& target, const std::string& what) {
+    std::string delta = Delta::create(base, target);
+    check(Delta::apply(base, delta) == target, what);
+}
+
+static void checkDeltas() {
+    std::mt19937 rng(7);
+    checkRoundTrip("", "", "empty base and target");
+    checkRoundTrip("", "short", "empty base");
+    checkRoundTrip("short", "", "empty target");
+    checkRoundTrip("abc", "abd", "inputs shorter than a block");
+    checkRoundTrip("0123456789abcdef", "0123456789abcdef", "input of exactly one block");
+    checkRoundTrip("0123456789abcdef!", "x0123456789abcdef", "one block at an offset");
+
+    std::string base = randomBytes(rng, 1 << 20);
+    std::string target = base;
+    target[target.size() / 2] ^= 1;
+    std::string delta = Delta::create(base, target);
+    check(Delta::apply(base, delta) == target, "long copy runs around an edit");
+    check(delta.size() < 1024, "long copy runs are copied, not inserted");
+
+    std::string shuffled = base.substr(base.size() / 2) + randomBytes(rng, 100) + base.substr(0, base.size() / 2);
+    checkRoundTrip(base, shuffled, "moved halves with an insert between");
+    checkRoundTrip(base, randomBytes(rng, 4096), "unrelated target");
+
+    for (int round = 0; round < 200; round++) {
+        std::string b = randomBytes(rng, rng() % 200);
+        std::string t = b;
+        for (int edits = rng() % 4; edits > 0; edits--) {
+            size_t at = t.empty() ? 0 : rng() % t.size();
+            if (rng() % 2 == 0 && !t.empty()) {
+                t.erase(at, rng() % 20);
+            } else {
+                t.insert(at, randomBytes(rng, rng() % 20));
+            }
+        }
+        checkRoundTrip(b, t, "random small edit " + std::to_string(round));
+    }
+
+    bool threw = false;
+    try {
+        Delta::apply("base", delta);
+    } catch (const std::exception&) {
+        threw = true;
+    }
+    check(threw, "a delta is not applied to the wrong base");
+}
+
+static std::string objectId(int i) {
+    return Utils::sha1("object", std::to_string(i));
+}
+
+static void checkPack(const std::string& dir) {
+    std::mt19937 rng(11);
+    std::map<std::string, std::string> contents;
+    std::vector<Pack::Object> objects;
+    std::string text = randomBytes(rng, 8192);
+    for (int i = 0; i < 30; i++) {
+        text.replace(rng() % text.size(), 8, randomBytes(rng, 8));
+        objects.push_back(Pack::Object{ObjectType::Blob, objectId(i)});
+        contents[objectId(i)] = text;
+    }
+    objects.push_back(Pack::Object{ObjectType::Commit, objectId(100)});
+    contents[objectId(100)] = "a commit";
+
+    std::string path = Pack::write(dir, objects, [&](ObjectType, const std::string& id) {
+        return contents.at(id);
+    });
+    {
+        Pack pack(path);
+        for (auto &o : objects) {
+            std::string data;
+            check(pack.read(o.type, o.id, data) && data == contents[o.id], "object reads back: " + o.id);
+        }
+        std::string data;
+        check(!pack.read(ObjectType::Blob, objectId(100), data), "type is part of the key");
+        check(!pack.contains(ObjectType::Blob, objectId(200)), "absent object");
+        std::vector<std::string> commits;
+        pack.ids(ObjectType::Commit, commits);
+        check(commits == std::vector<std::string>{objectId(100)}, "ids by type");
+        check(Utils::readContentsAsString(path).size() < 30 * 8192 / 4, "similar blobs are stored as deltas");
+    }
+
+    std::string bytes = Utils::readContentsAsString(path);
+    size_t magic = bytes.find("\x7fGLO");
+    check(magic != std::string::npos, "entries are in ObjectCodec form");
+    bytes[magic] = 'x';
+    Utils::writeContents(path, bytes);
+    Pack pack(path);
+    bool threw = false;
+    try {
+        std::string data;
+        pack.read(objects[0].type, objects[0].id, data);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    check(threw, "an entry without the ObjectCodec header is rejected");
+}
+
+int main() {
+    checkDeltas();
+    char tmpl[] = "/tmp/gitlite-pack-test-XXXXXX";
+    std::string dir = mkdtemp(tmpl);
+    checkPack(dir);
+    for (auto &name : Utils::plainFilenamesIn(dir)) {
+        unlink(Utils::join(dir, name).c_str());
+    }
+    rmdir(dir.c_str());
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all pack checks passed" << std::endl;
+    return 0;
+}
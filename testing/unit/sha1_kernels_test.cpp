@@ -0,0 +1,79 @@
+// Cross-checks every SHA-1 kernel available on this CPU against the
+// reference kernel, and the streaming hasher against known digests.
+
+#include "Sha1Kernels.h"
+#include "Utils.h"
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+static void checkKernelsAgree() {
+    std::vector<SHA1::Kernel> kernels = SHA1::availableKernels();
+    const SHA1::Kernel& reference = kernels.front();
+    std::mt19937 rng(1958);
+    std::vector<uint8_t> data(64 * 37);
+    for (auto &b : data) {
+        b = static_cast<uint8_t>(rng());
+    }
+    for (size_t blocks = 1; blocks <= 37; blocks++) {
+        uint32_t expected[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+        reference.compress(expected, data.data(), blocks);
+        for (auto &k : kernels) {
+            uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+            k.compress(state, data.data(), blocks);
+            check(std::memcmp(state, expected, sizeof(state)) == 0,
+                  std::string(k.name) + " on " + std::to_string(blocks) + " blocks");
+        }
+    }
+}
+
+static void checkKnownDigests() {
+    check(Utils::sha1("") == "da39a3ee5e6b4b0d3255bfef95601890afd80709", "empty message");
+    check(Utils::sha1("abc") == "a9993e364706816aba3e25717850c26c9cd0d89d", "\"abc\"");
+    check(Utils::sha1("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq")
+          == "84983e441c3bd26ebaae4aa1f95129e5e54670f1", "448-bit message");
+    check(Utils::sha1(std::string(1000000, 'a')) == "34aa973cd4c4daa4f61eeb2bdbad27316534016f",
+          "one million 'a'");
+}
+
+static void checkStreamingMatchesOneShot() {
+    std::mt19937 rng(42);
+    std::string message(10000, '\0');
+    for (auto &c : message) {
+        c = static_cast<char>(rng());
+    }
+    for (size_t len : {0, 1, 55, 56, 63, 64, 65, 127, 128, 129, 1000, 10000}) {
+        std::string part = message.substr(0, len);
+        SHA1::SHA sha;
+        for (size_t pos = 0, step = 1; pos < len; pos += step, step = step * 7 % 61 + 1) {
+            sha.update(part.data() + pos, std::min(step, len - pos));
+        }
+        check(sha.final() == Utils::sha1(part), "streaming " + std::to_string(len) + " bytes");
+    }
+}
+
+int main() {
+    checkKernelsAgree();
+    checkKnownDigests();
+    checkStreamingMatchesOneShot();
+    for (auto &k : SHA1::availableKernels()) {
+        std::cout << "kernel " << k.name << std::endl;
+    }
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all SHA-1 checks passed" << std::endl;
+    return 0;
+}
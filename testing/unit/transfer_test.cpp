@@ -0,0 +1,157 @@
+// Moves history between repositories: bundles that are truncated or have
+// any byte of their pack or index flipped are refused without leaving a
+// pack behind, and push and fetch copy loose objects below
+// GITLITE_UNPACK_LIMIT and a pack above it, with the same result.
+
+#include "Utils.h"
+#include "cli.h"
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+static std::string objectDir(const std::string& dir, const std::string& sub) {
+    return Utils::join(dir, ".gitlite/objects", sub);
+}
+
+/** The number of files in the pack directory of the repository in DIR. */
+static size_t packFiles(const std::string& dir) {
+    std::string packs = objectDir(dir, "pack");
+    return Utils::isDirectory(packs) ? Utils::plainFilenamesIn(packs).size() : 0;
+}
+
+static size_t looseCommits(const std::string& dir) {
+    return Utils::filesUnder(objectDir(dir, "commits")).size();
+}
+
+static std::string repository(const std::string& root, const std::string& name) {
+    std::string dir = Utils::join(root, name);
+    Utils::createDirectories(dir);
+    check(cli::run(dir, {"init"}).status == 0, "init " + name);
+    return dir;
+}
+
+/** Makes three commits of four files each in DIR; returns the log. */
+static std::string makeHistory(const std::string& dir) {
+    for (int c = 0; c < 3; c++) {
+        for (int f = 0; f < 4; f++) {
+            std::string name = "f" + std::to_string(f) + ".txt";
+            Utils::writeContents(Utils::join(dir, name), "version " + std::to_string(c) + " of " + name + "\n");
+            cli::run(dir, {"add", name});
+        }
+        check(cli::run(dir, {"commit", "commit " + std::to_string(c)}).status == 0, "commit");
+    }
+    return cli::run(dir, {"log"}).out;
+}
+
+static void checkBundles(const std::string& root, const std::string& source) {
+    std::string file = Utils::join(root, "all.bundle");
+    check(cli::run(source, {"bundle", "create", file}).status == 0, "bundle create");
+    std::string bytes = Utils::readContentsAsString(file);
+    std::string head = Utils::readContentsAsString(Utils::join(source, ".gitlite/refs/master"));
+    std::string listed = head + " master\n";
+
+    std::string target = repository(root, "unbundled");
+    std::string bad = Utils::join(root, "bad.bundle");
+    for (size_t size : {size_t(0), size_t(4), bytes.size() / 2, bytes.size() - 1}) {
+        Utils::writeContents(bad, bytes.substr(0, size));
+        check(cli::run(target, {"bundle", "unbundle", bad}).out == "Not a bundle file.\n",
+              "a bundle cut to " + std::to_string(size) + " bytes is refused");
+    }
+
+    // The pack and its index end the bundle, followed by their lengths.
+    const unsigned char* trailer = reinterpret_cast<const unsigned char*>(bytes.data() + bytes.size() - 16);
+    uint64_t pack_size = Utils::getU64(trailer);
+    uint64_t index_size = Utils::getU64(trailer + 8);
+    size_t pack_start = bytes.size() - 16 - index_size - pack_size;
+    size_t index_start = pack_start + pack_size;
+    for (size_t pos = pack_start; pos < index_start + index_size; pos++) {
+        std::string flipped = bytes;
+        flipped[pos] ^= 1;
+        Utils::writeContents(bad, flipped);
+        std::string where = (pos < index_start ? "pack byte " + std::to_string(pos - pack_start)
+                                               : "index byte " + std::to_string(pos - index_start));
+        check(cli::run(target, {"bundle", "unbundle", bad}).out == "Bad bundle file.\n",
+              "a bundle with a flipped " + where + " is refused");
+        check(packFiles(target) == 0, "no pack is left after a flipped " + where);
+    }
+    check(cli::run(target, {"find", "commit 2"}).out == "Found no commit with that message.\n",
+          "refused bundles bring no commits");
+
+    check(cli::run(target, {"bundle", "unbundle", file}).out == listed, "the intact bundle is accepted");
+    check(packFiles(target) == 2, "the intact bundle installs its pack");
+    check(cli::run(target, {"checkout", head, "--", "f0.txt"}).status == 0
+          && Utils::readContentsAsString(Utils::join(target, "f0.txt")) == "version 2 of f0.txt\n",
+          "files of the unbundled history");
+    std::string flipped = bytes;
+    flipped[index_start + 20] ^= 1;
+    Utils::writeContents(bad, flipped);
+    check(cli::run(target, {"bundle", "unbundle", bad}).out == "Bad bundle file.\n"
+          && packFiles(target) == 2, "a bad bundle leaves the packs installed before");
+    flipped = bytes;
+    flipped[index_start - 1] ^= 1;
+    Utils::writeContents(bad, flipped);
+    check(cli::run(target, {"bundle", "unbundle", bad}).out == listed && packFiles(target) == 2,
+          "a bundle whose pack is installed already keeps the installed copy");
+}
+
+/** Fetches and pushes the history of SOURCE with unpack limit LIMIT into
+ *  new repositories; PACKED says whether the objects should arrive as a
+ *  pack. */
+static void checkTransfer(const std::string& root, const std::string& source, const std::string& log,
+                          const std::string& limit, bool packed) {
+    std::vector<std::string> env = {"GITLITE_UNPACK_LIMIT=" + limit};
+    std::string what = " with unpack limit " + limit;
+
+    std::string fetched = repository(root, "fetched-" + limit);
+    cli::run(fetched, {"add-remote", "origin", Utils::join(source, ".gitlite")});
+    check(cli::run(fetched, {"fetch", "origin", "master"}, env).out.empty(), "fetch" + what);
+    check((packFiles(fetched) > 0) == packed, "fetched objects are " + std::string(packed ? "packed" : "loose") + what);
+    check(looseCommits(fetched) == (packed ? 1u : 4u), "commits fetched" + what);
+    check(cli::run(fetched, {"checkout", "origin/master"}).status == 0
+          && cli::run(fetched, {"log"}).out == log, "fetched history" + what);
+    check(Utils::readContentsAsString(Utils::join(fetched, "f3.txt")) == "version 2 of f3.txt\n",
+          "fetched files" + what);
+
+    std::string pushed = repository(root, "pushed-" + limit);
+    cli::run(source, {"add-remote", "to-" + limit, Utils::join(pushed, ".gitlite")});
+    check(cli::run(source, {"push", "to-" + limit, "master"}, env).out.empty(), "push" + what);
+    check((packFiles(pushed) > 0) == packed, "pushed objects are " + std::string(packed ? "packed" : "loose") + what);
+    check(cli::run(pushed, {"log"}).out == log, "pushed history" + what);
+    check(cli::run(pushed, {"reset", Utils::readContentsAsString(Utils::join(source, ".gitlite/refs/master"))}).status == 0
+          && Utils::readContentsAsString(Utils::join(pushed, "f1.txt")) == "version 2 of f1.txt\n",
+          "pushed files" + what);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: transfer_test GITLITE" << std::endl;
+        return 2;
+    }
+    cli::setBinary(argv[1]);
+    std::string root = cli::scratchDir("gitlite-transfer-test");
+    std::string source = repository(root, "source");
+    std::string log = makeHistory(source);
+
+    checkBundles(root, source);
+    // Three commits bring 3 commits, 3 trees and 12 blobs.
+    checkTransfer(root, source, log, "1000", false);
+    checkTransfer(root, source, log, "10", true);
+
+    cli::removeTree(root);
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all transfer checks passed" << std::endl;
+    return 0;
+}